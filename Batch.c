@@ -0,0 +1,430 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "Emulator.h"
+
+// A manifest line names a program (a source file or a .pimg image), an input file ('-' for none) and an optional
+// memory size in words, lines starting with ';' are comments
+typedef struct
+{
+	CHAR program[MAX_PATH];	// Program file
+	CHAR input[MAX_PATH];	// Input file, '-' for no input
+	ULONG memory;			// Memory size in words
+	LPPROGRAM shared;		// Assembled program, shared by all jobs running the same file
+	ULONG error;			// Error that kept the job from running
+	ULONG exception;		// Exception the job stopped with
+	ULONG address;			// Program counter when the job stopped
+	ULONGLONG retired;		// Number of retired instructions
+	ULONG committed;		// Number of memory pages committed when the job stopped (EMULATOR_FLAG_SPARSE)
+	ULONG pages;			// Number of pages the memory spans
+	LPBYTE output;			// Collected guest output
+	ULONG size;				// Number of characters in output
+} BATCHJOB,*LPBATCHJOB;
+
+typedef struct
+{
+	LPBATCHJOB jobs;
+	ULONG count;
+	LONG next;				// Number of jobs taken by the slots
+	LPSCHEDULER scheduler;
+	LPEVENTLOOP loop;		// Event loop reading the input files of the jobs
+	ULONG flags;
+	ULONGLONG quota;		// Instruction quota of every job, 0 for no limit
+	ULONG timeout;			// Wall time quota of every job in milliseconds, 0 for no limit
+	LPCSTR samples;			// File the sample histograms are appended to, NULL if they are not kept
+	LPCSTR cache;			// Directory of the assembled program cache, NULL if the programs are always assembled
+} BATCH,*LPBATCH;
+
+// A job in flight, the emulator runs the jobs the slot takes one after the other
+typedef struct
+{
+	LPBATCH batch;
+	EMULATOR emulator;
+	ULONG job;				// Job the emulator runs
+	HANDLE input;			// Input file of the job, INVALID_HANDLE_VALUE for no input
+} BATCHSLOT,*LPBATCHSLOT;
+
+static BOOL IsProgramImage(LPCSTR path)
+{
+	SIZE_T length = strlen(path);
+
+	return length >= 5 && !_stricmp(path + length - 5, ".pimg");
+}
+
+// Prepares the emulator of the slot for a job, an emulator left by a job running the same program with the same memory
+// size is reset to the loaded program, other emulators are replaced
+static BOOL PrepareBatchJob(LPBATCH batch, LPBATCHJOB job, LPBATCHSLOT slot)
+{
+	LPEMULATOR emulator = &slot->emulator;
+
+	slot->input = INVALID_HANDLE_VALUE;
+
+	if(!job->shared)
+		return FALSE;
+
+	// The profile and sample counts are kept for every job on its own
+	if(emulator->memory && (emulator->program != job->shared || emulator->capacity != job->memory || batch->flags & (EMULATOR_FLAG_PROFILE | EMULATOR_FLAG_SAMPLE)))
+		UninitializeEmulator(emulator);
+
+	if(emulator->memory)
+	{
+		if(!ResetEmulator(emulator))
+		{
+			job->error = emulator->error;
+
+			UninitializeEmulator(emulator);
+			return FALSE;
+		}
+	}
+	else
+	{
+		if(!InitializeEmulatorEx(emulator, job->memory, batch->flags))
+		{
+			job->error = EMULATOR_ERROR_NO_MEMORY;
+			return FALSE;
+		}
+
+		if(!AttachProgram(emulator, job->shared))
+		{
+			job->error = emulator->error ? emulator->error : EMULATOR_ERROR_NO_MEMORY;
+
+			UninitializeEmulator(emulator);
+			return FALSE;
+		}
+	}
+
+	if(!SetEmulatorOutput(emulator, NULL))
+	{
+		job->error = EMULATOR_ERROR_NO_MEMORY;
+
+		UninitializeEmulator(emulator);
+		return FALSE;
+	}
+
+	// An invalid input handle reads as an empty input
+	if(!strcmp(job->input, "-"))
+	{
+		SetEmulatorInput(emulator, slot->input);
+		return TRUE;
+	}
+
+	// Files and named pipes alike are read by the event loop, so a job waiting for input never blocks a thread
+	slot->input = CreateFile(job->input, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, NULL);
+	if(slot->input == INVALID_HANDLE_VALUE || !SetEmulatorInputChannel(emulator, slot->input, batch->loop))
+	{
+		if(slot->input != INVALID_HANDLE_VALUE)
+			CloseHandle(slot->input);
+
+		slot->input = INVALID_HANDLE_VALUE;
+
+		job->error = EMULATOR_ERROR_FILE_OPEN;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// The input state belongs to the job
+static VOID ReleaseBatchInput(LPBATCHSLOT slot)
+{
+	UninitializeEmulatorInput(&slot->emulator);
+
+	if(slot->input != INVALID_HANDLE_VALUE)
+		CloseHandle(slot->input);
+}
+
+static VOID CALLBACK FinishBatchJob(LPEMULATOR emulator, ULONGLONG retired, LPVOID context);
+
+// Schedules the next job nobody took yet on the emulator of the slot, the emulator is freed once every job was taken
+static VOID StartBatchJob(LPBATCHSLOT slot)
+{
+	LPBATCH batch = slot->batch;
+	LPBATCHJOB job;
+
+	for(;;)
+	{
+		slot->job = (ULONG)InterlockedIncrement(&batch->next) - 1;
+		if(slot->job >= batch->count)
+			break;
+
+		job = &batch->jobs[slot->job];
+
+		if(!PrepareBatchJob(batch, job, slot))
+			continue;
+
+		if(ScheduleEmulator(batch->scheduler, &slot->emulator, batch->quota, batch->timeout, FinishBatchJob, slot))
+			return;
+
+		job->error = slot->emulator.error;
+
+		ReleaseBatchInput(slot);
+		UninitializeEmulator(&slot->emulator);
+	}
+
+	UninitializeEmulator(&slot->emulator);
+}
+
+// Called by the scheduler once the job of the slot stopped
+static VOID CALLBACK FinishBatchJob(LPEMULATOR emulator, ULONGLONG retired, LPVOID context)
+{
+	LPBATCHSLOT slot = context;
+	LPBATCH batch = slot->batch;
+	LPBATCHJOB job = &batch->jobs[slot->job];
+
+	job->retired = retired;
+	job->exception = emulator->exception;
+	job->address = emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+
+	if(batch->flags & EMULATOR_FLAG_SPARSE)
+		job->committed = GetCommittedMemoryPages(emulator, &job->pages);
+
+	if(batch->samples)
+	{
+		CHAR title[MAX_PATH + 32];
+
+		sprintf(title, "job %u (%s)", slot->job, job->program);
+		SaveSamplesToFile(emulator, batch->samples, title);
+	}
+
+	// Take over the collected output
+	job->output = emulator->output.buffer;
+	job->size = emulator->output.used;
+	emulator->output.buffer = NULL;
+	emulator->output.used = 0;
+
+	ReleaseBatchInput(slot);
+
+	StartBatchJob(slot);
+}
+
+// Assembles every distinct program once, with the largest memory size of the jobs running it
+static VOID AssembleBatchPrograms(LPBATCH batch)
+{
+	EMULATOR emulator;
+	ULONG memory;
+	ULONG error;
+	ULONG index;
+	ULONG other;
+	BOOL result;
+	LPPROGRAM program;
+
+	for(index = 0; index < batch->count; ++index)
+	{
+		if(batch->jobs[index].shared || batch->jobs[index].error)
+			continue;
+
+		memory = batch->jobs[index].memory;
+		for(other = index + 1; other < batch->count; ++other)
+			if(!strcmp(batch->jobs[other].program, batch->jobs[index].program) && batch->jobs[other].memory > memory)
+				memory = batch->jobs[other].memory;
+
+		program = NULL;
+		error = EMULATOR_ERROR_NO_MEMORY;
+
+		// The memory the program is loaded into is as sparse as the memory of the jobs
+		if(InitializeEmulatorEx(&emulator, memory, batch->flags & EMULATOR_FLAG_SPARSE))
+		{
+			SetEmulatorCache(&emulator, batch->cache);
+
+			if(IsProgramImage(batch->jobs[index].program))
+				result = LoadProgramFromFile(&emulator, batch->jobs[index].program);
+			else
+				result = LoadProgramFromSourceFile(&emulator, batch->jobs[index].program);
+
+			if(result)
+			{
+				program = CreateProgram(&emulator);
+
+				// Keep a reference for the batch after the loading emulator is gone
+				if(program)
+					InterlockedIncrement(&program->references);
+			}
+			else
+				error = emulator.error;
+
+			UninitializeEmulator(&emulator);
+		}
+
+		for(other = index; other < batch->count; ++other)
+		{
+			if(strcmp(batch->jobs[other].program, batch->jobs[index].program))
+				continue;
+
+			batch->jobs[other].shared = program;
+			if(!program)
+				batch->jobs[other].error = error;
+		}
+	}
+}
+
+static BOOL ReadBatchManifest(LPBATCH batch, LPCSTR manifest)
+{
+	FILE* file;
+	CHAR line[2 * MAX_PATH + 64];
+	LPBATCHJOB jobs;
+	ULONG capacity = 0;
+	ULONG memory;
+	int fields;
+
+	file = fopen(manifest, "r");
+	if(!file)
+		return FALSE;
+
+	while(fgets(line, sizeof(line), file))
+	{
+		if(line[0] == ';' || line[0] == '\r' || line[0] == '\n' || !line[0])
+			continue;
+
+		if(batch->count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 64;
+
+			if(batch->jobs)
+				jobs = HeapReAlloc(GetProcessHeap(), 0, batch->jobs, capacity * sizeof(BATCHJOB));
+			else
+				jobs = HeapAlloc(GetProcessHeap(), 0, capacity * sizeof(BATCHJOB));
+
+			if(!jobs)
+			{
+				fclose(file);
+				return FALSE;
+			}
+
+			batch->jobs = jobs;
+		}
+
+		ZeroMemory(&batch->jobs[batch->count], sizeof(BATCHJOB));
+
+		memory = EMULATOR_DEFAULT_MEMORY;
+		fields = sscanf(line, "%259s %259s %i", batch->jobs[batch->count].program, batch->jobs[batch->count].input, &memory);
+		if(fields < 1)
+			continue;
+
+		if(fields < 2)
+			strcpy(batch->jobs[batch->count].input, "-");
+
+		batch->jobs[batch->count].memory = memory ? memory : EMULATOR_DEFAULT_MEMORY;
+		++batch->count;
+	}
+
+	fclose(file);
+	return TRUE;
+}
+
+BOOL RunBatch(LPCSTR manifest, ULONG flags, ULONG threads, LPCSTR samples, LPCSTR cache, ULONG slice, ULONG guests, ULONGLONG quota, ULONG timeout)
+{
+	BATCH batch;
+	SYSTEM_INFO information;
+	LPBATCHSLOT slots = NULL;
+	ULONG index;
+	BOOL result = FALSE;
+
+	ZeroMemory(&batch, sizeof(batch));
+	batch.flags = flags;
+	batch.quota = quota;
+	batch.timeout = timeout;
+	batch.samples = samples;
+	batch.cache = cache;
+
+	if(!ReadBatchManifest(&batch, manifest))
+		goto cleanup;
+
+	AssembleBatchPrograms(&batch);
+
+	if(!threads)
+	{
+		GetSystemInfo(&information);
+		threads = information.dwNumberOfProcessors;
+	}
+
+	// A few jobs in flight for every thread keep the threads busy while some of the jobs wait for input
+	if(!guests)
+		guests = threads * EMULATOR_BATCH_GUESTS;
+
+	if(guests > batch.count)
+		guests = batch.count;
+
+	// Threads without a job to run would only wait
+	if(threads > guests && guests)
+		threads = guests;
+
+	slots = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, guests * sizeof(BATCHSLOT));
+	if(!slots)
+		goto cleanup;
+
+	batch.loop = CreateEventLoop();
+	if(!batch.loop)
+		goto cleanup;
+
+	batch.scheduler = CreateScheduler(threads, slice);
+	if(!batch.scheduler)
+		goto cleanup;
+
+	// Every slot runs a job at a time and takes the next job once it finished, in manifest order
+	for(index = 0; index < guests; ++index)
+	{
+		slots[index].batch = &batch;
+		StartBatchJob(&slots[index]);
+	}
+
+	WaitScheduler(batch.scheduler);
+	DestroyScheduler(batch.scheduler);
+	batch.scheduler = NULL;
+
+	for(index = 0; index < batch.count; ++index)
+	{
+		LPBATCHJOB job = &batch.jobs[index];
+
+		printf("Job %u: %s %s\n", index, job->program, job->input);
+
+		if(job->output)
+			fwrite(job->output, 1, job->size, stdout);
+
+		if(job->error)
+			printf("Job %u failed. Error %0#8x.\n", index, job->error);
+		else if(job->exception != EMULATOR_EXCEPTION_NONE)
+			printf("Job %u: Exception %0#8x occured at address %0#8x after %llu instructions.\n", index, job->exception, job->address, job->retired);
+		else
+			printf("Job %u: Completed after %llu instructions.\n", index, job->retired);
+
+		if(!job->error && (flags & EMULATOR_FLAG_SPARSE))
+			printf("Job %u: Committed %u of %u memory pages.\n", index, job->committed, job->pages);
+	}
+
+	fflush(stdout);
+	result = TRUE;
+
+cleanup:
+	for(index = 0; index < batch.count; ++index)
+	{
+		if(batch.jobs[index].output)
+			HeapFree(GetProcessHeap(), 0, batch.jobs[index].output);
+
+		// Every job running a program shares the reference of the batch, the first one drops it
+		if(batch.jobs[index].shared)
+		{
+			LPPROGRAM program = batch.jobs[index].shared;
+			ULONG other;
+
+			for(other = index; other < batch.count; ++other)
+				if(batch.jobs[other].shared == program)
+					batch.jobs[other].shared = NULL;
+
+			ReleaseProgram(program);
+		}
+	}
+
+	if(batch.scheduler)
+		DestroyScheduler(batch.scheduler);
+
+	if(batch.loop)
+		DestroyEventLoop(batch.loop);
+
+	if(slots)
+		HeapFree(GetProcessHeap(), 0, slots);
+
+	if(batch.jobs)
+		HeapFree(GetProcessHeap(), 0, batch.jobs);
+
+	return result;
+}
@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../Emulator.h"
+
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+#define BENCHMARK_RUNS 5					// Default number of runs of every workload
+#define BENCHMARK_MEMORY 1048576			// Memory size of the emulators in words, large enough for the generated program
+#define BENCHMARK_GENERATED_LINES 200000	// Number of lines in the generated program
+
+// Workload source files, relative to the benchmark directory, NULL for the generated program
+typedef struct
+{
+	LPCSTR name;
+	LPCSTR file;
+} WORKLOAD;
+
+static const WORKLOAD workloads[] =
+{
+	{"alu",			"Alu.pasm"},
+	{"memory",		"Memory.pasm"},
+	{"bulk",		"Bulk.pasm"},
+	{"stack",		"Stack.pasm"},
+	{"branch",		"Branch.pasm"},
+	{"output",		"Output.pasm"},
+	{"generated",	NULL},
+};
+
+// Mean and standard deviation of a set of samples
+typedef struct
+{
+	double mean;
+	double deviation;
+	double minimum;
+	double maximum;
+} STATISTICS;
+
+static double GetSeconds(LARGE_INTEGER start, LARGE_INTEGER end)
+{
+	LARGE_INTEGER frequency;
+
+	QueryPerformanceFrequency(&frequency);
+
+	return (double)(end.QuadPart - start.QuadPart) / (double)frequency.QuadPart;
+}
+
+static VOID GetStatistics(const double* samples, ULONG count, STATISTICS* statistics)
+{
+	double sum = 0.0;
+	double squares = 0.0;
+	ULONG index;
+
+	statistics->minimum = samples[0];
+	statistics->maximum = samples[0];
+
+	for(index = 0; index < count; ++index)
+	{
+		sum += samples[index];
+
+		if(samples[index] < statistics->minimum)
+			statistics->minimum = samples[index];
+
+		if(samples[index] > statistics->maximum)
+			statistics->maximum = samples[index];
+	}
+
+	statistics->mean = sum / count;
+
+	for(index = 0; index < count; ++index)
+		squares += (samples[index] - statistics->mean) * (samples[index] - statistics->mean);
+
+	// Sample standard deviation, 0 for a single run
+	statistics->deviation = count > 1 ? sqrt(squares / (count - 1)) : 0.0;
+}
+
+static ULONG CountLines(LPCSTR path)
+{
+	CHAR buffer[EMULATOR_READ_BUFFER];
+	ULONG lines = 0;
+	FILE* file;
+
+	file = fopen(path, "rt");
+	if(!file)
+		return 0;
+
+	while(fgets(buffer, sizeof(buffer), file))
+		++lines;
+
+	fclose(file);
+	return lines;
+}
+
+// Writes a long straight line program that exercises the parser with every argument form and runs without faults, the
+// line edited (MAXDWORD for none) is replaced to measure the reassembly after a one line edit
+static BOOL GenerateProgram(LPCSTR path, ULONG lines, ULONG edited)
+{
+	static const LPCSTR patterns[] =
+	{
+		"\tADD r1 r1 #1\n",
+		"\tMOVE r2 #5\n",
+		"\tSUB r3 r1 r2\n",
+		"\t; Generated comment line\n",
+		"\tMOVE r4 r3\n",
+		"\tCOND r3\n",
+		"\tADD r5 r4 #16\n",
+		"\tSUB r6 r6 r5\n",
+	};
+
+	FILE* file;
+	ULONG line;
+
+	file = fopen(path, "wt");
+	if(!file)
+		return FALSE;
+
+	for(line = 0; line + 1 < lines; ++line)
+		fputs(line == edited ? "\tMOVE r7 #7\n" : patterns[line % _countof(patterns)], file);
+
+	fputs("\tBREAK\n", file);
+
+	return !fclose(file);
+}
+
+static SIZE_T GetPeakMemory(VOID)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+
+	if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+
+	return counters.PeakWorkingSetSize;
+}
+
+// Runs a workload the given number of times and prints one JSON object with its results
+static BOOL RunWorkload(LPCSTR name, LPCSTR path, ULONG runs, ULONG flags, HANDLE output)
+{
+	EMULATOR emulator;
+	LARGE_INTEGER start;
+	LARGE_INTEGER parsed;
+	LARGE_INTEGER end;
+	STATISTICS mips;
+	STATISTICS parse;
+	double* instructionRates;
+	double* lineRates;
+	ULONGLONG retired = 0;
+	ULONG lines;
+	ULONG run;
+	BOOL result = TRUE;
+
+	lines = CountLines(path);
+	if(!lines)
+	{
+		fprintf(stderr, "Failed to read the workload '%s'.\n", path);
+		return FALSE;
+	}
+
+	instructionRates = HeapAlloc(GetProcessHeap(), 0, runs * sizeof(double));
+	lineRates = HeapAlloc(GetProcessHeap(), 0, runs * sizeof(double));
+	if(!instructionRates || !lineRates)
+		result = FALSE;
+
+	for(run = 0; run < runs && result; ++run)
+	{
+		if(!InitializeEmulatorEx(&emulator, BENCHMARK_MEMORY, flags))
+		{
+			fprintf(stderr, "Failed to initialize the emulation engine.\n");
+
+			result = FALSE;
+			break;
+		}
+
+		// Guest output goes to the null device so the console does not dominate the output workload
+		SetEmulatorOutput(&emulator, output);
+
+		QueryPerformanceCounter(&start);
+
+		if(!LoadProgramFromSourceFile(&emulator, path))
+		{
+			fprintf(stderr, "Failed to load the workload '%s'. Error %0#8x.\n", path, emulator.error);
+
+			UninitializeEmulator(&emulator);
+
+			result = FALSE;
+			break;
+		}
+
+		QueryPerformanceCounter(&parsed);
+		retired = RunEmulator(&emulator, 0);
+		FlushEmulatorOutput(&emulator);
+		QueryPerformanceCounter(&end);
+
+		if(emulator.exception != EMULATOR_EXCEPTION_NONE)
+		{
+			fprintf(stderr, "Workload '%s' raised exception %0#8x at address %0#8x.\n", path, emulator.exception, emulator.registers[EMULATOR_REGISTER_PROGRAM_COUNTER]);
+
+			UninitializeEmulator(&emulator);
+
+			result = FALSE;
+			break;
+		}
+
+		instructionRates[run] = (double)retired / GetSeconds(parsed, end) / 1e6;
+		lineRates[run] = (double)lines / GetSeconds(start, parsed);
+
+		UninitializeEmulator(&emulator);
+	}
+
+	if(result)
+	{
+		GetStatistics(instructionRates, runs, &mips);
+		GetStatistics(lineRates, runs, &parse);
+
+		printf("{\"workload\":\"%s\",\"runs\":%u,\"flags\":%u,\"instructions\":%llu,\"lines\":%u,"
+			"\"mips_mean\":%.3f,\"mips_stddev\":%.3f,\"mips_min\":%.3f,\"mips_max\":%.3f,"
+			"\"parse_lines_per_second_mean\":%.0f,\"parse_lines_per_second_stddev\":%.0f,\"peak_rss_bytes\":%Iu}\n",
+			name, runs, flags, retired, lines, mips.mean, mips.deviation, mips.minimum, mips.maximum, parse.mean, parse.deviation, GetPeakMemory());
+		fflush(stdout);
+	}
+
+	if(instructionRates)
+		HeapFree(GetProcessHeap(), 0, instructionRates);
+
+	if(lineRates)
+		HeapFree(GetProcessHeap(), 0, lineRates);
+
+	return result;
+}
+
+// Reloads a program that alternates between two versions differing in one line through an incremental assembly and
+// prints one JSON object with the reload latency
+static BOOL RunReassembly(LPCSTR name, LPCSTR path, LPCSTR edited, ULONG runs, ULONG flags)
+{
+	EMULATOR emulator;
+	ASSEMBLY assembly;
+	LARGE_INTEGER start;
+	LARGE_INTEGER end;
+	STATISTICS latency;
+	double* samples;
+	ULONG lines;
+	ULONG run;
+	BOOL result = TRUE;
+
+	lines = CountLines(path);
+
+	samples = HeapAlloc(GetProcessHeap(), 0, runs * sizeof(double));
+	if(!samples)
+		return FALSE;
+
+	InitializeAssembly(&assembly);
+
+	// The first load assembles the whole program and is not measured
+	for(run = 0; run <= runs && result; ++run)
+	{
+		if(!InitializeEmulatorEx(&emulator, BENCHMARK_MEMORY, flags))
+		{
+			fprintf(stderr, "Failed to initialize the emulation engine.\n");
+
+			result = FALSE;
+			break;
+		}
+
+		QueryPerformanceCounter(&start);
+
+		if(!LoadProgramFromSourceFileEx(&emulator, run % 2 ? edited : path, &assembly))
+		{
+			fprintf(stderr, "Failed to load the workload '%s'. Error %0#8x.\n", run % 2 ? edited : path, emulator.error);
+			result = FALSE;
+		}
+
+		QueryPerformanceCounter(&end);
+
+		if(run)
+			samples[run - 1] = GetSeconds(start, end) * 1e3;
+
+		UninitializeEmulator(&emulator);
+	}
+
+	if(result)
+	{
+		GetStatistics(samples, runs, &latency);
+
+		printf("{\"workload\":\"%s\",\"runs\":%u,\"flags\":%u,\"lines\":%u,\"chunks\":%u,\"chunks_parsed\":%u,"
+			"\"reload_ms_mean\":%.3f,\"reload_ms_stddev\":%.3f,\"reload_ms_min\":%.3f,\"reload_ms_max\":%.3f,\"peak_rss_bytes\":%Iu}\n",
+			name, runs, flags, lines, assembly.count, assembly.parsed, latency.mean, latency.deviation, latency.minimum, latency.maximum, GetPeakMemory());
+		fflush(stdout);
+	}
+
+	UninitializeAssembly(&assembly);
+	HeapFree(GetProcessHeap(), 0, samples);
+
+	return result;
+}
+
+int main(int argc, const char** argv)
+{
+	CHAR path[MAX_PATH];
+	CHAR generated[MAX_PATH];
+	CHAR edited[MAX_PATH];
+	LPCSTR directory = ".";
+	LPCSTR only = NULL;
+	ULONG runs = BENCHMARK_RUNS;
+	ULONG flags = 0;
+	ULONG index;
+	HANDLE output;
+	BOOL result = TRUE;
+
+	--argc;
+	++argv;
+
+	while(argc && argv[0][0] == '-')
+	{
+		if(!strcmp(argv[0], "-jit"))
+			flags |= EMULATOR_FLAG_JIT;
+		else if(!strcmp(argv[0], "-runs") && argc > 1)
+		{
+			runs = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-workload") && argc > 1)
+		{
+			only = argv[1];
+
+			--argc;
+			++argv;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: Benchmark [-jit] [-runs <count>] [-workload <name>] [directory]\n");
+			return 1;
+		}
+
+		--argc;
+		++argv;
+	}
+
+	if(argc)
+		directory = argv[0];
+
+	if(!runs)
+		runs = 1;
+
+	output = CreateFile("NUL", GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if(output == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Failed to open the null device.\n");
+		return 1;
+	}
+
+	// The generated programs go to the temporary directory
+	generated[0] = 0;
+	edited[0] = 0;
+	if(!GetTempPath(MAX_PATH, path) || !GetTempFileName(path, "pas", 0, generated) || !GenerateProgram(generated, BENCHMARK_GENERATED_LINES, MAXDWORD) ||
+		!GetTempFileName(path, "pas", 0, edited) || !GenerateProgram(edited, BENCHMARK_GENERATED_LINES, BENCHMARK_GENERATED_LINES / 2))
+	{
+		fprintf(stderr, "Failed to generate the assembler workload.\n");
+
+		if(generated[0])
+			DeleteFile(generated);
+
+		if(edited[0])
+			DeleteFile(edited);
+
+		CloseHandle(output);
+		return 1;
+	}
+
+	for(index = 0; index < _countof(workloads); ++index)
+	{
+		if(only && strcmp(only, workloads[index].name))
+			continue;
+
+		if(workloads[index].file)
+			_snprintf(path, sizeof(path), "%s\\%s", directory, workloads[index].file);
+		else
+			lstrcpyn(path, generated, MAX_PATH);
+
+		if(!RunWorkload(workloads[index].name, path, runs, flags, output))
+			result = FALSE;
+	}
+
+	if(!only || !strcmp(only, "reassemble"))
+		if(!RunReassembly("reassemble", generated, edited, runs, flags))
+			result = FALSE;
+
+	DeleteFile(generated);
+	DeleteFile(edited);
+	CloseHandle(output);
+
+	return result ? 0 : 1;
+}
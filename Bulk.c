@@ -0,0 +1,222 @@
+#include "Emulator.h"
+
+// Word kernels of the bulk memory instructions. x86-64 hosts always have SSE2, the AVX2 kernels are used once the
+// processor and the system report AVX2 support, other hosts run the scalar loops. The executors checked the ranges, the
+// kernels access exactly the words they are given.
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define EMULATOR_SIMD_SUPPORTED
+#endif
+
+#if defined(EMULATOR_SIMD_SUPPORTED)
+#include <immintrin.h>
+
+// GCC and Clang only emit AVX2 instructions in functions that ask for them, MSVC emits the intrinsics wherever they are used
+#if defined(__GNUC__)
+#define AVX2 __attribute__((target("avx2")))
+#else
+#define AVX2
+#endif
+
+// Reported by Windows 10 and later, older systems report the feature as missing and get the SSE2 kernels
+#if !defined(PF_AVX2_INSTRUCTIONS_AVAILABLE)
+#define PF_AVX2_INSTRUCTIONS_AVAILABLE 40
+#endif
+
+static BOOL avx2;
+static INIT_ONCE avx2Once = INIT_ONCE_STATIC_INIT;
+#endif
+
+static VOID FillWordsScalar(PULONG destination, ULONG value, ULONG count)
+{
+	ULONG index;
+
+	for(index = 0; index < count; ++index)
+		destination[index] = value;
+}
+
+static ULONG CompareWordsScalar(const ULONG* first, const ULONG* second, ULONG count)
+{
+	ULONG index;
+
+	for(index = 0; index < count; ++index)
+	{
+		if(first[index] != second[index])
+			break;
+	}
+
+	return index;
+}
+
+static ULONG ScanWordsScalar(const ULONG* words, ULONG value, ULONG count)
+{
+	ULONG index;
+
+	for(index = 0; index < count; ++index)
+	{
+		if(words[index] == value)
+			break;
+	}
+
+	return index;
+}
+
+#if defined(EMULATOR_SIMD_SUPPORTED)
+static BOOL CALLBACK DetectAvx2(PINIT_ONCE once, PVOID parameter, PVOID* context)
+{
+	avx2 = IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE);
+	return TRUE;
+}
+
+static BOOL IsAvx2Available(VOID)
+{
+	InitOnceExecuteOnce(&avx2Once, DetectAvx2, NULL, NULL);
+	return avx2;
+}
+
+// The vector loops leave the words that don't fill a whole vector to the scalar loops
+
+static VOID FillWordsSse2(PULONG destination, ULONG value, ULONG count)
+{
+	__m128i fill = _mm_set1_epi32((int)value);
+	ULONG index;
+
+	for(index = 0; count - index >= 4; index += 4)
+		_mm_storeu_si128((__m128i*)&destination[index], fill);
+
+	FillWordsScalar(destination + index, value, count - index);
+}
+
+static AVX2 VOID FillWordsAvx2(PULONG destination, ULONG value, ULONG count)
+{
+	__m256i fill = _mm256_set1_epi32((int)value);
+	ULONG index;
+
+	for(index = 0; count - index >= 8; index += 8)
+		_mm256_storeu_si256((__m256i*)&destination[index], fill);
+
+	FillWordsScalar(destination + index, value, count - index);
+}
+
+static ULONG CompareWordsSse2(const ULONG* first, const ULONG* second, ULONG count)
+{
+	ULONG index;
+	ULONG mask;
+	DWORD bit;
+
+	for(index = 0; count - index >= 4; index += 4)
+	{
+		// One bit per word, set where the words are equal
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&first[index]), _mm_loadu_si128((const __m128i*)&second[index]))));
+		if(mask != 0x0F)
+		{
+			BitScanForward(&bit, ~mask);
+			return index + bit;
+		}
+	}
+
+	return index + CompareWordsScalar(first + index, second + index, count - index);
+}
+
+static AVX2 ULONG CompareWordsAvx2(const ULONG* first, const ULONG* second, ULONG count)
+{
+	ULONG index;
+	ULONG mask;
+	DWORD bit;
+
+	for(index = 0; count - index >= 8; index += 8)
+	{
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)&first[index]), _mm256_loadu_si256((const __m256i*)&second[index]))));
+		if(mask != 0xFF)
+		{
+			BitScanForward(&bit, ~mask);
+			return index + bit;
+		}
+	}
+
+	return index + CompareWordsScalar(first + index, second + index, count - index);
+}
+
+static ULONG ScanWordsSse2(const ULONG* words, ULONG value, ULONG count)
+{
+	__m128i scan = _mm_set1_epi32((int)value);
+	ULONG index;
+	ULONG mask;
+	DWORD bit;
+
+	for(index = 0; count - index >= 4; index += 4)
+	{
+		// One bit per word, set where the word equals the value
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)&words[index]), scan)));
+		if(mask)
+		{
+			BitScanForward(&bit, mask);
+			return index + bit;
+		}
+	}
+
+	return index + ScanWordsScalar(words + index, value, count - index);
+}
+
+static AVX2 ULONG ScanWordsAvx2(const ULONG* words, ULONG value, ULONG count)
+{
+	__m256i scan = _mm256_set1_epi32((int)value);
+	ULONG index;
+	ULONG mask;
+	DWORD bit;
+
+	for(index = 0; count - index >= 8; index += 8)
+	{
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i*)&words[index]), scan)));
+		if(mask)
+		{
+			BitScanForward(&bit, mask);
+			return index + bit;
+		}
+	}
+
+	return index + ScanWordsScalar(words + index, value, count - index);
+}
+#endif
+
+VOID CopyWords(PULONG destination, const ULONG* source, ULONG count)
+{
+	// The C runtime already picks the widest copy loop the host supports
+	MoveMemory(destination, source, (SIZE_T)count * sizeof(ULONG));
+}
+
+VOID FillWords(PULONG destination, ULONG value, ULONG count)
+{
+#if defined(EMULATOR_SIMD_SUPPORTED)
+	if(IsAvx2Available())
+		FillWordsAvx2(destination, value, count);
+	else
+		FillWordsSse2(destination, value, count);
+#else
+	FillWordsScalar(destination, value, count);
+#endif
+}
+
+ULONG CompareWords(const ULONG* first, const ULONG* second, ULONG count)
+{
+#if defined(EMULATOR_SIMD_SUPPORTED)
+	if(IsAvx2Available())
+		return CompareWordsAvx2(first, second, count);
+
+	return CompareWordsSse2(first, second, count);
+#else
+	return CompareWordsScalar(first, second, count);
+#endif
+}
+
+ULONG ScanWords(const ULONG* words, ULONG value, ULONG count)
+{
+#if defined(EMULATOR_SIMD_SUPPORTED)
+	if(IsAvx2Available())
+		return ScanWordsAvx2(words, value, count);
+
+	return ScanWordsSse2(words, value, count);
+#else
+	return ScanWordsScalar(words, value, count);
+#endif
+}
@@ -0,0 +1,427 @@
+#include "Emulator.h"
+
+// Guest channels backed by overlapped handles are associated with the I/O completion port of an event loop, its single
+// thread completes the reads and writes of every channel. An input channel keeps a read in flight while its ring buffer
+// has space, an output channel writes a copy of the flushed output while the guest keeps filling its buffer and queues
+// the output flushed meanwhile behind it, up to a backlog at which the guest waits for the event loop.
+
+typedef struct EVENTLOOP
+{
+	HANDLE port;
+	HANDLE thread;
+} EVENTLOOP;
+
+static DWORD WINAPI RunEventLoop(LPVOID parameter)
+{
+	LPEVENTLOOP loop = parameter;
+	LPOVERLAPPED overlapped;
+	LPCHANNELEVENT event;
+	ULONG_PTR key;
+	DWORD transferred;
+	BOOL result;
+
+	for(;;)
+	{
+		result = GetQueuedCompletionStatus(loop->port, &transferred, &key, &overlapped, INFINITE);
+
+		// DestroyEventLoop posts a completion without a request
+		if(!overlapped)
+			break;
+
+		event = CONTAINING_RECORD(overlapped, CHANNELEVENT, overlapped);
+		event->complete(event, transferred, result);
+	}
+
+	return 0;
+}
+
+LPEVENTLOOP CreateEventLoop(VOID)
+{
+	LPEVENTLOOP loop;
+
+	loop = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(EVENTLOOP));
+	if(!loop)
+		return NULL;
+
+	loop->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if(!loop->port)
+	{
+		HeapFree(GetProcessHeap(), 0, loop);
+		return NULL;
+	}
+
+	loop->thread = CreateThread(NULL, 0, RunEventLoop, loop, 0, NULL);
+	if(!loop->thread)
+	{
+		CloseHandle(loop->port);
+		HeapFree(GetProcessHeap(), 0, loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+VOID DestroyEventLoop(LPEVENTLOOP loop)
+{
+	PostQueuedCompletionStatus(loop->port, 0, 0, NULL);
+
+	WaitForSingleObject(loop->thread, INFINITE);
+	CloseHandle(loop->thread);
+
+	CloseHandle(loop->port);
+	HeapFree(GetProcessHeap(), 0, loop);
+}
+
+// A handle can only be associated with a completion port once, a socket the guest reads and writes is associated by the
+// first channel using it
+static BOOL AttachEventLoop(LPEMULATOR emulator, HANDLE handle, LPEVENTLOOP loop)
+{
+	if((emulator->input.loop == loop && emulator->input.handle == handle) || (emulator->output.loop == loop && emulator->output.handle == handle))
+		return TRUE;
+
+	return CreateIoCompletionPort(handle, loop->port, 0, 0) != NULL;
+}
+
+static VOID CompleteChannelRead(LPCHANNELEVENT event, ULONG transferred, BOOL result)
+{
+	LPEMULATORINPUT input = CONTAINING_RECORD(event, EMULATORINPUT, read);
+
+	EnterCriticalSection(&input->lock);
+
+	input->reading = FALSE;
+
+	// Pipes and sockets report their end as a failed or empty read, a canceled read ends the input as well
+	if(!result || !transferred)
+		input->end = TRUE;
+	else
+	{
+		input->tail += transferred;
+		input->offset += transferred;
+	}
+
+	StartChannelRead(input);
+
+	// CancelChannelRead waits for the completion too
+	WakeAllConditionVariable(&input->available);
+
+	if(input->waiting)
+	{
+		input->waiting = FALSE;
+		input->callback(input->context);
+	}
+
+	LeaveCriticalSection(&input->lock);
+}
+
+VOID StartChannelRead(LPEMULATORINPUT input)
+{
+	ULONG offset;
+	ULONG length;
+
+	if(input->reading || input->end || input->stop)
+		return;
+
+	// Largest contiguous free part of the ring buffer, the guest only advances released while the lock is held
+	offset = input->tail % EMULATOR_INPUT_BUFFER;
+	length = EMULATOR_INPUT_BUFFER - (input->tail - input->released);
+	if(length > EMULATOR_INPUT_BUFFER - offset)
+		length = EMULATOR_INPUT_BUFFER - offset;
+
+	if(!length)
+		return;
+
+	ZeroMemory(&input->read.overlapped, sizeof(OVERLAPPED));
+	input->read.overlapped.Offset = (DWORD)input->offset;
+	input->read.overlapped.OffsetHigh = (DWORD)(input->offset >> 32);
+	input->read.complete = CompleteChannelRead;
+
+	// The completion is queued to the port even if the read completes right away
+	input->reading = TRUE;
+	if(!ReadFile(input->handle, input->buffer + offset, length, NULL, &input->read.overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		input->reading = FALSE;
+		input->end = TRUE;
+	}
+}
+
+VOID CancelChannelRead(LPEMULATORINPUT input)
+{
+	if(input->reading)
+		CancelIoEx(input->handle, &input->read.overlapped);
+
+	while(input->reading)
+		SleepConditionVariableCS(&input->available, &input->lock, INFINITE);
+}
+
+BOOL SetEmulatorInputChannel(LPEMULATOR emulator, HANDLE handle, LPEVENTLOOP loop)
+{
+	if(!AttachEventLoop(emulator, handle, loop))
+		return FALSE;
+
+	emulator->input.handle = handle;
+	emulator->input.loop = loop;
+
+	return TRUE;
+}
+
+// Issues the write of the rest of pending, called with the output lock held
+static VOID StartChannelWrite(LPEMULATOROUTPUT output);
+
+static VOID CompleteChannelWrite(LPCHANNELEVENT event, ULONG transferred, BOOL result)
+{
+	LPEMULATOROUTPUT output = CONTAINING_RECORD(event, EMULATOROUTPUT, write);
+	LPBYTE pending;
+	ULONG capacity;
+
+	EnterCriticalSection(&output->lock);
+
+	output->written += transferred;
+	output->offset += transferred;
+
+	if(result && transferred && output->written < output->writing)
+		StartChannelWrite(output);
+	else if(result && transferred && output->queue)
+	{
+		// The output flushed meanwhile is written next, pending takes its place
+		pending = output->pending;
+		capacity = output->capacity;
+
+		output->pending = output->queued;
+		output->capacity = output->reserved;
+		output->writing = output->queue;
+		output->written = 0;
+
+		output->queued = pending;
+		output->reserved = capacity;
+		output->queue = 0;
+
+		StartChannelWrite(output);
+	}
+	else
+	{
+		// Output the handle does not take anymore is dropped like a failed WriteFile of an unbuffered output
+		output->writing = 0;
+		output->queue = 0;
+	}
+
+	WakeAllConditionVariable(&output->completed);
+
+	if(output->waiting && output->queue < EMULATOR_CHANNEL_BACKLOG)
+	{
+		output->waiting = FALSE;
+		output->callback(output->context);
+	}
+
+	LeaveCriticalSection(&output->lock);
+}
+
+static VOID StartChannelWrite(LPEMULATOROUTPUT output)
+{
+	ZeroMemory(&output->write.overlapped, sizeof(OVERLAPPED));
+	output->write.overlapped.Offset = (DWORD)output->offset;
+	output->write.overlapped.OffsetHigh = (DWORD)(output->offset >> 32);
+	output->write.complete = CompleteChannelWrite;
+
+	if(!WriteFile(output->handle, output->pending + output->written, output->writing - output->written, NULL, &output->write.overlapped) && GetLastError() != ERROR_IO_PENDING)
+	{
+		output->writing = 0;
+		output->queue = 0;
+	}
+}
+
+// Grows a copy buffer of the output to hold size characters, returns FALSE if it can't
+static BOOL ReserveChannelOutput(LPBYTE* buffer, PULONG capacity, ULONG size)
+{
+	LPBYTE reserved;
+
+	if(*capacity >= size)
+		return TRUE;
+
+	if(*buffer)
+		reserved = HeapReAlloc(GetProcessHeap(), 0, *buffer, size);
+	else
+		reserved = HeapAlloc(GetProcessHeap(), 0, size);
+
+	if(!reserved)
+		return FALSE;
+
+	*buffer = reserved;
+	*capacity = size;
+
+	return TRUE;
+}
+
+// Copies the buffered output to pending and writes it, or appends it to queued while a write is in flight, returns FALSE
+// if the copy can't be made. Called with the output lock held
+static BOOL StartChannelOutput(LPEMULATOROUTPUT output)
+{
+	if(output->writing)
+	{
+		if(!ReserveChannelOutput(&output->queued, &output->reserved, output->queue + output->used))
+			return FALSE;
+
+		CopyMemory(output->queued + output->queue, output->buffer, output->used);
+		output->queue += output->used;
+		output->used = 0;
+
+		return TRUE;
+	}
+
+	if(!ReserveChannelOutput(&output->pending, &output->capacity, output->used))
+		return FALSE;
+
+	CopyMemory(output->pending, output->buffer, output->used);
+	output->writing = output->used;
+	output->written = 0;
+	output->used = 0;
+
+	StartChannelWrite(output);
+
+	return TRUE;
+}
+
+BOOL FlushChannelOutput(LPEMULATOROUTPUT output)
+{
+	BOOL result;
+
+	if(!output->used)
+		return TRUE;
+
+	EnterCriticalSection(&output->lock);
+	result = StartChannelOutput(output);
+	LeaveCriticalSection(&output->lock);
+
+	return result;
+}
+
+VOID PostChannelOutput(LPEMULATOROUTPUT output)
+{
+	if(!output->used)
+		return;
+
+	EnterCriticalSection(&output->lock);
+
+	if(output->queue < EMULATOR_CHANNEL_BACKLOG)
+		StartChannelOutput(output);
+
+	LeaveCriticalSection(&output->lock);
+}
+
+BOOL WaitChannelOutput(LPEMULATOR emulator)
+{
+	LPEMULATOROUTPUT output = &emulator->output;
+
+	if(!output->used)
+		return TRUE;
+
+	EnterCriticalSection(&output->lock);
+
+	while(output->queue >= EMULATOR_CHANNEL_BACKLOG)
+	{
+		// The instruction is executed again once the event loop caught up
+		if(output->callback)
+		{
+			output->waiting = TRUE;
+			emulator->waiting = TRUE;
+
+			LeaveCriticalSection(&output->lock);
+			return FALSE;
+		}
+
+		SleepConditionVariableCS(&output->completed, &output->lock, INFINITE);
+	}
+
+	// Output no copy can be made of is dropped
+	if(!StartChannelOutput(output))
+		output->used = 0;
+
+	LeaveCriticalSection(&output->lock);
+
+	return TRUE;
+}
+
+VOID DrainChannelOutput(LPEMULATOROUTPUT output)
+{
+	EnterCriticalSection(&output->lock);
+
+	while(output->writing || output->used)
+	{
+		if(output->writing)
+			SleepConditionVariableCS(&output->completed, &output->lock, INFINITE);
+		else if(!StartChannelOutput(output))
+		{
+			// Output no copy can be made of is dropped
+			output->used = 0;
+		}
+	}
+
+	LeaveCriticalSection(&output->lock);
+}
+
+VOID CloseChannelOutput(LPEMULATOROUTPUT output)
+{
+	if(!output->loop)
+		return;
+
+	DrainChannelOutput(output);
+
+	DeleteCriticalSection(&output->lock);
+
+	if(output->pending)
+		HeapFree(GetProcessHeap(), 0, output->pending);
+
+	if(output->queued)
+		HeapFree(GetProcessHeap(), 0, output->queued);
+
+	output->loop = NULL;
+	output->pending = NULL;
+	output->capacity = 0;
+	output->queued = NULL;
+	output->reserved = 0;
+	output->waiting = FALSE;
+	output->offset = 0;
+}
+
+BOOL SetEmulatorOutputChannel(LPEMULATOR emulator, HANDLE handle, LPEVENTLOOP loop)
+{
+	LPEMULATOROUTPUT output = &emulator->output;
+	LARGE_INTEGER distance;
+	LARGE_INTEGER position;
+	BOOL allocated = FALSE;
+
+	// The previous output is kept until nothing can fail anymore
+	if(!AttachEventLoop(emulator, handle, loop))
+		return FALSE;
+
+	// The guest fills the buffer while the event loop writes
+	if(!output->buffer)
+	{
+		if(!SetEmulatorOutputBuffer(emulator, EMULATOR_OUTPUT_BUFFER))
+			return FALSE;
+
+		allocated = TRUE;
+	}
+
+	// Overlapped writes carry their offset, they continue at the current position of a file like WriteFile would (a file
+	// opened for appending is written at its end anyway), pipes and sockets have no position
+	distance.QuadPart = 0;
+	if(!SetFilePointerEx(handle, distance, &position, FILE_CURRENT))
+		position.QuadPart = 0;
+
+	if(!SetEmulatorOutput(emulator, handle))
+	{
+		if(allocated)
+			SetEmulatorOutputBuffer(emulator, 0);
+
+		return FALSE;
+	}
+
+	InitializeCriticalSection(&output->lock);
+	InitializeConditionVariable(&output->completed);
+
+	output->loop = loop;
+	output->console = FALSE;
+	output->offset = (ULONGLONG)position.QuadPart;
+
+	return TRUE;
+}
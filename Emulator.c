@@ -1,941 +1,2271 @@
 #include "Emulator.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <malloc.h>
 
 COMMAND commands[] =
 {
-	{"JUMP",	INSTRUCTION_JUMP,	ParseInstructionJump,		ExecuteInstructionJump},
-	{"COND",	INSTRUCTION_COND,	ParseInstructionCond,		ExecuteInstructionCond},
-	{"MOVE",	INSTRUCTION_MOVE,	ParseInstructionMove,		ExecuteInstructionMove},
-	{"ADD",		INSTRUCTION_ADD,	ParseInstructionAdd,		ExecuteInstructionAdd},
-	{"SUB",		INSTRUCTION_SUB,	ParseInstructionSub,		ExecuteInstructionSub},
-	{"WRITE",	INSTRUCTION_WRITE,	ParseInstructionWrite,		ExecuteInstructionWrite},
-	{"READ",	INSTRUCTION_READ,	ParseInstructionRead,		ExecuteInstructionRead},
-	{"LOAD",	INSTRUCTION_LOAD,	ParseInstructionLoad,		ExecuteInstructionLoad},
-	{"STORE",	INSTRUCTION_STORE,	ParseInstructionStore,		ExecuteInstructionStore},
-	{"PUSH",	INSTRUCTION_PUSH,	ParseInstructionPush,		ExecuteInstructionPush},
-	{"POP",		INSTRUCTION_POP,	ParseInstructionPop,		ExecuteInstructionPop},
-	{"BREAK",	INSTRUCTION_BREAK,	ParseInstructionBreak,		ExecuteInstructionBreak},
+	{"JUMP",	INSTRUCTION_JUMP,	ParseInstructionJump},
+	{"COND",	INSTRUCTION_COND,	ParseInstructionCond},
+	{"MOVE",	INSTRUCTION_MOVE,	ParseInstructionMove},
+	{"ADD",		INSTRUCTION_ADD,	ParseInstructionAdd},
+	{"SUB",		INSTRUCTION_SUB,	ParseInstructionSub},
+	{"WRITE",	INSTRUCTION_WRITE,	ParseInstructionWrite},
+	{"READ",	INSTRUCTION_READ,	ParseInstructionRead},
+	{"LOAD",	INSTRUCTION_LOAD,	ParseInstructionLoad},
+	{"STORE",	INSTRUCTION_STORE,	ParseInstructionStore},
+	{"PUSH",	INSTRUCTION_PUSH,	ParseInstructionPush},
+	{"POP",		INSTRUCTION_POP,	ParseInstructionPop},
+	{"BREAK",	INSTRUCTION_BREAK,	ParseInstructionBreak},
+	{"MEMCPY",	INSTRUCTION_MEMCPY,	ParseInstructionMemcpy},
+	{"MEMSET",	INSTRUCTION_MEMSET,	ParseInstructionMemset},
+	{"MEMCMP",	INSTRUCTION_MEMCMP,	ParseInstructionMemcmp},
+	{"MEMCHR",	INSTRUCTION_MEMCHR,	ParseInstructionMemchr},
 	// TODO Add more commands here
 
-	{"DW",		INSTRUCTION_NONE,	ParseDirectiveDefineWord,	NULL},
-	{"DS",		INSTRUCTION_NONE,	ParseDirectiveDefineString,	NULL},
+	{"DW",		INSTRUCTION_NONE,	ParseDirectiveDefineWord},
+	{"DS",		INSTRUCTION_NONE,	ParseDirectiveDefineString},
 	// TODO Add more directives here
 };
 
-BOOL InitializeEmulator(LPEMULATOR emulator, ULONG memory)
-{
-	if(!memory)
-		memory = EMULATOR_DEFAULT_MEMORY;
-
-	ZeroMemory(emulator,sizeof(EMULATOR));
-
-	emulator->memory = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, memory);
-	if(!emulator->memory)
-		return FALSE;
-
-	emulator->capacity = memory;
+// Half empty table so a seed that maps every command to its own slot is found in a few attempts
+C_ASSERT(_countof(commands) * 2 <= EMULATOR_COMMAND_HASH);
 
-	return TRUE;
-}
+// Perfect hash table of the command names, holds the index of the command plus one (0 marks a free slot)
+static BYTE commandTable[EMULATOR_COMMAND_HASH];
+static ULONG commandSeed;
+static INIT_ONCE commandTableOnce = INIT_ONCE_STATIC_INIT;
 
-VOID UninitializeEmulator(LPEMULATOR emulator)
+// Executor dispatch table indexed by the instruction type stored in the decoded instruction
+LPCOMMANDEXECUTOR executors[INSTRUCTION_COUNT] =
 {
-	ULONG index;
+	NULL,						// INSTRUCTION_NONE
+	ExecuteInstructionJump,		// INSTRUCTION_JUMP
+	ExecuteInstructionCond,		// INSTRUCTION_COND
+	ExecuteInstructionMove,		// INSTRUCTION_MOVE
+	ExecuteInstructionAdd,		// INSTRUCTION_ADD
+	ExecuteInstructionSub,		// INSTRUCTION_SUB
+	ExecuteInstructionWrite,	// INSTRUCTION_WRITE
+	ExecuteInstructionRead,		// INSTRUCTION_READ
+	ExecuteInstructionLoad,		// INSTRUCTION_LOAD
+	ExecuteInstructionStore,	// INSTRUCTION_STORE
+	ExecuteInstructionPush,		// INSTRUCTION_PUSH
+	ExecuteInstructionPop,		// INSTRUCTION_POP
+	ExecuteInstructionBreak,	// INSTRUCTION_BREAK
+	ExecuteInstructionMemcpy,	// INSTRUCTION_MEMCPY
+	ExecuteInstructionMemset,	// INSTRUCTION_MEMSET
+	ExecuteInstructionMemcmp,	// INSTRUCTION_MEMCMP
+	ExecuteInstructionMemchr,	// INSTRUCTION_MEMCHR
+
+	// Single stepping a fused instruction only executes the first instruction of the sequence
+	ExecuteInstructionCond,		// INSTRUCTION_CONDJUMP
+	ExecuteInstructionLoad,		// INSTRUCTION_LOADCONDJUMP
+	ExecuteInstructionAdd,		// INSTRUCTION_ADDLOAD
+	ExecuteInstructionAdd,		// INSTRUCTION_ADDJUMP
+};
 
-	if(!emulator->memory)
-		return;
+// Instruction sequences replaced by FuseInstructions, longer sequences first
+struct
+{
+	BYTE type;			// Fused instruction type stored on the first instruction
+	BYTE length;		// Number of instructions in the sequence
+	BYTE types[3];		// Instruction types of the sequence
+} fusions[] =
+{
+	{INSTRUCTION_LOADCONDJUMP,	3, {INSTRUCTION_LOAD, INSTRUCTION_COND, INSTRUCTION_JUMP}},
+	{INSTRUCTION_CONDJUMP,		2, {INSTRUCTION_COND, INSTRUCTION_JUMP}},
+	{INSTRUCTION_ADDLOAD,		2, {INSTRUCTION_ADD, INSTRUCTION_LOAD}},
+	{INSTRUCTION_ADDJUMP,		2, {INSTRUCTION_ADD, INSTRUCTION_JUMP}},
+};
 
-	// Free the allocated instructions
-	for(index = 0; index < emulator->capacity && emulator->memory[index]; ++index)
-		HeapFree(GetProcessHeap(), 0, (LPVOID)emulator->memory[index]);
+BYTE GetUnfusedType(BYTE type)
+{
+	ULONG fusion;
 
-	HeapFree(GetProcessHeap(), 0, emulator->memory);
+	for(fusion = 0; fusion < _countof(fusions); ++fusion)
+	{
+		if(fusions[fusion].type == type)
+			return fusions[fusion].types[0];
+	}
 
-	emulator->memory = NULL;
-	emulator->capacity = 0;
+	return type;
 }
 
-BOOL LoadProgramFromSourceFile(LPEMULATOR emulator, LPCSTR path)
+LPCSTR GetInstructionName(BYTE type)
 {
-	BYTE buffer[EMULATOR_READ_BUFFER];
+	ULONG command;
 
-	FILE* file = fopen(path, "rt");
-	if(!file)
+	type = GetUnfusedType(type);
+
+	for(command = 0; command < _countof(commands); ++command)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
-		return FALSE;
+		if(commands[command].type == type && type != INSTRUCTION_NONE)
+			return commands[command].name;
 	}
 
-	while(fgets(buffer, sizeof(buffer), file))
-	{
-		LPINSTRUCTION instruction;
-		LPSTR buff = buffer;
+	return "NONE";
+}
 
-		// Remove whitespaces
-		while(buff[0] && (buff[0] == ' ' || buff[0] == '\t')) ++buff;
+// Returns the type FuseInstructions stores for the instruction at address
+static BYTE GetFusedType(LPINSTRUCTION code, ULONG address, ULONG instructions)
+{
+	ULONG fusion;
+	ULONG index;
 
-		// Remove empty lines and comments
-		if(!lstrlen(buff) || buff[0] == '\n' || buff[0] == ';')
+	for(fusion = 0; fusion < _countof(fusions); ++fusion)
+	{
+		if(address + fusions[fusion].length > instructions)
 			continue;
-		
-		instruction = ParseCommand(emulator, buff);
-		if(!instruction)
-		{
-			fclose(file);
-			return FALSE;
-		}
 
-		// -1 means a directive was parsed (directives are not stored in memory like instructions)
-		if(instruction != LPINSTRUCTION_NONE)
+		// Instructions carrying INSTRUCTION_FLAG_REGISTERS never match so they keep going through their executor
+		for(index = 0; index < fusions[fusion].length; ++index)
 		{
-			emulator->memory[emulator->instructions] = (ULONG)instruction;
-			++emulator->instructions;
+			if(GetUnfusedType(code[address + index].type) != fusions[fusion].types[index])
+				break;
 		}
+
+		if(index == fusions[fusion].length)
+			return fusions[fusion].type;
 	}
 
-	fclose(file);
-	return TRUE;
+	return GetUnfusedType(code[address].type);
 }
 
-BOOL LoadProgramFromFile(LPEMULATOR emulator, LPCSTR path)
+BOOL InitializeEmulator(LPEMULATOR emulator, ULONG memory)
 {
-	//
-	// TODO Not yet implemented
-	//
-	DebugBreak();
-
-	return TRUE;
+	return InitializeEmulatorEx(emulator, memory, 0);
 }
 
-BOOL ParseRegister(LPCSTR text, PULONG value)
+BOOL InitializeEmulatorEx(LPEMULATOR emulator, ULONG memory, ULONG flags)
 {
-	if(!lstrcmpi(text, "pc"))
-		*value = EMULATOR_REGISTER_PROGRAM_COUNTER;
-	else if(!lstrcmpi(text, "sp"))
-		*value = EMULATOR_REGISTER_STACK_POINTER;
-	else if(sscanf(text, "r%u", value) != 1)
+	ULONG mode;
+
+	if(!memory)
+		memory = EMULATOR_DEFAULT_MEMORY;
+
+	ZeroMemory(emulator,sizeof(EMULATOR));
+
+	if(memory > EMULATOR_MAXIMUM_MEMORY || memory > MAXSIZE_T / sizeof(ULONG))
 		return FALSE;
 
-	if(*value >= EMULATOR_REGISTERS)
+	emulator->flags = flags;
+
+	if(!AllocateEmulatorMemory(emulator, memory))
 		return FALSE;
 
-	return TRUE;
-}
+	emulator->output.handle = GetStdHandle(STD_OUTPUT_HANDLE);
+	emulator->output.console = GetConsoleMode(emulator->output.handle, &mode);
 
-BOOL ParseAddress(LPCSTR text, PULONG value)
-{
-	if(sscanf(text, "%u", value) != 1)
+	if(!SetEmulatorOutputBuffer(emulator, EMULATOR_OUTPUT_BUFFER))
+	{
+		FreeEmulatorMemory(emulator);
+		return FALSE;
+	}
+
+	if((flags & EMULATOR_FLAG_SAMPLE) && !InitializeSampler(emulator))
+	{
+		SetEmulatorOutputBuffer(emulator, 0);
+		FreeEmulatorMemory(emulator);
 		return FALSE;
+	}
+
+	// Profiling runs every instruction through its executor, so there is no need for native code
+	if(flags & EMULATOR_FLAG_PROFILE)
+	{
+		if(!InitializeProfiler(emulator))
+		{
+			if(emulator->sampler)
+				UninitializeSampler(emulator);
+
+			SetEmulatorOutputBuffer(emulator, 0);
+			FreeEmulatorMemory(emulator);
+			return FALSE;
+		}
+	}
+	// The interpreter is used if no native code can be generated
+	else if(flags & EMULATOR_FLAG_JIT)
+		InitializeJit(emulator);
 
 	return TRUE;
 }
 
-BOOL ParseConstant(LPCSTR text, PULONG value)
+VOID UninitializeEmulator(LPEMULATOR emulator)
 {
-	if(sscanf(text, "#%u", value) != 1)
-		return FALSE;
+	if(!emulator->memory)
+		return;
 
-	return TRUE;
+	// Stop sampling before the code goes away
+	if(emulator->sampler)
+		UninitializeSampler(emulator);
+
+	if(emulator->jit)
+		UninitializeJit(emulator);
+
+	if(emulator->profile)
+		UninitializeProfiler(emulator);
+
+	// Free the guest output and input buffers, output an event loop still writes is written first
+	CloseChannelOutput(&emulator->output);
+	SetEmulatorOutputBuffer(emulator, 0);
+	UninitializeEmulatorInput(emulator);
+
+	// Free the decoded instructions
+	if(emulator->program)
+		ReleaseProgram(emulator->program);
+	else if(emulator->image)
+		UnmapViewOfFile(emulator->image);
+	else if(emulator->code)
+		_aligned_free(emulator->code);
+
+	if(emulator->blocks)
+		HeapFree(GetProcessHeap(), 0, emulator->blocks);
+
+	if(emulator->snapshot)
+		ReleaseSnapshot(emulator->snapshot);
+
+	if(emulator->reset)
+		ReleaseSnapshot(emulator->reset);
+
+	FreeEmulatorMemory(emulator);
+
+	// The exception handler no longer reaches the memory
+	if(emulator->backing)
+		ReleaseSnapshot(emulator->backing);
+
+	emulator->code = NULL;
+	emulator->blocks = NULL;
+	emulator->image = NULL;
+	emulator->program = NULL;
+	emulator->snapshot = NULL;
+	emulator->backing = NULL;
+	emulator->reset = NULL;
+	emulator->slots = 0;
+	emulator->instructions = 0;
 }
 
-BOOL ParseCharacter(LPCSTR text, PULONG value)
+// Returns TRUE for the characters sscanf treats as whitespace, the tokenizer splits lines at them
+static BOOL IsBlank(CHAR character)
 {
-	if(sscanf(text, "'%c'", value) != 1)
-		return FALSE;
-
-	return TRUE;
+	return character == ' ' || (character >= '\t' && character <= '\r');
 }
 
-LPINSTRUCTION ParseCommand(LPEMULATOR emulator, LPCSTR text)
+// Splits the line starting at text into whitespace separated tokens, returns the start of the next line
+static LPCSTR TokenizeLine(LPCSTR text, LPCSTR end, LPSOURCELINE line)
 {
-	ULONG index;
-	CHAR name[EMULATOR_COMMAND_NAME];
+	LPCSTR start;
 
-	if(sscanf(text, "%s", name) != 1)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	line->count = 0;
 
-	for(index = 0; index < _countof(commands); ++index)
+	while(text < end && *text != '\n')
 	{
-		if(!_strcmpi(name, commands[index].name))
-			return commands[index].parser(&commands[index], emulator, text);
+		if(IsBlank(*text))
+		{
+			++text;
+			continue;
+		}
+
+		// Comments and the tokens past the last argument any command reads are skipped along with the rest of the line
+		if(line->count == EMULATOR_COMMAND_TOKENS || (line->count && line->tokens[0].text[0] == ';'))
+		{
+			text = memchr(text, '\n', end - text);
+			if(!text)
+				text = end;
+
+			break;
+		}
+
+		start = text;
+		while(text < end && !IsBlank(*text))
+			++text;
+
+		line->tokens[line->count].text = start;
+		line->tokens[line->count].length = (ULONG)(text - start);
+		++line->count;
 	}
 
-	SetEmulatorError(emulator, EMULATOR_ERROR_UNKNOWN_INSTRUCTION);
-	return NULL;
+	line->end = text;
+
+	return text < end ? text + 1 : end;
 }
 
-LPINSTRUCTION ParseInstructionJump(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Data write of a directive in a chunk assembled in parallel
+typedef struct
+{
+	ULONG number;		// Chunk relative line of the directive
+	ULONG instruction;	// Number of instructions of the chunk preceding the directive
+	ULONG address;		// Address of the first word
+	ULONG length;		// Number of words
+	ULONG offset;		// Offset of the words in the word buffer of the chunk
+} SOURCEDATA,*LPSOURCEDATA;
+
+// Part of a source file assembled on its own, the chunk collects the instructions in a private code array and the data
+// writes of the directives, the ordered merge assigns the addresses and validates and applies the data writes, so the
+// assembled chunk does not depend on the lines before it and can be reused by an incremental load
+typedef struct SOURCECHUNK
+{
+	LPCSTR text;		// First line of the chunk, only valid while the source is loaded
+	LPCSTR end;			// End of the chunk, the start of the next line
+	EMULATOR emulator;	// Holds the code array, the number of instructions and the error of the chunk
+	ULONG lines;		// Number of lines parsed, the line of an error is the last one
+	PULONG numbers;		// Chunk relative line of every instruction
+	LPSOURCEDATA data;	// Data writes in source order
+	ULONG writes;		// Number of data writes
+	ULONG records;		// Number of data writes the data array can hold
+	PULONG words;		// Words written by the data writes
+	ULONG used;			// Number of words in the word buffer
+	ULONG size;			// Number of words the word buffer can hold
+	ULONGLONG hash;		// Hash of the lines of the chunk, chunks of an assembly are matched by their hash and length
+	ULONG length;		// Number of source bytes
+	LPSTR source;		// Copy of the source bytes of a chunk of an assembly, compared when the hash and length match
+	BOOL referenced;	// Set if the source being loaded contains the chunk
+} SOURCECHUNK;
+
+// Grows a heap array to hold at least count elements, doubling its size
+static BOOL GrowArray(LPVOID* array, PULONG size, ULONG count, ULONG element)
 {
-	LPINSTRUCTIONJUMP instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR argument[EMULATOR_COMMAND_ARGUMENT];
+	LPVOID grown;
+	ULONG capacity = *size ? *size : 256;
 
-	if(sscanf(text, "%s %s", name, argument) != 2)
+	while(capacity < count)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		if(capacity > MAXDWORD / 2 / element)
+			return FALSE;
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONJUMP));
-	if(!instruction)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
+		capacity *= 2;
 	}
 
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONJUMP);
+	if(capacity == *size)
+		return TRUE;
 
-	if(ParseRegister(argument, &instruction->argument))
-		instruction->type = ARGUMENT_REGISTER;
-	else if(ParseAddress(argument, &instruction->argument))
-		instruction->type = ARGUMENT_ADDRESS;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	grown = *array ? HeapReAlloc(GetProcessHeap(), 0, *array, capacity * element) : HeapAlloc(GetProcessHeap(), 0, capacity * element);
+	if(!grown)
+		return FALSE;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	*array = grown;
+	*size = capacity;
 
-	return (LPINSTRUCTION)instruction;
+	return TRUE;
 }
 
-LPINSTRUCTION ParseInstructionCond(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Returns the memory words a directive writes, a chunk assembled in parallel buffers the words until the ordered merge
+// validates and applies the write
+static PULONG ReserveData(LPEMULATOR emulator, LPSOURCELINE line, ULONG address, ULONG length)
 {
-	LPINSTRUCTIONCOND instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR argument[EMULATOR_COMMAND_ARGUMENT];
+	LPSOURCECHUNK chunk = line->chunk;
+	LPSOURCEDATA data;
+	PULONG words;
 
-	if(sscanf(text, "%s %s", name, argument) != 2)
+	if(!chunk)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		if(!IsValidAddressWrite(emulator, address, length))
+		{
+			SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+			return NULL;
+		}
+
+		return &emulator->memory[address];
 	}
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONCOND));
-	if(!instruction)
+	if(!GrowArray((LPVOID*)&chunk->data, &chunk->records, chunk->writes + 1, sizeof(SOURCEDATA)) || length > MAXDWORD - chunk->used ||
+		!GrowArray((LPVOID*)&chunk->words, &chunk->size, chunk->used + length, sizeof(ULONG)))
 	{
 		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
 		return NULL;
 	}
 
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONCOND);
-	
-	if(ParseRegister(argument, &instruction->argument))
-		instruction->type = ARGUMENT_REGISTER;
-	else if(ParseConstant(argument, &instruction->argument))
-		instruction->type = ARGUMENT_CONSTANT;
-	else if(ParseAddress(argument, &instruction->argument))
-		instruction->type = ARGUMENT_ADDRESS;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	data = &chunk->data[chunk->writes++];
+	data->number = line->number;
+	data->instruction = emulator->instructions;
+	data->address = address;
+	data->length = length;
+	data->offset = chunk->used;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	words = &chunk->words[chunk->used];
+	chunk->used += length;
 
-	return (LPINSTRUCTION)instruction;
+	return words;
 }
 
-LPINSTRUCTION ParseInstructionMove(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Assembles the lines from text to end into the emulator (the private emulator of the chunk if one is passed), returns
+// FALSE on the first error, lines receives the number of lines parsed including the failing one
+static BOOL ParseSource(LPEMULATOR emulator, LPCSTR text, LPCSTR end, LPSOURCECHUNK chunk, PULONG lines)
 {
-	LPINSTRUCTIONMOVE instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR arguments[2][EMULATOR_COMMAND_ARGUMENT];
+	LPINSTRUCTION instruction;
+	SOURCELINE line;
+	ULONG size = 0;
 
-	if(sscanf(text, "%s %s %s", name, arguments[0], arguments[1]) != 3)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	line.number = 0;
+	line.chunk = chunk;
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONMOVE));
-	if(!instruction)
+	while(text < end)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
-	}
+		text = TokenizeLine(text, end, &line);
+		++line.number;
 
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONMOVE);
-	
-	if(ParseRegister(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_CONSTANT;
-	else if(ParseAddress(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_ADDRESS;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+		// Remove empty lines and comments
+		if(!line.count || line.tokens[0].text[0] == ';')
+			continue;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		instruction = ParseCommand(emulator, &line);
+		if(!instruction)
+		{
+			*lines = line.number;
+			return FALSE;
+		}
 
-	if(ParseRegister(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_CONSTANT;
-	else if(ParseAddress(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_ADDRESS;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+		// -1 means a directive was parsed (directives are not stored in memory like instructions)
+		if(instruction != LPINSTRUCTION_NONE)
+		{
+			instruction->type |= GetInstructionFlags(instruction);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+			if(chunk)
+			{
+				if(!GrowArray((LPVOID*)&chunk->numbers, &size, emulator->instructions + 1, sizeof(ULONG)))
+				{
+					SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+
+					*lines = line.number;
+					return FALSE;
+				}
+
+				chunk->numbers[emulator->instructions] = line.number;
+			}
+			else if(emulator->profile)
+				SetProfileLine(emulator, emulator->instructions, line.number);
+
+			++emulator->instructions;
+		}
 	}
 
-	return (LPINSTRUCTION)instruction;
+	*lines = line.number;
+	return TRUE;
 }
 
-LPINSTRUCTION ParseInstructionAdd(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Chunks waiting to be assembled, the threads take the next one until none is left
+typedef struct
 {
-	LPINSTRUCTIONARTH instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR arguments[3][EMULATOR_COMMAND_ARGUMENT];
+	LPSOURCECHUNK* chunks;
+	ULONG count;
+	volatile LONG next;
+} SOURCEWORK,*LPSOURCEWORK;
 
-	if(sscanf(text, "%s %s %s %s", name, arguments[0], arguments[1], arguments[2]) != 4)
+static DWORD WINAPI ParseSourceWorker(LPVOID parameter)
+{
+	LPSOURCEWORK work = parameter;
+	LPSOURCECHUNK chunk;
+	ULONG index;
+
+	while((index = (ULONG)InterlockedIncrement(&work->next) - 1) < work->count)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		chunk = work->chunks[index];
+
+		// The merge only fuses the instructions at the joins of the chunks again
+		if(ParseSource(&chunk->emulator, chunk->text, chunk->end, chunk, &chunk->lines))
+			FuseInstructions(&chunk->emulator);
 	}
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONARTH));
-	if(!instruction)
+	return 0;
+}
+
+// Assembles the chunks for an emulator with the given memory size, one thread for every EMULATOR_SOURCE_CHUNK bytes up
+// to one per processor
+static VOID ParseSourceChunks(LPSOURCECHUNK* chunks, ULONG count, ULONG capacity)
+{
+	SOURCEWORK work;
+	SYSTEM_INFO information;
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	ULONGLONG size = 0;
+	ULONG started = 0;
+	ULONG limit;
+	ULONG index;
+
+	for(index = 0; index < count; ++index)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
+		chunks[index]->emulator.capacity = capacity;
+		size += chunks[index]->end - chunks[index]->text;
 	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONARTH);
 
-	if(ParseRegister(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_REGISTER;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	work.chunks = chunks;
+	work.count = count;
+	work.next = 0;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	GetSystemInfo(&information);
 
-	if(ParseRegister(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_CONSTANT;
-	else if(ParseAddress(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_ADDRESS;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	limit = (ULONG)(size / EMULATOR_SOURCE_CHUNK);
+	if(limit > information.dwNumberOfProcessors)
+		limit = information.dwNumberOfProcessors;
+	if(limit > count)
+		limit = count;
+	if(limit > MAXIMUM_WAIT_OBJECTS)
+		limit = MAXIMUM_WAIT_OBJECTS;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+	// The calling thread takes part, the chunks of a thread that could not be started are left to the others
+	for(index = 1; index < limit; ++index)
+	{
+		threads[started] = CreateThread(NULL, 0, ParseSourceWorker, &work, 0, NULL);
+		if(threads[started])
+			++started;
 	}
 
-	if(ParseRegister(arguments[2], &instruction->arguments[2]))
-		instruction->types[2] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[2], &instruction->arguments[2]))
-		instruction->types[2] = ARGUMENT_CONSTANT;
-	else if(ParseAddress(arguments[2], &instruction->arguments[2]))
-		instruction->types[2] = ARGUMENT_ADDRESS;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	ParseSourceWorker(&work);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	if(started)
+		WaitForMultipleObjects(started, threads, TRUE, INFINITE);
 
-	return (LPINSTRUCTION)instruction;
+	for(index = 0; index < started; ++index)
+		CloseHandle(threads[index]);
 }
 
-LPINSTRUCTION ParseInstructionSub(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Appends the instructions first to last of a chunk to the code array, first is the line number of the first line of
+// the chunk, fails like AllocateInstruction once the code array is full
+static BOOL MergeSourceInstructions(LPEMULATOR emulator, LPSOURCECHUNK chunk, ULONG first, ULONG start, ULONG end)
 {
-	LPINSTRUCTIONARTH instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR arguments[3][EMULATOR_COMMAND_ARGUMENT];
+	ULONG limit = emulator->image || emulator->program ? emulator->instructions : EMULATOR_CODE_LIMIT;
+	ULONG count = end - start;
+	ULONG index;
 
-	if(sscanf(text, "%s %s %s %s", name, arguments[0], arguments[1], arguments[2]) != 4)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	if(count > limit - emulator->instructions)
+		count = limit - emulator->instructions;
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONARTH));
-	if(!instruction)
+	CopyMemory(&emulator->code[emulator->instructions], &chunk->emulator.code[start], count * sizeof(INSTRUCTION));
+
+	if(emulator->profile)
+		for(index = 0; index < count; ++index)
+			SetProfileLine(emulator, emulator->instructions + index, first + chunk->numbers[start + index]);
+
+	emulator->instructions += count;
+
+	if(count < end - start)
 	{
+		emulator->line = first + chunk->numbers[start + count];
+
 		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
+		return FALSE;
 	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONARTH);
 
-	if(ParseRegister(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_REGISTER;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	return TRUE;
+}
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+// Applies a chunk to the emulator in source order, fails on the first line that fails sequential assembly
+static BOOL MergeSourceChunk(LPEMULATOR emulator, LPSOURCECHUNK chunk, ULONG first)
+{
+	LPSOURCEDATA data;
+	ULONG start = 0;
+	ULONG index;
 
-	if(ParseRegister(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_CONSTANT;
-	else if(ParseAddress(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_ADDRESS;
-	else
+	for(index = 0; index < chunk->writes; ++index)
 	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+		data = &chunk->data[index];
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		if(!MergeSourceInstructions(emulator, chunk, first, start, data->instruction))
+			return FALSE;
+
+		start = data->instruction;
+
+		// Data writes may not overwrite the instructions preceding them
+		if(!IsValidAddressWrite(emulator, data->address, data->length))
+		{
+			emulator->line = first + data->number;
+
+			SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+			return FALSE;
+		}
+
+		CopyMemory(&emulator->memory[data->address], &chunk->words[data->offset], data->length * sizeof(ULONG));
 	}
 
-	if(ParseRegister(arguments[2], &instruction->arguments[2]))
-		instruction->types[2] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[2], &instruction->arguments[2]))
-		instruction->types[2] = ARGUMENT_CONSTANT;
-	else if(ParseAddress(arguments[2], &instruction->arguments[2]))
-		instruction->types[2] = ARGUMENT_ADDRESS;
-	else
+	if(!MergeSourceInstructions(emulator, chunk, first, start, chunk->emulator.instructions))
+		return FALSE;
+
+	if(chunk->emulator.error != EMULATOR_ERROR_NONE)
 	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+		emulator->line = first + chunk->lines;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		SetEmulatorError(emulator, chunk->emulator.error);
+		return FALSE;
 	}
 
-	return (LPINSTRUCTION)instruction;
+	return TRUE;
 }
 
-LPINSTRUCTION ParseInstructionWrite(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Merges assembled chunks into the emulator in source order, the merged instructions are fused like FuseInstructions
+// does unless the merge fails
+static BOOL MergeSourceChunks(LPEMULATOR emulator, LPSOURCECHUNK* chunks, ULONG count)
 {
-	LPINSTRUCTIONIO instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR argument[EMULATOR_COMMAND_ARGUMENT];
+	LPINSTRUCTION code;
+	ULONG instructions = emulator->instructions;
+	ULONG start = emulator->instructions;
+	ULONG join = emulator->instructions;
+	ULONG first = 0;
+	ULONG slots;
+	ULONG index;
+	ULONG address;
+	BOOL result = TRUE;
 
-	if(sscanf(text, "%s %s", name, argument) != 2)
+	// Make room for every instruction up front
+	for(index = 0; index < count && instructions <= EMULATOR_CODE_LIMIT; ++index)
+		instructions += chunks[index]->emulator.instructions;
+
+	slots = (instructions < EMULATOR_CODE_LIMIT ? instructions : EMULATOR_CODE_LIMIT) + EMULATOR_CODE_SENTINELS;
+	if(!emulator->image && !emulator->program && instructions > emulator->instructions && slots > emulator->slots)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		code = _aligned_realloc(emulator->code, slots * sizeof(INSTRUCTION), EMULATOR_CODE_ALIGNMENT);
+		if(!code)
+		{
+			SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+			return FALSE;
+		}
+
+		emulator->code = code;
+		emulator->slots = slots;
 	}
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONIO));
-	if(!instruction)
+	for(index = 0; index < count && result; ++index)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
+		result = MergeSourceChunk(emulator, chunks[index], first);
+		first += chunks[index]->lines;
 	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONIO);
-
-	if(ParseRegister(argument, &instruction->argument))
-		instruction->type = ARGUMENT_REGISTER;
-	else if(ParseCharacter(argument, &instruction->argument))
-		instruction->type = ARGUMENT_CHARACTER;
-	else if(ParseConstant(argument, &instruction->argument))
-		instruction->type = ARGUMENT_CONSTANT;
-	else
+
+	if(result)
 	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+		// The chunks are fused on their own, a sequence may only continue into the next chunk from its last two instructions
+		for(index = 0; index <= count; ++index)
+		{
+			for(address = join > 2 ? join - 2 : 0; address < join; ++address)
+				emulator->code[address].type = GetFusedType(emulator->code, address, emulator->instructions);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+			if(index < count)
+				join += chunks[index]->emulator.instructions;
+		}
+	}
+	else
+	{
+		// Sequential assembly leaves the instructions of a failed load unfused
+		for(address = start; address < emulator->instructions; ++address)
+			emulator->code[address].type = GetUnfusedType(emulator->code[address].type);
 	}
 
-	return (LPINSTRUCTION)instruction;
+	// AllocateInstruction keeps the sentinels after the last instruction zeroed
+	if(emulator->code && !emulator->image && !emulator->program)
+		ZeroMemory(&emulator->code[emulator->instructions], EMULATOR_CODE_SENTINELS * sizeof(INSTRUCTION));
+
+	return result;
 }
 
-LPINSTRUCTION ParseInstructionRead(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+static LPSOURCECHUNK AllocateSourceChunk(LPCSTR text, LPCSTR end)
 {
-	LPINSTRUCTIONIO instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR argument[EMULATOR_COMMAND_ARGUMENT];
-
-	if(sscanf(text, "%s %s", name, argument) != 2)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	LPSOURCECHUNK chunk;
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONIO));
-	if(!instruction)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+	chunk = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SOURCECHUNK));
+	if(!chunk)
 		return NULL;
-	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONIO);
-
-	if(ParseRegister(argument, &instruction->argument))
-		instruction->type = ARGUMENT_REGISTER;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	chunk->text = text;
+	chunk->end = end;
 
-	return (LPINSTRUCTION)instruction;
+	return chunk;
 }
 
-LPINSTRUCTION ParseInstructionLoad(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+static VOID FreeSourceChunk(LPSOURCECHUNK chunk)
 {
-	LPINSTRUCTIONMEMORY instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR arguments[2][EMULATOR_COMMAND_ARGUMENT];
-
-	if(sscanf(text, "%s %s %s", name, arguments[0], arguments[1]) != 3)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	if(chunk->emulator.code)
+		_aligned_free(chunk->emulator.code);
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONMEMORY));
-	if(!instruction)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
-	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONMEMORY);
+	if(chunk->numbers)
+		HeapFree(GetProcessHeap(), 0, chunk->numbers);
 
-	if(!ParseRegister(arguments[0], &instruction->arguments[0]))
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	if(chunk->data)
+		HeapFree(GetProcessHeap(), 0, chunk->data);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
-	
-	instruction->types[0] = ARGUMENT_REGISTER;
-	
-	if(ParseRegister(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_CONSTANT;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	if(chunk->words)
+		HeapFree(GetProcessHeap(), 0, chunk->words);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	if(chunk->source)
+		HeapFree(GetProcessHeap(), 0, chunk->source);
 
-	return (LPINSTRUCTION)instruction;
+	HeapFree(GetProcessHeap(), 0, chunk);
 }
 
-LPINSTRUCTION ParseInstructionStore(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Assembles the source on several threads, one chunk of whole lines each, and merges the chunks in source order
+static BOOL ParseSourceParallel(LPEMULATOR emulator, LPCSTR source, LPCSTR end, ULONG count)
 {
-	LPINSTRUCTIONMEMORY instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR arguments[2][EMULATOR_COMMAND_ARGUMENT];
-
-	if(sscanf(text, "%s %s %s", name, arguments[0], arguments[1]) != 3)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	LPSOURCECHUNK* chunks;
+	LPCSTR text = source;
+	LPCSTR split;
+	ULONG index;
+	BOOL result = TRUE;
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONMEMORY));
-	if(!instruction)
+	chunks = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, count * sizeof(LPSOURCECHUNK));
+	if(!chunks)
 	{
 		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
-	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONMEMORY);
-
-	if(ParseRegister(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[0], &instruction->arguments[0]))
-		instruction->types[0] = ARGUMENT_CONSTANT;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
-
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		return FALSE;
 	}
 
-	if(ParseRegister(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_REGISTER;
-	else if(ParseConstant(arguments[1], &instruction->arguments[1]))
-		instruction->types[1] = ARGUMENT_CONSTANT;
-	else
+	// Split at the first line starting after every multiple of the chunk size
+	for(index = 0; index < count && result; ++index)
 	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+		split = end;
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		if(index + 1 < count)
+		{
+			split = source + (end - source) / count * (index + 1);
+			if(split < text)
+				split = text;
 
-	return (LPINSTRUCTION)instruction;
-}
+			split = memchr(split, '\n', end - split);
+			split = split ? split + 1 : end;
+		}
 
-LPINSTRUCTION ParseInstructionPush(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
-{
-	LPINSTRUCTIONSTACK instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR argument[EMULATOR_COMMAND_ARGUMENT];
+		chunks[index] = AllocateSourceChunk(text, split);
+		if(!chunks[index])
+		{
+			SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+			result = FALSE;
+		}
 
-	if(sscanf(text, "%s %s", name, argument) != 2)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		text = split;
 	}
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONMEMORY));
-	if(!instruction)
+	if(result)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
+		ParseSourceChunks(chunks, count, emulator->capacity);
+		result = MergeSourceChunks(emulator, chunks, count);
 	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONMEMORY);
 
-	if(ParseRegister(argument, &instruction->argument))
-		instruction->type = ARGUMENT_REGISTER;
-	else if(ParseConstant(argument, &instruction->argument))
-		instruction->type = ARGUMENT_CONSTANT;
-	else
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
+	for(index = 0; index < count; ++index)
+		if(chunks[index])
+			FreeSourceChunk(chunks[index]);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	HeapFree(GetProcessHeap(), 0, chunks);
 
-	return (LPINSTRUCTION)instruction;
+	return result;
 }
 
-LPINSTRUCTION ParseInstructionPop(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Hash of a source line, eight bytes at a time, the low bits depend on every byte
+static ULONGLONG HashSourceLine(LPCSTR text, LPCSTR end)
 {
-	LPINSTRUCTIONSTACK instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR argument[EMULATOR_COMMAND_ARGUMENT];
+	ULONGLONG hash = 0xCBF29CE484222325 ^ (ULONGLONG)(end - text);
+	ULONGLONG word;
 
-	if(sscanf(text, "%s %s", name, argument) != 2)
+	for(; end - text >= sizeof(word); text += sizeof(word))
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		CopyMemory(&word, text, sizeof(word));
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTIONMEMORY));
-	if(!instruction)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15;
+		hash ^= hash >> 32;
 	}
-	
-	instruction->instruction.command = command;
-	instruction->instruction.size = sizeof(INSTRUCTIONMEMORY);
-
-	if(!ParseRegister(argument, &instruction->argument))
-	{
-		HeapFree(GetProcessHeap(), 0, instruction);
 
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	// The rest of the line is padded with zeros
+	word = 0;
+	CopyMemory(&word, text, end - text);
 
-	instruction->type = ARGUMENT_REGISTER;
+	hash = (hash ^ word) * 0x9E3779B97F4A7C15;
+	hash ^= hash >> 32;
 
-	return (LPINSTRUCTION)instruction;
+	return hash;
 }
 
-LPINSTRUCTION ParseInstructionBreak(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Slot of the chunk with the given source bytes in an open addressing table of a power of two size, the slot is empty
+// if the table holds no such chunk, the bytes are only compared once the hash and length match
+static ULONG FindSourceChunk(LPSOURCECHUNK* table, ULONG size, ULONGLONG hash, LPCSTR text, ULONG length)
 {
-	LPINSTRUCTION instruction;
-	CHAR name[EMULATOR_COMMAND_NAME];
-
-	if(sscanf(text, "%s", name) != 1)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	ULONG slot = (ULONG)(hash ^ hash >> 32) & (size - 1);
 
-	instruction = HeapAlloc(GetProcessHeap(), 0, sizeof(INSTRUCTION));
-	if(!instruction)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
-		return NULL;
-	}
-	
-	instruction->command = command;
-	instruction->size = sizeof(INSTRUCTION);
+	while(table[slot] && (table[slot]->hash != hash || table[slot]->length != length || memcmp(table[slot]->source, text, length)))
+		slot = (slot + 1) & (size - 1);
 
-	return instruction;
+	return slot;
 }
 
-LPINSTRUCTION ParseDirectiveDefineWord(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
+// Splits the source into chunks that end after a line whose hash has its low bits clear, so an edit only changes the
+// chunks around it, the chunks the assembly holds from the last load (and repeated chunks) are assembled only once.
+// Only the assembly is skipped, every load still hashes and compares all of the source and copies the instructions of
+// every chunk into the code array
+static BOOL ParseSourceIncremental(LPEMULATOR emulator, LPCSTR source, LPCSTR end, LPASSEMBLY assembly)
 {
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR address[EMULATOR_COMMAND_ARGUMENT];
-	CHAR word[EMULATOR_COMMAND_ARGUMENT];
-	ULONG addr;
-	ULONG constant;
+	LPSOURCECHUNK* table;
+	LPSOURCECHUNK* chunks = NULL;
+	LPSOURCECHUNK* pending = NULL;
+	LPSOURCECHUNK* kept = NULL;
+	LPSOURCECHUNK chunk;
+	LPCSTR text = source;
+	LPCSTR start;
+	LPCSTR line;
+	ULONGLONG hash;
+	ULONGLONG digest;
+	ULONG lines;
+	ULONG count = 0;
+	ULONG size = 0;
+	ULONG parsed = 0;
+	ULONG capacity = 0;
+	ULONG reused = 0;
+	ULONG slots = 64;
+	ULONG slot;
+	ULONG index;
+	BOOL result = FALSE;
 
-	if(sscanf(text, "%s %s %s", name, address, word) != 3)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+	// Every chunk but the last holds at least EMULATOR_ASSEMBLY_LINES / 4 lines, the table is kept at most half full
+	while(slots / 2 < assembly->count + (ULONG)((end - source) / (EMULATOR_ASSEMBLY_LINES / 4)) + 1)
+		slots *= 2;
 
-	if(!ParseAddress(address, &addr))
+	table = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, slots * sizeof(LPSOURCECHUNK));
+	if(!table)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
 	}
 
-	if(!ParseConstant(word, &constant))
+	for(index = 0; index < assembly->count; ++index)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		chunk = assembly->chunks[index];
+		chunk->referenced = FALSE;
 
-	if(!IsValidAddressWrite(emulator, addr, 1))
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		table[FindSourceChunk(table, slots, chunk->hash, chunk->source, chunk->length)] = chunk;
 	}
 
-	emulator->memory[addr] = constant;
+	while(text < end)
+	{
+		start = text;
+		digest = 0xCBF29CE484222325;
+		lines = 0;
 
-	return LPINSTRUCTION_NONE;
-}
+		do
+		{
+			line = text;
+			text = memchr(text, '\n', end - text);
+			text = text ? text + 1 : end;
 
-LPINSTRUCTION ParseDirectiveDefineString(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text)
-{
-	CHAR name[EMULATOR_COMMAND_NAME];
-	CHAR address[EMULATOR_COMMAND_ARGUMENT];
-	CHAR string[EMULATOR_COMMAND_STRING];
-	CHAR processed[EMULATOR_COMMAND_STRING];
-	ULONG addr;
-	ULONG index[2];
+			hash = HashSourceLine(line, text);
+			digest = (digest ^ hash) * 0x100000001B3;
+			++lines;
+		}
+		while(text < end && lines < EMULATOR_ASSEMBLY_LINES * 4 && (lines < EMULATOR_ASSEMBLY_LINES / 4 || hash & (EMULATOR_ASSEMBLY_LINES - 1)));
 
-	if(sscanf(text, "%s %s \"%[^\"]s\"", name, address, string) != 3)
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		if(!GrowArray((LPVOID*)&chunks, &size, count + 1, sizeof(LPSOURCECHUNK)))
+			goto cleanup;
 
-	if(!ParseAddress(address, &addr))
-	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
-	}
+		slot = FindSourceChunk(table, slots, digest, start, (ULONG)(text - start));
+		chunk = table[slot];
 
-	for(index[0] = 0, index[1] = 0; string[index[0]]; ++index[0], ++index[1])
-	{
-		if(string[index[0]] == '\\')
+		if(!chunk)
 		{
-			++index[0];
+			if(!GrowArray((LPVOID*)&pending, &capacity, parsed + 1, sizeof(LPSOURCECHUNK)))
+				goto cleanup;
+
+			chunk = AllocateSourceChunk(start, text);
+			if(!chunk)
+				goto cleanup;
 
-			switch(string[index[0]])
+			chunk->hash = digest;
+			chunk->length = (ULONG)(text - start);
+
+			// The source of the load is gone by the next one, the chunk keeps its bytes to compare them
+			chunk->source = HeapAlloc(GetProcessHeap(), 0, chunk->length);
+			if(!chunk->source)
 			{
-			case '\\': processed[index[1]] = '\\'; break;
-			case 'a': processed[index[1]] = '\a'; break;
-			case 'b': processed[index[1]] = '\b'; break;
-			case 'f': processed[index[1]] = '\f'; break;
-			case 'n': processed[index[1]] = '\n'; break;
-			case 'r': processed[index[1]] = '\r'; break;
-			case 't': processed[index[1]] = '\t'; break;
-			case 'v': processed[index[1]] = '\v'; break;
-			case '"': processed[index[1]] = '"'; break;
-			case '0': processed[index[1]] = '\0'; break;
-			default: emulator->error = EMULATOR_ERROR_INVALID_INSTRUCTION; return NULL;
+				FreeSourceChunk(chunk);
+				goto cleanup;
 			}
+
+			CopyMemory(chunk->source, start, chunk->length);
+
+			table[slot] = chunk;
+			pending[parsed++] = chunk;
 		}
+		else if(!chunk->referenced)
+			++reused;
+
+		chunk->referenced = TRUE;
+		chunks[count++] = chunk;
+	}
+
+	kept = HeapAlloc(GetProcessHeap(), 0, (reused + parsed + 1) * sizeof(LPSOURCECHUNK));
+	if(!kept)
+		goto cleanup;
+
+	ParseSourceChunks(pending, parsed, emulator->capacity);
+	result = MergeSourceChunks(emulator, chunks, count);
+
+	// Keep the chunks of this load that assembled without an error, the chunk text is only valid during the load
+	reused = 0;
+
+	for(index = 0; index < assembly->count; ++index)
+	{
+		if(assembly->chunks[index]->referenced)
+			kept[reused++] = assembly->chunks[index];
 		else
-			processed[index[1]] = string[index[0]];
+			FreeSourceChunk(assembly->chunks[index]);
 	}
 
-	if(!IsValidAddressWrite(emulator, addr, index[1]))
+	for(index = 0; index < parsed; ++index)
 	{
-		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
-		return NULL;
+		pending[index]->text = NULL;
+		pending[index]->end = NULL;
+
+		if(pending[index]->emulator.error == EMULATOR_ERROR_NONE)
+			kept[reused++] = pending[index];
+		else
+			FreeSourceChunk(pending[index]);
 	}
 
-	for(index[0] = 0; index[0] < index[1]; ++index[0])
-		emulator->memory[addr + index[0]] = processed[index[0]];
+	if(assembly->chunks)
+		HeapFree(GetProcessHeap(), 0, assembly->chunks);
 
-	// TODO Reconsider automatic string null termination
-	//emulator->memory[addr + index] = 0;
+	assembly->chunks = kept;
+	assembly->count = reused;
+	assembly->parsed = parsed;
 
-	return LPINSTRUCTION_NONE;
+	// The chunks are owned by the assembly now
+	parsed = 0;
+
+cleanup:
+	if(!kept)
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+
+	for(index = 0; index < parsed; ++index)
+		FreeSourceChunk(pending[index]);
+
+	if(pending)
+		HeapFree(GetProcessHeap(), 0, pending);
+
+	if(chunks)
+		HeapFree(GetProcessHeap(), 0, chunks);
+
+	HeapFree(GetProcessHeap(), 0, table);
+
+	return result;
 }
 
-BOOL IsValidAddressRead(LPEMULATOR emulator, ULONG address, ULONG range)
+VOID InitializeAssembly(LPASSEMBLY assembly)
 {
-	if(address >= emulator->instructions && address + range < emulator->capacity)
-		return TRUE;
-
-	return FALSE;
+	ZeroMemory(assembly, sizeof(ASSEMBLY));
 }
 
-BOOL IsValidAddressWrite(LPEMULATOR emulator, ULONG address, ULONG range)
+VOID UninitializeAssembly(LPASSEMBLY assembly)
 {
-	if(address >= emulator->instructions && address + range < emulator->capacity)
-		return TRUE;
+	ULONG index;
 
-	return FALSE;
+	for(index = 0; index < assembly->count; ++index)
+		FreeSourceChunk(assembly->chunks[index]);
+
+	if(assembly->chunks)
+		HeapFree(GetProcessHeap(), 0, assembly->chunks);
+
+	ZeroMemory(assembly, sizeof(ASSEMBLY));
 }
 
-BOOL IsValidAddressExecute(LPEMULATOR emulator, ULONG address)
+VOID SetEmulatorCache(LPEMULATOR emulator, LPCSTR directory)
 {
-	if(address < emulator->instructions)
-		return TRUE;
-
-	return FALSE;
+	emulator->cache = directory;
 }
 
-BOOL ExecuteInstruction(LPEMULATOR emulator)
+// 128 bit hash of a source file, two lanes of the line hash with different multipliers
+static VOID HashSourceFile(LPCSTR text, LPCSTR end, ULONGLONG hash[2])
 {
-	LPINSTRUCTION instruction;
+	ULONGLONG word;
 
-	if(!IsValidAddressExecute(emulator, emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER]))
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-		return FALSE;
-	}
+	hash[0] = 0xCBF29CE484222325 ^ (ULONGLONG)(end - text);
+	hash[1] = 0x84222325CBF29CE4 ^ (ULONGLONG)(end - text);
 
-	instruction = (LPINSTRUCTION)emulator->memory[emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER]];
-	if(!instruction)
+	for(; end - text >= sizeof(word); text += sizeof(word))
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-		return FALSE;
+		CopyMemory(&word, text, sizeof(word));
+
+		hash[0] = (hash[0] ^ word) * 0x9E3779B97F4A7C15;
+		hash[0] ^= hash[0] >> 32;
+		hash[1] = (hash[1] ^ word) * 0xC2B2AE3D27D4EB4F;
+		hash[1] ^= hash[1] >> 29;
 	}
 
-	if(!instruction->command || !instruction->command->executor)
-		DebugBreak();	// Should not get here
+	word = 0;
+	CopyMemory(&word, text, end - text);
 
-	return instruction->command->executor(instruction, emulator);
+	hash[0] = (hash[0] ^ word) * 0x9E3779B97F4A7C15;
+	hash[0] ^= hash[0] >> 32;
+	hash[1] = (hash[1] ^ word) * 0xC2B2AE3D27D4EB4F;
+	hash[1] ^= hash[1] >> 29;
 }
 
-BOOL ExecuteInstructionJump(LPINSTRUCTION inst, LPEMULATOR emulator)
+// Path of the cache entry of a source, the entries are named by the source hash, the assembler and image versions and
+// the memory size, returns FALSE if the path does not fit
+static BOOL GetCachePath(LPEMULATOR emulator, LPCSTR source, LPCSTR end, LPSTR path)
 {
-	LPINSTRUCTIONJUMP instruction = (LPINSTRUCTIONJUMP)inst;
-	if(!instruction)
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
-		return FALSE;
-	}
-
-	switch(instruction->type)
-	{
-	case ARGUMENT_ADDRESS:
-		if(instruction->argument >= emulator->instructions)
-		{
-			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-			return FALSE;
-		}
+	ULONGLONG hash[2];
+	int length;
 
-		emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = instruction->argument;
-		break;
-
-	case ARGUMENT_REGISTER:
-		if(emulator->registers[instruction->argument] >= emulator->instructions)
-		{
-			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-			return FALSE;
-		}
+	HashSourceFile(source, end, hash);
 
-		emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = emulator->registers[instruction->argument];
-		break;
-	}
+	length = _snprintf(path, MAX_PATH, "%s\\%016llx%016llx-%u.%u-%08x.pimg", emulator->cache, hash[0], hash[1], EMULATOR_VERSION, EMULATOR_IMAGE_VERSION, emulator->capacity);
 
-	//++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];		// LOL
-	return TRUE;
+	return length > 0 && length < MAX_PATH;
 }
 
-BOOL ExecuteInstructionCond(LPINSTRUCTION inst, LPEMULATOR emulator)
+// Writes the loaded program to a new file in the cache directory and renames it to the entry, other processes only ever
+// see complete entries, an entry another process added in the meantime holds the same program and is kept
+static VOID SaveCachedProgram(LPEMULATOR emulator, LPCSTR path)
 {
-	LPINSTRUCTIONCOND instruction = (LPINSTRUCTIONCOND)inst;
-	if(!instruction)
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
-		return FALSE;
-	}
+	CHAR temporary[MAX_PATH];
 
-	switch(instruction->type)
-	{
-	case ARGUMENT_ADDRESS:
-		if(instruction->argument >= emulator->capacity)
-		{
-			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-			return FALSE;
-		}
+	if(!GetTempFileName(emulator->cache, "pim", 0, temporary))
+		return;
 
-		if(emulator->memory[instruction->argument])
-			++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
-		break;
+	// A cache that can't be written does not fail the load
+	if(!SaveProgramToFile(emulator, temporary))
+	{
+		emulator->error = EMULATOR_ERROR_NONE;
 
-	case ARGUMENT_REGISTER:
-		if(emulator->registers[instruction->argument])
-			++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
-		break;
+		DeleteFile(temporary);
+		return;
 	}
 
-	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
-	return TRUE;
+	if(!MoveFile(temporary, path))
+		DeleteFile(temporary);
 }
 
-BOOL ExecuteInstructionMove(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL LoadProgramFromSourceFile(LPEMULATOR emulator, LPCSTR path)
 {
-	LPINSTRUCTIONMOVE instruction = (LPINSTRUCTIONMOVE)inst;
-	if(!instruction)
+	return LoadProgramFromSourceFileEx(emulator, path, NULL);
+}
+
+BOOL LoadProgramFromSourceFileEx(LPEMULATOR emulator, LPCSTR path, LPASSEMBLY assembly)
+{
+	HANDLE file;
+	HANDLE mapping;
+	LARGE_INTEGER size;
+	SYSTEM_INFO information;
+	LPCSTR source = NULL;
+	CHAR cache[MAX_PATH];
+	ULONG chunks;
+	BOOL result;
+
+	file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if(file == INVALID_HANDLE_VALUE)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
 		return FALSE;
 	}
 
-	if(instruction->types[0] == ARGUMENT_CONSTANT)
+	if(!GetFileSizeEx(file, &size) || size.QuadPart > MAXDWORD)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		CloseHandle(file);
+
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
 		return FALSE;
 	}
 
-	if(instruction->types[0] == ARGUMENT_ADDRESS)
+	// The source is tokenized in place, empty files can't be mapped and hold no program
+	if(size.QuadPart)
 	{
-		if(!IsValidAddressWrite(emulator, instruction->arguments[0], 1))
+		mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if(mapping)
 		{
-			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
-			return FALSE;
+			source = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
 		}
 
-		if(instruction->types[1] == ARGUMENT_ADDRESS)
+		if(!source)
 		{
-			if(!IsValidAddressRead(emulator, instruction->arguments[1], 1))
-			{
-				SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
-				return FALSE;
-			}
+			CloseHandle(file);
 
-			emulator->memory[instruction->arguments[0]] = emulator->memory[instruction->arguments[1]];
+			SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+			return FALSE;
 		}
-		else if(instruction->types[1] == ARGUMENT_REGISTER)
+	}
+
+	CloseHandle(file);
+
+	// Program images can only be loaded into an emulator without code, the profiler needs the line of every instruction
+	if(emulator->cache && !emulator->code && !emulator->profile && GetCachePath(emulator, source, source + size.LowPart, cache))
+	{
+		if(LoadProgramFromFile(emulator, cache))
+		{
+			if(source)
+				UnmapViewOfFile(source);
+
+			return TRUE;
+		}
+
+		// A damaged entry is replaced by the assembled program
+		if(emulator->error == EMULATOR_ERROR_INVALID_IMAGE)
+			DeleteFile(cache);
+
+		emulator->error = EMULATOR_ERROR_NONE;
+	}
+	else
+		cache[0] = 0;
+
+	if(emulator->profile)
+		SetProfileSource(emulator, path);
+
+	// One chunk of at least EMULATOR_SOURCE_CHUNK bytes per processor
+	GetSystemInfo(&information);
+
+	chunks = size.LowPart / EMULATOR_SOURCE_CHUNK;
+	if(chunks > information.dwNumberOfProcessors)
+		chunks = information.dwNumberOfProcessors;
+	if(chunks > MAXIMUM_WAIT_OBJECTS)
+		chunks = MAXIMUM_WAIT_OBJECTS;
+
+	if(assembly)
+		result = ParseSourceIncremental(emulator, source, source + size.LowPart, assembly);
+	else if(chunks > 1)
+		result = ParseSourceParallel(emulator, source, source + size.LowPart, chunks);
+	else
+	{
+		result = ParseSource(emulator, source, source + size.LowPart, NULL, &emulator->line);
+		if(result)
+			FuseInstructions(emulator);
+	}
+
+	if(source)
+		UnmapViewOfFile(source);
+
+	if(!result)
+		return FALSE;
+
+	// The line is only kept for errors
+	emulator->line = 0;
+
+	if(cache[0])
+		SaveCachedProgram(emulator, cache);
+
+	if(!AnalyzeProgram(emulator))
+		return FALSE;
+
+	return SetEmulatorResetState(emulator);
+}
+
+LPPROGRAM CreateProgram(LPEMULATOR emulator)
+{
+	return CreateProgramEx(emulator, TRUE);
+}
+
+// Stores the pre-initialized memory as runs, the address and number of words of every run followed by its words, into
+// data (NULL only counts them), every committed span of the memory (memory that is not sparse is a single one) gives a
+// run from its first to its last nonzero word, returns the number of words the runs take up
+static ULONG GetProgramData(LPEMULATOR emulator, PULONG data, PULONG extent)
+{
+	ULONG size = 0;
+	ULONG address;
+	ULONG first;
+	ULONG last;
+	ULONG end;
+	BOOL committed;
+
+	for(address = 0; address < emulator->capacity; address = end)
+	{
+		end = address + GetEmulatorMemorySpan(emulator, address, &committed);
+
+		// Pages of sparse memory that were never committed hold zeroes and are not read
+		if(!committed)
+			continue;
+
+		for(first = address; first < end && !emulator->memory[first]; ++first);
+		for(last = end; last > first && !emulator->memory[last - 1]; --last);
+
+		if(first == last)
+			continue;
+
+		if(data)
+		{
+			data[size] = first;
+			data[size + 1] = last - first;
+			CopyMemory(&data[size + 2], &emulator->memory[first], (last - first) * sizeof(ULONG));
+		}
+
+		size += 2 + last - first;
+		*extent = last;
+	}
+
+	return size;
+}
+
+LPPROGRAM CreateProgramEx(LPEMULATOR emulator, BOOL memory)
+{
+	LPPROGRAM program;
+	ULONG size = 0;
+	ULONG extent = 0;
+
+	program = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PROGRAM));
+	if(!program)
+		return NULL;
+
+	if(memory)
+		size = GetProgramData(emulator, NULL, &extent);
+
+	if(size)
+	{
+		program->data = HeapAlloc(GetProcessHeap(), 0, size * sizeof(ULONG));
+		if(!program->data)
+		{
+			HeapFree(GetProcessHeap(), 0, program);
+			return NULL;
+		}
+
+		GetProgramData(emulator, program->data, &extent);
+	}
+
+	program->references = 1;
+	program->code = emulator->code;
+	program->instructions = emulator->instructions;
+	program->image = emulator->image;
+	program->size = size;
+	program->extent = extent;
+	CopyMemory(program->registers, emulator->registers, sizeof(program->registers));
+
+	// The code array belongs to the program from now on
+	emulator->program = program;
+	emulator->image = NULL;
+
+	return program;
+}
+
+BOOL AttachProgram(LPEMULATOR emulator, LPPROGRAM program)
+{
+	ULONG index;
+
+	if(emulator->code)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_IMAGE);
+		return FALSE;
+	}
+
+	if(program->instructions > EMULATOR_CODE_LIMIT || program->extent > emulator->capacity)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	InterlockedIncrement(&program->references);
+
+	for(index = 0; index < program->size; index += 2 + program->data[index + 1])
+		CopyMemory(&emulator->memory[program->data[index]], &program->data[index + 2], program->data[index + 1] * sizeof(ULONG));
+
+	CopyMemory(emulator->registers, program->registers, sizeof(emulator->registers));
+
+	emulator->program = program;
+	emulator->code = program->code;
+	emulator->instructions = program->instructions;
+	emulator->slots = program->instructions + EMULATOR_CODE_SENTINELS;
+
+	if(!AnalyzeProgram(emulator))
+		return FALSE;
+
+	return SetEmulatorResetState(emulator);
+}
+
+VOID ReleaseProgram(LPPROGRAM program)
+{
+	if(InterlockedDecrement(&program->references))
+		return;
+
+	if(program->image)
+		UnmapViewOfFile(program->image);
+	else if(program->code)
+		_aligned_free(program->code);
+
+	if(program->data)
+		HeapFree(GetProcessHeap(), 0, program->data);
+
+	HeapFree(GetProcessHeap(), 0, program);
+}
+
+// Checks an instruction of a binary program image, the interpreter relies on the same invariants the parsers establish
+static BOOL IsValidImageInstruction(LPINSTRUCTION code, ULONG address, ULONG instructions)
+{
+	LPINSTRUCTION instruction = &code[address];
+	ULONG index;
+	BYTE type;
+
+	if(instruction->type != GetFusedType(code, address, instructions))
+		return FALSE;
+
+	type = GetUnfusedType(INSTRUCTION_TYPE(instruction));
+	if(type == INSTRUCTION_NONE || type > INSTRUCTION_MEMCHR)
+		return FALSE;
+
+	if((instruction->type & INSTRUCTION_FLAG_REGISTERS) != GetInstructionFlags(instruction))
+		return FALSE;
+
+	for(index = 0; index < _countof(instruction->types); ++index)
+	{
+		if(instruction->types[index] > ARGUMENT_CHARACTER)
+			return FALSE;
+
+		if(instruction->types[index] == ARGUMENT_REGISTER && instruction->arguments[index] >= EMULATOR_REGISTERS)
+			return FALSE;
+	}
+
+	// Instructions writing a register name it in their first argument
+	if(type == INSTRUCTION_ADD || type == INSTRUCTION_SUB || type == INSTRUCTION_READ || type == INSTRUCTION_LOAD || type == INSTRUCTION_POP || type == INSTRUCTION_MEMCMP || type == INSTRUCTION_MEMCHR)
+	{
+		if(instruction->types[0] != ARGUMENT_REGISTER)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL LoadProgramFromFile(LPEMULATOR emulator, LPCSTR path)
+{
+	HANDLE file;
+	HANDLE mapping;
+	LARGE_INTEGER size;
+	LPBYTE image;
+	LPIMAGEHEADER header;
+	LPIMAGERUN run;
+	ULONGLONG offset;
+	ULONG index;
+
+	// The code array of an image can't be appended to
+	if(emulator->code)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_IMAGE);
+		return FALSE;
+	}
+
+	file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	if(!GetFileSizeEx(file, &size) || size.QuadPart < sizeof(IMAGEHEADER) || size.QuadPart > MAXDWORD)
+	{
+		CloseHandle(file);
+
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_IMAGE);
+		return FALSE;
+	}
+
+	mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+
+	if(!mapping)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	// The view keeps the mapping alive
+	image = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+
+	if(!image)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	header = (LPIMAGEHEADER)image;
+
+	if(header->signature != EMULATOR_IMAGE_SIGNATURE || header->version != EMULATOR_IMAGE_VERSION)
+		goto invalid;
+
+	if(header->instructions > EMULATOR_CODE_LIMIT || header->code % EMULATOR_CODE_ALIGNMENT || header->code < sizeof(IMAGEHEADER))
+		goto invalid;
+
+	if((ULONGLONG)header->code + ((ULONGLONG)header->instructions + EMULATOR_CODE_SENTINELS) * sizeof(INSTRUCTION) > (ULONGLONG)size.QuadPart)
+		goto invalid;
+
+	for(index = 0; index < header->instructions; ++index)
+	{
+		if(!IsValidImageInstruction((LPINSTRUCTION)(image + header->code), index, header->instructions))
+			goto invalid;
+	}
+
+	for(index = 0; index < EMULATOR_CODE_SENTINELS * sizeof(INSTRUCTION); ++index)
+	{
+		if(image[header->code + header->instructions * sizeof(INSTRUCTION) + index])
+			goto invalid;
+	}
+
+	// Validate all the data runs before touching the emulator memory
+	offset = header->data;
+	for(index = 0; index < header->runs; ++index)
+	{
+		if(offset + sizeof(IMAGERUN) > (ULONGLONG)size.QuadPart)
+			goto invalid;
+
+		run = (LPIMAGERUN)(image + offset);
+		if(run->address >= emulator->capacity || run->length > emulator->capacity - run->address)
+			goto invalid;
+
+		offset += sizeof(IMAGERUN) + (ULONGLONG)run->length * sizeof(ULONG);
+		if(offset > (ULONGLONG)size.QuadPart)
+			goto invalid;
+	}
+
+	offset = header->data;
+	for(index = 0; index < header->runs; ++index)
+	{
+		run = (LPIMAGERUN)(image + offset);
+		CopyMemory(&emulator->memory[run->address], run + 1, run->length * sizeof(ULONG));
+
+		offset += sizeof(IMAGERUN) + run->length * sizeof(ULONG);
+	}
+
+	CopyMemory(emulator->registers, header->registers, sizeof(emulator->registers));
+
+	emulator->image = image;
+	emulator->code = (LPINSTRUCTION)(image + header->code);
+	emulator->instructions = header->instructions;
+	emulator->slots = header->instructions + EMULATOR_CODE_SENTINELS;
+
+	if(!AnalyzeProgram(emulator))
+		return FALSE;
+
+	return SetEmulatorResetState(emulator);
+
+invalid:
+	UnmapViewOfFile(image);
+
+	SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_IMAGE);
+	return FALSE;
+}
+
+static BOOL WriteImage(HANDLE file, LPCVOID buffer, ULONG size)
+{
+	ULONG written;
+
+	if(!WriteFile(file, buffer, size, &written, NULL) || written != size)
+		return FALSE;
+
+	return TRUE;
+}
+
+BOOL SaveProgramToFile(LPEMULATOR emulator, LPCSTR path)
+{
+	HANDLE file;
+	IMAGEHEADER header;
+	IMAGERUN run;
+	INSTRUCTION padding[EMULATOR_CODE_ALIGNMENT / sizeof(INSTRUCTION)];
+	ULONG address;
+	ULONG end;
+	BOOL committed;
+
+	file = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	ZeroMemory(&header, sizeof(header));
+	ZeroMemory(padding, sizeof(padding));
+
+	header.signature = EMULATOR_IMAGE_SIGNATURE;
+	header.version = EMULATOR_IMAGE_VERSION;
+	header.instructions = emulator->instructions;
+	header.code = (sizeof(IMAGEHEADER) + EMULATOR_CODE_ALIGNMENT - 1) & ~(EMULATOR_CODE_ALIGNMENT - 1);
+	header.data = header.code + (header.instructions + EMULATOR_CODE_SENTINELS) * sizeof(INSTRUCTION);
+	CopyMemory(header.registers, emulator->registers, sizeof(header.registers));
+
+	// Header and code segment, the header is rewritten once the number of data runs is known
+	if(!WriteImage(file, &header, sizeof(header)) || !WriteImage(file, padding, header.code - sizeof(header)))
+		goto failed;
+
+	if(emulator->instructions && !WriteImage(file, emulator->code, emulator->instructions * sizeof(INSTRUCTION)))
+		goto failed;
+
+	if(!WriteImage(file, padding, EMULATOR_CODE_SENTINELS * sizeof(INSTRUCTION)))
+		goto failed;
+
+	// Data runs, zero words are left out since the emulator memory starts zeroed, pages of sparse memory that were never
+	// committed are skipped without reading them
+	for(address = 0; address < emulator->capacity; address = end)
+	{
+		end = address + GetEmulatorMemorySpan(emulator, address, &committed);
+		if(!committed)
+			continue;
+
+		for(; address < end; address += run.length)
+		{
+			if(!emulator->memory[address])
+			{
+				run.length = 1;
+				continue;
+			}
+
+			run.address = address;
+			for(run.length = 0; address + run.length < end && emulator->memory[address + run.length]; ++run.length);
+
+			if(!WriteImage(file, &run, sizeof(run)) || !WriteImage(file, &emulator->memory[address], run.length * sizeof(ULONG)))
+				goto failed;
+
+			++header.runs;
+		}
+	}
+
+	if(SetFilePointer(file, 0, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER || !WriteImage(file, &header, sizeof(header)))
+		goto failed;
+
+	CloseHandle(file);
+	return TRUE;
+
+failed:
+	CloseHandle(file);
+	DeleteFile(path);
+
+	SetEmulatorError(emulator, EMULATOR_ERROR_FILE_WRITE);
+	return FALSE;
+}
+
+// Reads a decimal number the way the %u conversion of sscanf does: an optional sign followed by at least one digit,
+// characters following the digits are ignored
+static BOOL ParseNumber(LPCSTR text, ULONG length, PULONG value)
+{
+	ULONG index = 0;
+	ULONG number = 0;
+	BOOL negative = FALSE;
+
+	if(length && (text[0] == '+' || text[0] == '-'))
+	{
+		negative = text[0] == '-';
+		++index;
+	}
+
+	if(index == length || text[index] < '0' || text[index] > '9')
+		return FALSE;
+
+	for(; index < length && text[index] >= '0' && text[index] <= '9'; ++index)
+		number = number * 10 + (text[index] - '0');
+
+	*value = negative ? 0 - number : number;
+
+	return TRUE;
+}
+
+BOOL ParseRegister(LPCSTR text, ULONG length, PULONG value)
+{
+	if(length == 2 && !_strnicmp(text, "pc", 2))
+		*value = EMULATOR_REGISTER_PROGRAM_COUNTER;
+	else if(length == 2 && !_strnicmp(text, "sp", 2))
+		*value = EMULATOR_REGISTER_STACK_POINTER;
+	else if(!length || text[0] != 'r' || !ParseNumber(text + 1, length - 1, value))
+		return FALSE;
+
+	if(*value >= EMULATOR_REGISTERS)
+		return FALSE;
+
+	return TRUE;
+}
+
+BOOL ParseAddress(LPCSTR text, ULONG length, PULONG value)
+{
+	return ParseNumber(text, length, value);
+}
+
+BOOL ParseConstant(LPCSTR text, ULONG length, PULONG value)
+{
+	if(!length || text[0] != '#')
+		return FALSE;
+
+	return ParseNumber(text + 1, length - 1, value);
+}
+
+BOOL ParseCharacter(LPCSTR text, ULONG length, PULONG value)
+{
+	if(length < 2 || text[0] != '\'')
+		return FALSE;
+
+	*value = (BYTE)text[1];
+
+	return TRUE;
+}
+
+// Classifies an argument token by its first character and parses it with the matching parser, returns the ARGUMENT_*
+// type of the argument or ARGUMENT_NONE if the token is malformed
+static ULONG ParseArgument(LPTOKEN token, PULONG value)
+{
+	switch(token->text[0])
+	{
+	case '#':
+		return ParseConstant(token->text, token->length, value) ? ARGUMENT_CONSTANT : ARGUMENT_NONE;
+
+	case '\'':
+		return ParseCharacter(token->text, token->length, value) ? ARGUMENT_CHARACTER : ARGUMENT_NONE;
+
+	case 'r':
+	case 'p':
+	case 'P':
+	case 's':
+	case 'S':
+		return ParseRegister(token->text, token->length, value) ? ARGUMENT_REGISTER : ARGUMENT_NONE;
+	}
+
+	return ParseAddress(token->text, token->length, value) ? ARGUMENT_ADDRESS : ARGUMENT_NONE;
+}
+
+// Parses the arguments of an instruction, types holds the ARGUMENT_MASK of the argument types accepted for every argument
+static LPINSTRUCTION ParseInstructionArguments(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line, const ULONG* types, ULONG count)
+{
+	LPINSTRUCTION instruction;
+	ULONG arguments[3];
+	ULONG kinds[3];
+	ULONG index;
+
+	// Tokens following the arguments are ignored
+	if(line->count < count + 1)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	for(index = 0; index < count; ++index)
+	{
+		kinds[index] = ParseArgument(&line->tokens[index + 1], &arguments[index]);
+
+		if(!(ARGUMENT_MASK(kinds[index]) & types[index]))
+		{
+			SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+			return NULL;
+		}
+	}
+
+	instruction = AllocateInstruction(command, emulator);
+	if(!instruction)
+		return NULL;
+
+	for(index = 0; index < count; ++index)
+	{
+		instruction->types[index] = (BYTE)kinds[index];
+		instruction->arguments[index] = arguments[index];
+	}
+
+	return instruction;
+}
+
+BYTE GetInstructionFlags(LPINSTRUCTION instruction)
+{
+	ULONG index;
+	BYTE flags = 0;
+
+	for(index = 0; index < _countof(instruction->types); ++index)
+	{
+		if(instruction->types[index] == ARGUMENT_REGISTER && instruction->arguments[index] >= EMULATOR_REGISTER_STACK_POINTER)
+			flags |= INSTRUCTION_FLAG_REGISTERS;
+	}
+
+	// Input is always handled by the executor
+	if(INSTRUCTION_TYPE(instruction) == INSTRUCTION_READ)
+		flags |= INSTRUCTION_FLAG_REGISTERS;
+
+	return flags;
+}
+
+VOID FuseInstructions(LPEMULATOR emulator)
+{
+	ULONG address;
+
+	for(address = 0; address < emulator->instructions; ++address)
+		emulator->code[address].type = GetFusedType(emulator->code, address, emulator->instructions);
+}
+
+// Checks the constant jump target or the constant memory addresses of an instruction
+static BOOL IsValidInstructionAddresses(LPEMULATOR emulator, LPINSTRUCTION instruction)
+{
+	ULONG index;
+
+	for(index = 0; index < _countof(instruction->types); ++index)
+	{
+		if(instruction->types[index] != ARGUMENT_ADDRESS)
+			continue;
+
+		if(GetUnfusedType(INSTRUCTION_TYPE(instruction)) == INSTRUCTION_JUMP)
+		{
+			if(!IsValidAddressExecute(emulator, instruction->arguments[index]))
+				return FALSE;
+		}
+		else if(!IsValidAddressRead(emulator, instruction->arguments[index], 1))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL AnalyzeProgram(LPEMULATOR emulator)
+{
+	PULONG blocks;
+	LPINSTRUCTION instruction;
+	ULONG address;
+	BYTE type;
+
+	blocks = HeapAlloc(GetProcessHeap(), 0, (emulator->instructions + EMULATOR_CODE_SENTINELS) * sizeof(ULONG));
+	if(!blocks)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	// The sentinels raise an exception however they are reached, the last block falls through into them
+	for(address = emulator->instructions; address < emulator->instructions + EMULATOR_CODE_SENTINELS; ++address)
+		blocks[address] = 1;
+
+	for(address = emulator->instructions; address--; )
+	{
+		instruction = &emulator->code[address];
+		type = GetUnfusedType(INSTRUCTION_TYPE(instruction));
+
+		// An instruction with an invalid constant address always raises an exception, the instructions falling through
+		// into it are stepped along with it so the interpreter never reaches it without the executor checking it
+		if((instruction->type & INSTRUCTION_FLAG_REGISTERS) || !IsValidInstructionAddresses(emulator, instruction))
+			blocks[address] = 0;
+		else if(type == INSTRUCTION_JUMP || type == INSTRUCTION_COND || type == INSTRUCTION_BREAK)
+			blocks[address] = 1;
+		// Instructions going through their executor can change the program counter, they end the block before them
+		else if(emulator->code[address + 1].type & INSTRUCTION_FLAG_REGISTERS)
+			blocks[address] = 1;
+		else
+			blocks[address] = blocks[address + 1] ? blocks[address + 1] + 1 : 0;
+	}
+
+	if(emulator->blocks)
+		HeapFree(GetProcessHeap(), 0, emulator->blocks);
+
+	emulator->blocks = blocks;
+
+	return TRUE;
+}
+
+LPINSTRUCTION AllocateInstruction(LPCOMMAND command, LPEMULATOR emulator)
+{
+	LPINSTRUCTION instruction;
+	LPINSTRUCTION code;
+	ULONG slots;
+
+	// Mapped program images and shared programs are read-only
+	if(emulator->instructions >= EMULATOR_CODE_LIMIT || emulator->image || emulator->program)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return NULL;
+	}
+
+	if(emulator->instructions + 1 + EMULATOR_CODE_SENTINELS > emulator->slots)
+	{
+		slots = emulator->slots ? emulator->slots * 2 : EMULATOR_CODE_SLOTS;
+		if(slots > EMULATOR_CODE_LIMIT + EMULATOR_CODE_SENTINELS)
+			slots = EMULATOR_CODE_LIMIT + EMULATOR_CODE_SENTINELS;
+
+		code = _aligned_realloc(emulator->code, slots * sizeof(INSTRUCTION), EMULATOR_CODE_ALIGNMENT);
+		if(!code)
+		{
+			SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+			return NULL;
+		}
+
+		emulator->code = code;
+		emulator->slots = slots;
+	}
+
+	// Clear the slot along with the sentinels that follow it
+	instruction = &emulator->code[emulator->instructions];
+	ZeroMemory(instruction, (1 + EMULATOR_CODE_SENTINELS) * sizeof(INSTRUCTION));
+
+	instruction->type = (BYTE)command->type;
+
+	return instruction;
+}
+
+// FNV-1a hash of a case folded command name, the seed selects one of a family of functions
+static ULONG HashCommandName(LPCSTR name, ULONG length, ULONG seed)
+{
+	ULONG hash = 0x811C9DC5 ^ seed;
+
+	while(length--)
+		hash = (hash ^ (BYTE)(*name++ | 0x20)) * 0x01000193;
+
+	return (hash ^ (hash >> 16)) & (EMULATOR_COMMAND_HASH - 1);
+}
+
+// Searches for a seed under which no two command names share a slot of the hash table
+static BOOL CALLBACK InitializeCommandTable(PINIT_ONCE once, PVOID parameter, PVOID* context)
+{
+	ULONG seed;
+	ULONG index;
+	ULONG slot;
+
+	for(seed = 0; ; ++seed)
+	{
+		ZeroMemory(commandTable, sizeof(commandTable));
+
+		for(index = 0; index < _countof(commands); ++index)
+		{
+			slot = HashCommandName(commands[index].name, lstrlen(commands[index].name), seed);
+			if(commandTable[slot])
+				break;
+
+			commandTable[slot] = (BYTE)(index + 1);
+		}
+
+		if(index == _countof(commands))
+			break;
+	}
+
+	commandSeed = seed;
+
+	return TRUE;
+}
+
+LPINSTRUCTION ParseCommand(LPEMULATOR emulator, LPSOURCELINE line)
+{
+	LPTOKEN name = &line->tokens[0];
+	LPCOMMAND command;
+	BYTE index;
+
+	if(!line->count)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	InitOnceExecuteOnce(&commandTableOnce, InitializeCommandTable, NULL, NULL);
+
+	// A single probe, the slot holds the only command the name can match
+	index = commandTable[HashCommandName(name->text, name->length, commandSeed)];
+	if(index)
+	{
+		command = &commands[index - 1];
+
+		if(!_strnicmp(command->name, name->text, name->length) && !command->name[name->length])
+			return command->parser(command, emulator, line);
+	}
+
+	SetEmulatorError(emulator, EMULATOR_ERROR_UNKNOWN_INSTRUCTION);
+	return NULL;
+}
+
+LPINSTRUCTION ParseInstructionJump(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionCond(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionMove(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionAdd(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionSub(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT) | ARGUMENT_MASK(ARGUMENT_ADDRESS),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionWrite(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CHARACTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionRead(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionLoad(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionStore(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionPush(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionPop(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionBreak(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	return ParseInstructionArguments(command, emulator, line, NULL, 0);
+}
+
+LPINSTRUCTION ParseInstructionMemcpy(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseInstructionMemset(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CHARACTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+// The register holds the number of words to compare and receives the result
+LPINSTRUCTION ParseInstructionMemcmp(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+// The register holds the number of words to scan and receives the result
+LPINSTRUCTION ParseInstructionMemchr(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	static const ULONG types[] =
+	{
+		ARGUMENT_MASK(ARGUMENT_REGISTER),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+		ARGUMENT_MASK(ARGUMENT_REGISTER) | ARGUMENT_MASK(ARGUMENT_CHARACTER) | ARGUMENT_MASK(ARGUMENT_CONSTANT),
+	};
+
+	return ParseInstructionArguments(command, emulator, line, types, _countof(types));
+}
+
+LPINSTRUCTION ParseDirectiveDefineWord(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	PULONG words;
+	ULONG addr;
+	ULONG constant;
+
+	if(line->count < 3)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	if(!ParseAddress(line->tokens[1].text, line->tokens[1].length, &addr))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	if(!ParseConstant(line->tokens[2].text, line->tokens[2].length, &constant))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	words = ReserveData(emulator, line, addr, 1);
+	if(!words)
+		return NULL;
+
+	*words = constant;
+
+	return LPINSTRUCTION_NONE;
+}
+
+// Returns the character of a string escape sequence, -1 if the sequence is unknown
+static LONG GetEscapedCharacter(CHAR character)
+{
+	switch(character)
+	{
+	case '\\': return '\\';
+	case 'a': return '\a';
+	case 'b': return '\b';
+	case 'f': return '\f';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
+	case 'v': return '\v';
+	case '"': return '"';
+	case '0': return '\0';
+	}
+
+	return -1;
+}
+
+LPINSTRUCTION ParseDirectiveDefineString(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line)
+{
+	PULONG words;
+	LPCSTR string;
+	LPCSTR end;
+	LPCSTR text;
+	ULONG addr;
+	ULONG length = 0;
+
+	// The string runs from the opening quote to the closing quote (or the end of the line) and may contain whitespace
+	if(line->count < 3 || line->tokens[2].text[0] != '"')
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	if(!ParseAddress(line->tokens[1].text, line->tokens[1].length, &addr))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	string = line->tokens[2].text + 1;
+	for(end = string; end < line->end && *end != '"'; ++end);
+
+	// Count the characters and validate the escape sequences before touching the memory
+	for(text = string; text < end; ++text, ++length)
+	{
+		if(*text == '\\' && (++text == end || GetEscapedCharacter(*text) < 0))
+		{
+			SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+			return NULL;
+		}
+	}
+
+	if(!length)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_INSTRUCTION);
+		return NULL;
+	}
+
+	words = ReserveData(emulator, line, addr, length);
+	if(!words)
+		return NULL;
+
+	for(text = string; text < end; ++text)
+	{
+		if(*text == '\\')
+			*words++ = (CHAR)GetEscapedCharacter(*++text);
+		else
+			*words++ = *text;
+	}
+
+	// TODO Reconsider automatic string null termination
+	//*words = 0;
+
+	return LPINSTRUCTION_NONE;
+}
+
+BOOL IsValidAddressRead(LPEMULATOR emulator, ULONG address, ULONG range)
+{
+	// The whole memory holds data, written so address + range can not wrap around
+	if(address < emulator->capacity && range <= emulator->capacity - address)
+		return TRUE;
+
+	return FALSE;
+}
+
+BOOL IsValidAddressWrite(LPEMULATOR emulator, ULONG address, ULONG range)
+{
+	if(address < emulator->capacity && range <= emulator->capacity - address)
+		return TRUE;
+
+	return FALSE;
+}
+
+BOOL IsValidAddressExecute(LPEMULATOR emulator, ULONG address)
+{
+	if(address < emulator->instructions)
+		return TRUE;
+
+	return FALSE;
+}
+
+BOOL ExecuteInstruction(LPEMULATOR emulator)
+{
+	LPINSTRUCTION instruction;
+
+	if(!IsValidAddressExecute(emulator, emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER]))
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	instruction = &emulator->code[emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER]];
+	if(INSTRUCTION_TYPE(instruction) >= INSTRUCTION_COUNT || !executors[INSTRUCTION_TYPE(instruction)])
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	return executors[INSTRUCTION_TYPE(instruction)](instruction, emulator);
+}
+
+BOOL ExecuteInstructionJump(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	switch(instruction->types[0])
+	{
+	case ARGUMENT_ADDRESS:
+		if(instruction->arguments[0] >= emulator->instructions)
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+			return FALSE;
+		}
+
+		emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = instruction->arguments[0];
+		break;
+
+	case ARGUMENT_REGISTER:
+		if(emulator->registers[instruction->arguments[0]] >= emulator->instructions)
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+			return FALSE;
+		}
+
+		emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = emulator->registers[instruction->arguments[0]];
+		break;
+	}
+
+	//++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];		// LOL
+	return TRUE;
+}
+
+BOOL ExecuteInstructionCond(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	switch(instruction->types[0])
+	{
+	case ARGUMENT_ADDRESS:
+		if(instruction->arguments[0] >= emulator->capacity)
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+			return FALSE;
+		}
+
+		if(emulator->memory[instruction->arguments[0]])
+			++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+		break;
+
+	case ARGUMENT_REGISTER:
+		if(emulator->registers[instruction->arguments[0]])
+			++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+		break;
+	}
+
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionMove(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[0] == ARGUMENT_CONSTANT)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[0] == ARGUMENT_ADDRESS)
+	{
+		if(!IsValidAddressWrite(emulator, instruction->arguments[0], 1))
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+			return FALSE;
+		}
+
+		if(instruction->types[1] == ARGUMENT_ADDRESS)
+		{
+			if(!IsValidAddressRead(emulator, instruction->arguments[1], 1))
+			{
+				SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+				return FALSE;
+			}
+
+			emulator->memory[instruction->arguments[0]] = emulator->memory[instruction->arguments[1]];
+		}
+		else if(instruction->types[1] == ARGUMENT_REGISTER)
 		{
 			emulator->memory[instruction->arguments[0]] = emulator->registers[instruction->arguments[1]];
 		}
@@ -985,10 +2315,9 @@ BOOL ExecuteInstructionMove(LPINSTRUCTION inst, LPEMULATOR emulator)
 	return TRUE;
 }
 
-BOOL ExecuteInstructionAdd(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL ExecuteInstructionAdd(LPINSTRUCTION instruction, LPEMULATOR emulator)
 {
 	ULONG values[2];
-	LPINSTRUCTIONARTH instruction = (LPINSTRUCTIONARTH)inst;
 	if(!instruction)
 	{
 		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
@@ -1041,10 +2370,9 @@ BOOL ExecuteInstructionAdd(LPINSTRUCTION inst, LPEMULATOR emulator)
 	return TRUE;
 }
 
-BOOL ExecuteInstructionSub(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL ExecuteInstructionSub(LPINSTRUCTION instruction, LPEMULATOR emulator)
 {
 	ULONG values[2];
-	LPINSTRUCTIONARTH instruction = (LPINSTRUCTIONARTH)inst;
 	if(!instruction)
 	{
 		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
@@ -1067,231 +2395,775 @@ BOOL ExecuteInstructionSub(LPINSTRUCTION inst, LPEMULATOR emulator)
 		values[0] = instruction->arguments[1];
 	else
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[2] == ARGUMENT_REGISTER)
+		values[1] = emulator->registers[instruction->arguments[2]];
+	else if(instruction->types[2] == ARGUMENT_ADDRESS)
+	{
+		if(!IsValidAddressRead(emulator, instruction->arguments[2], 1))
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+			return FALSE;
+		}
+
+		values[1] = emulator->memory[instruction->arguments[2]];
+	}
+	else if(instruction->types[2] == ARGUMENT_CONSTANT)
+		values[1] = instruction->arguments[2];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	emulator->registers[instruction->arguments[0]] = values[0] - values[1];
+
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionWrite(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	CHAR character;
+
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[0] == ARGUMENT_CHARACTER || instruction->types[0] == ARGUMENT_CONSTANT)
+		character = (CHAR)instruction->arguments[0];
+	else if(instruction->types[0] == ARGUMENT_REGISTER)
+		character = (CHAR)emulator->registers[instruction->arguments[0]];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	// The WRITE is executed again once the output channel caught up
+	if(!WriteEmulatorOutput(emulator, character))
+		return FALSE;
+
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionRead(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[0] != ARGUMENT_REGISTER)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	// Prompts written by the guest have to be visible before it blocks on input, the READ is executed again once an output
+	// channel caught up
+	if(emulator->output.loop)
+	{
+		if(!WaitChannelOutput(emulator))
+			return FALSE;
+	}
+	else
+		FlushEmulatorOutput(emulator);
+
+	// Only the low byte of the register is replaced, at the end of input the register is left unchanged
+	ReadEmulatorInput(emulator, (LPBYTE)&emulator->registers[instruction->arguments[0]]);
+
+	// The READ is executed again once input arrived
+	if(emulator->waiting)
+		return FALSE;
+
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionLoad(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	ULONG address;
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[1] == ARGUMENT_REGISTER)
+		address = emulator->registers[instruction->arguments[1]];
+	else if(instruction->types[1] == ARGUMENT_CONSTANT)
+		address = instruction->arguments[1];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+	
+	if(!IsValidAddressRead(emulator, address, 1))
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+		return FALSE;
+	}
+
+	emulator->registers[instruction->arguments[0]] = emulator->memory[address];
+
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionStore(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	ULONG address;
+	ULONG value;
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[0] == ARGUMENT_REGISTER)
+		address = emulator->registers[instruction->arguments[0]];
+	else if(instruction->types[0] == ARGUMENT_CONSTANT)
+		address = instruction->arguments[0];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(instruction->types[1] == ARGUMENT_REGISTER)
+		value = emulator->registers[instruction->arguments[1]];
+	else if(instruction->types[1] == ARGUMENT_CONSTANT)
+		value = instruction->arguments[1];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+	
+	if(!IsValidAddressWrite(emulator, address, 1))
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+		return FALSE;
+	}
+
+	emulator->memory[address] = value;
+
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionPush(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	ULONG value;
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(!IsValidAddressWrite(emulator, emulator->registers[EMULATOR_REGISTER_STACK_POINTER], 1))
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+		return FALSE;
+	}
+
+	if(instruction->types[0] == ARGUMENT_REGISTER)
+		value = emulator->registers[instruction->arguments[0]];
+	else if(instruction->types[0] == ARGUMENT_CONSTANT)
+		value = instruction->arguments[0];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	emulator->memory[emulator->registers[EMULATOR_REGISTER_STACK_POINTER]] = value;
+
+	++emulator->registers[EMULATOR_REGISTER_STACK_POINTER];
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionPop(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	if(!IsValidAddressRead(emulator, emulator->registers[EMULATOR_REGISTER_STACK_POINTER] - 1, 1))
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+		return FALSE;
+	}
+
+	emulator->registers[instruction->arguments[0]] = emulator->memory[emulator->registers[EMULATOR_REGISTER_STACK_POINTER] - 1];
+
+	--emulator->registers[EMULATOR_REGISTER_STACK_POINTER];
+	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	return TRUE;
+}
+
+BOOL ExecuteInstructionBreak(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+		return FALSE;
+	}
+
+	SetEmulatorException(emulator, EMULATOR_EXCEPTION_NONE);
+	return FALSE;
+}
+
+// Fetches an argument of a bulk memory instruction, the parsers only accept characters for the value arguments
+static BOOL FetchBulkArgument(LPINSTRUCTION instruction, LPEMULATOR emulator, ULONG index, PULONG value)
+{
+	if(instruction->types[index] == ARGUMENT_REGISTER)
+		*value = emulator->registers[instruction->arguments[index]];
+	else if(instruction->types[index] == ARGUMENT_CONSTANT || instruction->types[index] == ARGUMENT_CHARACTER)
+		*value = instruction->arguments[index];
+	else
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL ExecuteInstructionMemcpy(LPINSTRUCTION instruction, LPEMULATOR emulator)
+{
+	ULONG destination;
+	ULONG source;
+	ULONG length;
+	if(!instruction)
+	{
+		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
 		return FALSE;
 	}
 
-	if(instruction->types[2] == ARGUMENT_REGISTER)
-		values[1] = emulator->registers[instruction->arguments[2]];
-	else if(instruction->types[2] == ARGUMENT_ADDRESS)
+	if(!FetchBulkArgument(instruction, emulator, 0, &destination) || !FetchBulkArgument(instruction, emulator, 1, &source) || !FetchBulkArgument(instruction, emulator, 2, &length))
+		return FALSE;
+
+	// A zero length accesses nothing, otherwise both ranges are checked before the first word is copied
+	if(length)
 	{
-		if(!IsValidAddressRead(emulator, instruction->arguments[2], 1))
+		if(!IsValidAddressWrite(emulator, destination, length) || !IsValidAddressRead(emulator, source, length))
 		{
 			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
 			return FALSE;
 		}
 
-		values[1] = emulator->memory[instruction->arguments[2]];
-	}
-	else if(instruction->types[2] == ARGUMENT_CONSTANT)
-		values[1] = instruction->arguments[2];
-	else
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-		return FALSE;
+		CopyWords(&emulator->memory[destination], &emulator->memory[source], length);
 	}
 
-	emulator->registers[instruction->arguments[0]] = values[0] - values[1];
-
 	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionWrite(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL ExecuteInstructionMemset(LPINSTRUCTION instruction, LPEMULATOR emulator)
 {
-	ULONG written;
-	LPINSTRUCTIONIO instruction = (LPINSTRUCTIONIO)inst;
+	ULONG destination;
+	ULONG value;
+	ULONG length;
 	if(!instruction)
 	{
 		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
 		return FALSE;
 	}
 
-	if(instruction->type == ARGUMENT_CHARACTER || instruction->type == ARGUMENT_CONSTANT)
-		WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), &instruction->argument, 1, &written, NULL);
-	else if(instruction->type == ARGUMENT_REGISTER)
-		WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), &emulator->registers[instruction->argument], 1, &written, NULL);
-	else
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+	if(!FetchBulkArgument(instruction, emulator, 0, &destination) || !FetchBulkArgument(instruction, emulator, 1, &value) || !FetchBulkArgument(instruction, emulator, 2, &length))
 		return FALSE;
+
+	if(length)
+	{
+		if(!IsValidAddressWrite(emulator, destination, length))
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+			return FALSE;
+		}
+
+		FillWords(&emulator->memory[destination], value, length);
 	}
 
 	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionRead(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL ExecuteInstructionMemcmp(LPINSTRUCTION instruction, LPEMULATOR emulator)
 {
-	ULONG read;
-	ULONG mode;
-	LPINSTRUCTIONIO instruction = (LPINSTRUCTIONIO)inst;
+	ULONG first;
+	ULONG second;
+	ULONG length;
+	ULONG index;
+	ULONG result = 0;
 	if(!instruction)
 	{
 		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
 		return FALSE;
 	}
 
-	GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &mode);
-	SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), mode & ~ENABLE_LINE_INPUT & ~ENABLE_ECHO_INPUT);
-	
-	if(instruction->type == ARGUMENT_REGISTER)
-		ReadConsole(GetStdHandle(STD_INPUT_HANDLE), &emulator->registers[instruction->argument], 1, &read, NULL);
-	else
+	if(!FetchBulkArgument(instruction, emulator, 1, &first) || !FetchBulkArgument(instruction, emulator, 2, &second))
+		return FALSE;
+
+	length = emulator->registers[instruction->arguments[0]];
+
+	if(length)
 	{
-		SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), mode);
+		if(!IsValidAddressRead(emulator, first, length) || !IsValidAddressRead(emulator, second, length))
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+			return FALSE;
+		}
 
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-		return FALSE;
+		// 1 or -1 as the first differing word of the first range is above or below the one of the second range
+		index = CompareWords(&emulator->memory[first], &emulator->memory[second], length);
+		if(index != length)
+			result = emulator->memory[first + index] > emulator->memory[second + index] ? 1 : (ULONG)-1;
 	}
 
-	SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), mode);
+	emulator->registers[instruction->arguments[0]] = result;
 
 	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionLoad(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL ExecuteInstructionMemchr(LPINSTRUCTION instruction, LPEMULATOR emulator)
 {
 	ULONG address;
-	LPINSTRUCTIONMEMORY instruction = (LPINSTRUCTIONMEMORY)inst;
+	ULONG value;
+	ULONG length;
+	ULONG available;
+	ULONG index = 0;
 	if(!instruction)
 	{
 		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
 		return FALSE;
 	}
 
-	if(instruction->types[1] == ARGUMENT_REGISTER)
-		address = emulator->registers[instruction->arguments[1]];
-	else if(instruction->types[1] == ARGUMENT_CONSTANT)
-		address = instruction->arguments[1];
-	else
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+	if(!FetchBulkArgument(instruction, emulator, 1, &address) || !FetchBulkArgument(instruction, emulator, 2, &value))
 		return FALSE;
-	}
-	
-	if(!IsValidAddressRead(emulator, address, 1))
+
+	length = emulator->registers[instruction->arguments[0]];
+
+	// Like the LOAD loop it replaces the scan only reads the words up to the match, so a length running past the end of
+	// the memory is only a fault if the value is not found before the end
+	if(length)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
-		return FALSE;
+		available = address < emulator->capacity ? emulator->capacity - address : 0;
+		if(available > length)
+			available = length;
+
+		if(available)
+			index = ScanWords(&emulator->memory[address], value, available);
+
+		if(index == available && available != length)
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+			return FALSE;
+		}
 	}
 
-	emulator->registers[instruction->arguments[0]] = emulator->memory[address];
+	emulator->registers[instruction->arguments[0]] = index;
 
 	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionStore(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL SetEmulatorOutputBuffer(LPEMULATOR emulator, ULONG size)
 {
-	ULONG address;
-	ULONG value;
-	LPINSTRUCTIONMEMORY instruction = (LPINSTRUCTIONMEMORY)inst;
-	if(!instruction)
+	LPBYTE buffer = NULL;
+
+	if(size)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
-		return FALSE;
+		buffer = HeapAlloc(GetProcessHeap(), 0, size);
+		if(!buffer)
+			return FALSE;
 	}
 
-	if(instruction->types[0] == ARGUMENT_REGISTER)
-		address = emulator->registers[instruction->arguments[0]];
-	else if(instruction->types[0] == ARGUMENT_CONSTANT)
-		address = instruction->arguments[0];
+	// A channel can't do without a buffer, the event loop writes from a copy of it
+	if(emulator->output.loop)
+	{
+		if(!size)
+		{
+			if(buffer)
+				HeapFree(GetProcessHeap(), 0, buffer);
+
+			return FALSE;
+		}
+
+		DrainChannelOutput(&emulator->output);
+	}
 	else
+		FlushEmulatorOutput(emulator);
+
+	if(emulator->output.buffer)
+		HeapFree(GetProcessHeap(), 0, emulator->output.buffer);
+
+	emulator->output.buffer = buffer;
+	emulator->output.size = size;
+
+	return TRUE;
+}
+
+BOOL SetEmulatorOutput(LPEMULATOR emulator, HANDLE handle)
+{
+	ULONG mode;
+
+	// Output written by an event loop is written before the handle changes
+	CloseChannelOutput(&emulator->output);
+	FlushEmulatorOutput(emulator);
+
+	emulator->output.handle = handle;
+	emulator->output.console = handle && GetConsoleMode(handle, &mode);
+
+	// Collecting output needs a buffer
+	if(!handle && !emulator->output.buffer)
+		return SetEmulatorOutputBuffer(emulator, EMULATOR_OUTPUT_BUFFER);
+
+	return TRUE;
+}
+
+VOID SetEmulatorInput(LPEMULATOR emulator, HANDLE handle)
+{
+	emulator->input.handle = handle;
+}
+
+VOID SetEmulatorInputCallback(LPEMULATOR emulator, VOID (CALLBACK* callback)(LPVOID context), LPVOID context)
+{
+	LPEMULATORINPUT input = &emulator->input;
+
+	// The prefetch thread and the event loop call the callback with the lock held
+	if(input->thread || input->type == EMULATOR_INPUT_CHANNEL)
+		EnterCriticalSection(&input->lock);
+
+	input->callback = callback;
+	input->context = context;
+	input->waiting = FALSE;
+
+	if(input->thread || input->type == EMULATOR_INPUT_CHANNEL)
+		LeaveCriticalSection(&input->lock);
+}
+
+VOID SetEmulatorOutputCallback(LPEMULATOR emulator, VOID (CALLBACK* callback)(LPVOID context), LPVOID context)
+{
+	LPEMULATOROUTPUT output = &emulator->output;
+
+	// The event loop calls the callback with the lock held
+	if(output->loop)
+		EnterCriticalSection(&output->lock);
+
+	output->callback = callback;
+	output->context = context;
+	output->waiting = FALSE;
+
+	if(output->loop)
+		LeaveCriticalSection(&output->lock);
+}
+
+BOOL WriteEmulatorOutput(LPEMULATOR emulator, CHAR character)
+{
+	LPEMULATOROUTPUT output = &emulator->output;
+	ULONG written;
+
+	LPBYTE buffer;
+
+	if(!output->buffer)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-		return FALSE;
+		WriteFile(output->handle, &character, 1, &written, NULL);
+		return TRUE;
 	}
 
-	if(instruction->types[1] == ARGUMENT_REGISTER)
-		value = emulator->registers[instruction->arguments[1]];
-	else if(instruction->types[1] == ARGUMENT_CONSTANT)
-		value = instruction->arguments[1];
-	else
+	// Collected output is kept until the caller takes it
+	if(!output->handle)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
-		return FALSE;
+		if(output->used == output->size)
+		{
+			buffer = HeapReAlloc(GetProcessHeap(), 0, output->buffer, output->size * 2);
+			if(!buffer)
+				return TRUE;
+
+			output->buffer = buffer;
+			output->size *= 2;
+		}
+
+		output->buffer[output->used++] = character;
+		return TRUE;
 	}
-	
-	if(!IsValidAddressWrite(emulator, address, 1))
+
+	if(output->loop)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
-		return FALSE;
+		// A full buffer waits for the event loop once the backlog is reached
+		if(output->used == output->size && !WaitChannelOutput(emulator))
+			return FALSE;
+
+		output->buffer[output->used++] = character;
+
+		// Lines of a channel are handed to the event loop right away like lines of a console
+		if(character == '\n')
+			PostChannelOutput(output);
+
+		return TRUE;
 	}
 
-	emulator->memory[address] = value;
+	output->buffer[output->used++] = character;
+
+	if(output->used == output->size || (character == '\n' && output->console))
+		FlushEmulatorOutput(emulator);
 
-	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionPush(LPINSTRUCTION inst, LPEMULATOR emulator)
+VOID FlushEmulatorOutput(LPEMULATOR emulator)
 {
-	ULONG value;
-	LPINSTRUCTIONSTACK instruction = (LPINSTRUCTIONSTACK)inst;
-	if(!instruction)
+	LPEMULATOROUTPUT output = &emulator->output;
+	ULONG written;
+	ULONG offset;
+
+	if(!output->handle)
+		return;
+
+	if(output->loop)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
-		return FALSE;
+		FlushChannelOutput(output);
+		return;
 	}
 
-	if(!IsValidAddressWrite(emulator, emulator->registers[EMULATOR_REGISTER_STACK_POINTER], 1))
+	// WriteFile works for consoles as well as for redirected output (pipes and files)
+	for(offset = 0; offset < output->used; offset += written)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
-		return FALSE;
+		if(!WriteFile(output->handle, output->buffer + offset, output->used - offset, &written, NULL) || !written)
+			break;
 	}
 
-	if(instruction->type == ARGUMENT_REGISTER)
-		value = emulator->registers[instruction->argument];
-	else if(instruction->type == ARGUMENT_CONSTANT)
-		value = instruction->argument;
-	else
+	output->used = 0;
+}
+
+// Fills the input buffer from a pipe or a file until the end of input or until the emulator is uninitialized
+static DWORD WINAPI PrefetchEmulatorInput(LPVOID parameter)
+{
+	LPEMULATORINPUT input = parameter;
+	ULONG offset;
+	ULONG length;
+	ULONG read;
+	BOOL result;
+
+	EnterCriticalSection(&input->lock);
+
+	while(!input->stop && !input->end)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+		if(input->tail - input->released == EMULATOR_INPUT_BUFFER)
+		{
+			SleepConditionVariableCS(&input->space, &input->lock, INFINITE);
+			continue;
+		}
+
+		// Largest contiguous free part of the ring buffer, only this thread advances tail
+		offset = input->tail % EMULATOR_INPUT_BUFFER;
+		length = EMULATOR_INPUT_BUFFER - (input->tail - input->released);
+		if(length > EMULATOR_INPUT_BUFFER - offset)
+			length = EMULATOR_INPUT_BUFFER - offset;
+
+		LeaveCriticalSection(&input->lock);
+		result = ReadFile(input->handle, input->buffer + offset, length, &read, NULL);
+		EnterCriticalSection(&input->lock);
+
+		if(!result || !read)
+			input->end = TRUE;
+		else
+			input->tail += read;
+
+		WakeConditionVariable(&input->available);
+
+		// A READ that found no input is executed again by whoever the callback wakes up
+		if(input->waiting)
+		{
+			input->waiting = FALSE;
+			input->callback(input->context);
+		}
+	}
+
+	LeaveCriticalSection(&input->lock);
+	return 0;
+}
+
+// Detects the type of the input handle and allocates the input buffer
+static BOOL InitializeEmulatorInput(LPEMULATOR emulator)
+{
+	LPEMULATORINPUT input = &emulator->input;
+
+	input->buffer = HeapAlloc(GetProcessHeap(), 0, EMULATOR_INPUT_BUFFER);
+	if(!input->buffer)
 		return FALSE;
+
+	if(!input->handle)
+		input->handle = GetStdHandle(STD_INPUT_HANDLE);
+
+	// The event loop keeps a read in flight from now on
+	if(input->loop)
+	{
+		input->type = EMULATOR_INPUT_CHANNEL;
+
+		InitializeCriticalSection(&input->lock);
+		InitializeConditionVariable(&input->available);
+
+		EnterCriticalSection(&input->lock);
+		StartChannelRead(input);
+		LeaveCriticalSection(&input->lock);
+
+		return TRUE;
 	}
 
-	emulator->memory[emulator->registers[EMULATOR_REGISTER_STACK_POINTER]] = value;
+	if(GetConsoleMode(input->handle, &input->mode))
+	{
+		// Unbuffered input without echo for the whole session instead of switching modes for every character
+		input->type = EMULATOR_INPUT_CONSOLE;
+		input->raw = SetConsoleMode(input->handle, input->mode & ~ENABLE_LINE_INPUT & ~ENABLE_ECHO_INPUT);
+		return TRUE;
+	}
+
+	input->type = GetFileType(input->handle) == FILE_TYPE_DISK ? EMULATOR_INPUT_FILE : EMULATOR_INPUT_PIPE;
+
+	// Reading a pipe can block for any time, so READ only stays nonblocking if a thread reads it
+	if((emulator->flags & EMULATOR_FLAG_PREFETCH_INPUT) || (input->callback && input->type == EMULATOR_INPUT_PIPE))
+	{
+		InitializeCriticalSection(&input->lock);
+		InitializeConditionVariable(&input->available);
+		InitializeConditionVariable(&input->space);
+
+		// Input is read synchronously if the thread can't be started
+		input->thread = CreateThread(NULL, 0, PrefetchEmulatorInput, input, 0, NULL);
+		if(!input->thread)
+			DeleteCriticalSection(&input->lock);
+	}
 
-	++emulator->registers[EMULATOR_REGISTER_STACK_POINTER];
-	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionPop(LPINSTRUCTION inst, LPEMULATOR emulator)
+BOOL ReadEmulatorInput(LPEMULATOR emulator, LPBYTE character)
 {
-	LPINSTRUCTIONSTACK instruction = (LPINSTRUCTIONSTACK)inst;
-	if(!instruction)
-	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
+	LPEMULATORINPUT input = &emulator->input;
+	ULONG read;
+	BOOL result;
+
+	if(!input->buffer && !InitializeEmulatorInput(emulator))
 		return FALSE;
-	}
 
-	if(!IsValidAddressRead(emulator, emulator->registers[EMULATOR_REGISTER_STACK_POINTER] - 1, 1))
+	if(input->thread || input->type == EMULATOR_INPUT_CHANNEL)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_ACCESS_VIOLATION);
-		return FALSE;
+		// The lock is only taken once all the input seen at the last look is consumed
+		if(input->head == input->limit)
+		{
+			EnterCriticalSection(&input->lock);
+
+			input->released = input->head;
+
+			if(input->thread)
+				WakeConditionVariable(&input->space);
+			else
+				StartChannelRead(input);
+
+			while(input->head == input->tail && !input->end)
+			{
+				if(input->callback)
+				{
+					input->waiting = TRUE;
+					LeaveCriticalSection(&input->lock);
+
+					emulator->waiting = TRUE;
+					return FALSE;
+				}
+
+				SleepConditionVariableCS(&input->available, &input->lock, INFINITE);
+			}
+
+			input->limit = input->tail;
+
+			LeaveCriticalSection(&input->lock);
+
+			if(input->head == input->limit)
+				return FALSE;
+		}
+
+		*character = input->buffer[input->head++ % EMULATOR_INPUT_BUFFER];
+		return TRUE;
 	}
 
-	emulator->registers[instruction->argument] = emulator->memory[emulator->registers[EMULATOR_REGISTER_STACK_POINTER] - 1];
+	// Refill the whole buffer once it is empty
+	if(input->head == input->tail)
+	{
+		if(input->end)
+			return FALSE;
 
-	--emulator->registers[EMULATOR_REGISTER_STACK_POINTER];
-	++emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+		if(input->type == EMULATOR_INPUT_CONSOLE)
+			result = ReadConsole(input->handle, input->buffer, EMULATOR_INPUT_BUFFER, &read, NULL);
+		else
+			result = ReadFile(input->handle, input->buffer, EMULATOR_INPUT_BUFFER, &read, NULL);
+
+		// A console never ends, an empty read there just means the read was interrupted
+		if(!result || !read)
+		{
+			input->end = input->type != EMULATOR_INPUT_CONSOLE;
+			return FALSE;
+		}
+
+		input->head = 0;
+		input->tail = read;
+	}
+
+	*character = input->buffer[input->head++];
 	return TRUE;
 }
 
-BOOL ExecuteInstructionBreak(LPINSTRUCTION inst, LPEMULATOR emulator)
+VOID UninitializeEmulatorInput(LPEMULATOR emulator)
 {
-	LPINSTRUCTION instruction = (LPINSTRUCTION)inst;
-	if(!instruction)
+	LPEMULATORINPUT input = &emulator->input;
+
+	if(input->thread)
 	{
-		SetEmulatorException(emulator, EMULATOR_EXCEPTION_NO_INSTRUCTION);
-		return FALSE;
+		EnterCriticalSection(&input->lock);
+		input->stop = TRUE;
+		WakeConditionVariable(&input->space);
+		LeaveCriticalSection(&input->lock);
+
+		// The thread may be blocked in ReadFile on a pipe nobody writes to, the cancel is repeated in case the thread
+		// had not entered ReadFile yet
+		while(WaitForSingleObject(input->thread, 10) == WAIT_TIMEOUT)
+			CancelSynchronousIo(input->thread);
+
+		CloseHandle(input->thread);
+
+		DeleteCriticalSection(&input->lock);
 	}
 
-	SetEmulatorException(emulator, EMULATOR_EXCEPTION_NONE);
-	return FALSE;
+	if(input->type == EMULATOR_INPUT_CHANNEL)
+	{
+		EnterCriticalSection(&input->lock);
+		input->stop = TRUE;
+		CancelChannelRead(input);
+		LeaveCriticalSection(&input->lock);
+
+		DeleteCriticalSection(&input->lock);
+	}
+
+	if(input->raw)
+		SetConsoleMode(input->handle, input->mode);
+
+	if(input->buffer)
+		HeapFree(GetProcessHeap(), 0, input->buffer);
+
+	ZeroMemory(input, sizeof(EMULATORINPUT));
 }
 
 VOID SetEmulatorException(LPEMULATOR emulator, ULONG exception)
@@ -1300,6 +3172,10 @@ VOID SetEmulatorException(LPEMULATOR emulator, ULONG exception)
 		DebugBreak();	// Should not get here
 
 	emulator->exception = exception;
+	emulator->halted = TRUE;
+
+	// The program stops here either way (BREAK sets EMULATOR_EXCEPTION_NONE)
+	FlushEmulatorOutput(emulator);
 }
 
 VOID SetEmulatorError(LPEMULATOR emulator, ULONG error)
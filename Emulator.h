@@ -2,24 +2,180 @@
 
 #include <windows.h>
 
-#define EMULATOR_COMMAND_NAME		64		// Max length of command name buffer
 #define EMULATOR_COMMAND_ARGUMENT	64		// Max length of command argument buffer
-#define EMULATOR_COMMAND_STRING		512		// Max length of command string buffer
-#define EMULATOR_READ_BUFFER 4096			// Line buffer size used when parsing assembly source files
-#define EMULATOR_DEFAULT_MEMORY 8192		// Default size of the memory space for the emulator (used if 0 passed to the emulator initialization function)
+#define EMULATOR_COMMAND_TOKENS		4		// Max number of tokens of a source line the parsers read (the command name and up to three arguments)
+#define EMULATOR_COMMAND_HASH		64		// Number of slots of the command name hash table, must be a power of two
+#define EMULATOR_SOURCE_CHUNK 1048576		// Min number of source bytes each thread assembles, smaller sources are assembled by the calling thread
+#define EMULATOR_ASSEMBLY_LINES 256			// Average number of lines in a chunk of an incremental assembly, must be a power of two
+#define EMULATOR_READ_BUFFER 4096			// Line buffer size used when reading assembly source files for the profile report
+#define EMULATOR_CODE_ALIGNMENT 64			// Alignment of the decoded instruction array (one cache line)
+#define EMULATOR_CODE_SLOTS 256				// Initial number of decoded instruction slots, the array doubles when full
+#define EMULATOR_CODE_LIMIT 0x04000000		// Max number of decoded instructions of a program, the code has its own address space next to the memory
+#define EMULATOR_JIT_BUFFER 4194304		// Size of the executable buffer the JIT compiler emits native code into, its pages are committed as the code grows
+#define EMULATOR_JIT_BLOCK 64				// Max number of instructions translated into a single native block
+#define EMULATOR_JIT_THRESHOLD 16			// Number of times an address has to be reached before a block starting at it is compiled
+#define EMULATOR_CODE_SENTINELS 2			// Number of zeroed (INSTRUCTION_NONE) slots kept after the last instruction so the interpreter can run off the end without a range check
+#define EMULATOR_OUTPUT_BUFFER 4096		// Default size of the guest output buffer (see SetEmulatorOutputBuffer)
+#define EMULATOR_INPUT_BUFFER 65536		// Size of the guest input ring buffer, must be a power of two
+#define EMULATOR_CHANNEL_BACKLOG 65536		// Number of flushed characters queued behind the write in flight at which a guest filling an output channel waits
+#define EMULATOR_DEFAULT_MEMORY 8192		// Default size of the memory space for the emulator in words (used if 0 passed to the emulator initialization function)
+#define EMULATOR_MAXIMUM_MEMORY 0x40000000	// Max size of the memory space in words (4 GiB), the host address space can limit it further
+#define EMULATOR_SAMPLE_INTERVAL 10		// Milliseconds between two samples of the program counter (EMULATOR_FLAG_SAMPLE)
+#define EMULATOR_SCHEDULER_SLICE 262144	// Default number of instructions a scheduled program runs before the next runnable program gets the thread
+#define EMULATOR_SCHEDULER_TICK 10			// Milliseconds between two checks of the time quotas of the programs waiting for input
+#define EMULATOR_BATCH_GUESTS 4			// Number of batch jobs in flight for every scheduler thread unless set otherwise
+#define EMULATOR_PAGE_WORDS 1024			// Number of words in a snapshot page, matches the 4096 byte pages the system tracks writes to
+#define EMULATOR_IMAGE_SIGNATURE 0x474D4950	// 'PIMG', first four bytes of a binary program image
+#define EMULATOR_IMAGE_VERSION 2			// Version of the binary program image format, images with a different version are rejected
+#define EMULATOR_VERSION 2					// Version of the assembler, part of the key of cached programs so a new assembler does not use them
+
+// Emulator initialization flags
+#define EMULATOR_FLAG_JIT			0x00000001	// Compile hot basic blocks to native code (x86-64 hosts only, ignored elsewhere)
+#define EMULATOR_FLAG_PREFETCH_INPUT	0x00000002	// Fill the input buffer from a background thread when stdin is a pipe or a file
+#define EMULATOR_FLAG_PROFILE		0x00000004	// Count the executions of every instruction (runs every instruction through its executor, the JIT is not used)
+#define EMULATOR_FLAG_SAMPLE		0x00000008	// Sample the program counter from a timer thread every EMULATOR_SAMPLE_INTERVAL milliseconds
+#define EMULATOR_FLAG_SPARSE		0x00000010	// Only reserve the memory and commit its pages on first access, for large memories the program uses a small part of
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define EMULATOR_JIT_SUPPORTED
+#endif
 
 #define EMULATOR_REGISTERS 16				// Number of emulator registers
 #define EMULATOR_REGISTER_PROGRAM_COUNTER (EMULATOR_REGISTERS-1)	// Index of the program counter register
 #define EMULATOR_REGISTER_STACK_POINTER (EMULATOR_REGISTERS-2)		// Index of the stack pointer register
 
+typedef struct COMMAND* LPCOMMAND;
+typedef struct INSTRUCTION* LPINSTRUCTION;
+typedef struct SOURCECHUNK* LPSOURCECHUNK;
+typedef struct SCHEDULER* LPSCHEDULER;
+typedef struct EVENTLOOP* LPEVENTLOOP;
+
+// Overlapped read or write of a guest channel, the thread of the event loop calls complete once it is done
+typedef struct CHANNELEVENT
+{
+	OVERLAPPED overlapped;
+	VOID (*complete)(struct CHANNELEVENT* event, ULONG transferred, BOOL result);
+} CHANNELEVENT,*LPCHANNELEVENT;
+
+// Buffered guest output channel
+typedef struct
+{
+	HANDLE handle;		// Handle the guest writes to (standard output by default), NULL collects the output in the buffer
+	BOOL console;		// Set if the handle is a console, console output is also flushed at every newline
+	LPBYTE buffer;		// Characters written since the last flush, NULL if the output is unbuffered
+	ULONG size;			// Size of the buffer, it grows as needed while output is collected
+	ULONG used;			// Number of characters in the buffer
+	LPEVENTLOOP loop;	// Event loop writing the handle (see SetEmulatorOutputChannel), NULL if WRITE writes it
+	CHANNELEVENT write;	// Write in flight on the event loop
+	LPBYTE pending;		// Flushed characters the event loop writes, the guest keeps filling buffer meanwhile
+	ULONG capacity;		// Size of pending
+	ULONG writing;		// Number of characters in pending, 0 if no write is in flight
+	ULONG written;		// Number of characters of pending written so far
+	LPBYTE queued;		// Characters flushed while a write is in flight, the event loop writes them once it completed
+	ULONG reserved;		// Size of queued
+	ULONG queue;		// Number of characters in queued
+	ULONGLONG offset;	// File offset of the next write
+	CRITICAL_SECTION lock;			// Guards pending, writing, written, queued, queue and waiting when an event loop writes the handle
+	CONDITION_VARIABLE completed;	// Signaled when a write completed
+	VOID (CALLBACK* callback)(LPVOID context);	// Called by the event loop once the backlog a WRITE or READ found was written, they block if NULL
+	LPVOID context;		// Passed to callback
+	BOOL waiting;		// Set while a WRITE or READ that found a backlog waits for the callback, guarded by lock
+} EMULATOROUTPUT,*LPEMULATOROUTPUT;
+
+// Guest input types
+#define EMULATOR_INPUT_CONSOLE	0
+#define EMULATOR_INPUT_PIPE		1
+#define EMULATOR_INPUT_FILE		2
+#define EMULATOR_INPUT_CHANNEL	3	// Read by an event loop (see SetEmulatorInputChannel)
+
+// Buffered guest input channel, the buffer is allocated by the first READ
+typedef struct
+{
+	HANDLE handle;		// Handle the guest reads from (standard input unless set by SetEmulatorInput)
+	ULONG type;			// EMULATOR_INPUT_* type of the handle
+	ULONG mode;			// Console mode to restore when the emulator is uninitialized
+	BOOL raw;			// Set once the console was switched to unbuffered input without echo
+	LPBYTE buffer;		// Ring buffer of EMULATOR_INPUT_BUFFER bytes
+	ULONG head;			// Number of bytes consumed by the guest
+	ULONG limit;		// Number of bytes the guest can consume before it has to look at tail again
+	ULONG tail;			// Number of bytes read from the handle
+	ULONG released;		// Number of bytes consumed by the guest the prefetch thread may overwrite
+	BOOL end;			// Set once the handle reported the end of input or an error
+	BOOL stop;			// Asks the prefetch thread to exit
+	HANDLE thread;		// Prefetch thread, NULL if the buffer is filled by READ itself
+	LPEVENTLOOP loop;	// Event loop filling the buffer instead of a prefetch thread (see SetEmulatorInputChannel), NULL if there is none
+	CHANNELEVENT read;	// Read in flight on the event loop
+	BOOL reading;		// Set while read is in flight
+	ULONGLONG offset;	// File offset of the next read
+	CRITICAL_SECTION lock;			// Guards tail, released, end, stop and reading when the prefetch thread or the event loop fill the buffer
+	CONDITION_VARIABLE available;	// Signaled when the prefetch thread or the event loop added input or hit the end
+	CONDITION_VARIABLE space;		// Signaled when the guest consumed input
+	VOID (CALLBACK* callback)(LPVOID context);	// Called by the prefetch thread or the event loop once input arrives for a READ that found none, READ blocks if NULL
+	LPVOID context;		// Passed to callback
+	BOOL waiting;		// Set while a READ that found no input waits for the callback, guarded by lock
+} EMULATORINPUT,*LPEMULATORINPUT;
+
+// Assembled program shared between emulators, it is never modified once created
+typedef struct
+{
+	LONG references;	// Number of emulators and other owners using the program
+	LPINSTRUCTION code;	// Decoded instructions
+	ULONG instructions;	// Number of decoded instructions
+	LPVOID image;		// Read-only view of the binary program image the code array points into, NULL if the code array is allocated
+	PULONG data;		// Initial memory contents as runs, the address and number of words of each run followed by its words
+	ULONG size;			// Number of words in data, the memory outside the runs starts zeroed
+	ULONG extent;		// Memory size the runs need, the end of the last run
+	ULONG registers[EMULATOR_REGISTERS];	// Initial register values
+} PROGRAM,*LPPROGRAM;
+
+// Copy of a memory page, shared by every snapshot the page did not change between
+typedef struct
+{
+	LONG references;	// Number of snapshots using the page
+	ULONG words[EMULATOR_PAGE_WORDS];
+} SNAPSHOTPAGE,*LPSNAPSHOTPAGE;
+
+// Saved emulator state, it is never modified once created
+typedef struct
+{
+	LONG references;	// Number of emulators and other owners using the snapshot
+	ULONG capacity;		// Memory size of the emulator the snapshot was taken from
+	ULONG pages;		// Number of entries in the page table
+	ULONG exception;
+	ULONG error;
+	ULONG registers[EMULATOR_REGISTERS];
+	BOOL halted;
+	LPSNAPSHOTPAGE* table;	// Memory pages, NULL for pages that are all zero
+} SNAPSHOT,*LPSNAPSHOT;
+
 typedef struct
 {
 	PULONG memory;		// The memory of the emulator
 	ULONG capacity;		// Total size of the emulator memory
-	ULONG instructions;	// Size of the emulator memory populated by instructions, starts at 0x00000000
+	BOOL guarded;		// Set if a guard region up to the last 32-bit word address follows the memory (see RecoverJitFault)
+	ULONG instructions;	// Number of decoded instructions, the program counter addresses the code array and not the memory
 	ULONG exception;	// Error douring execution
 	ULONG error;		// Error douring parsing/loading
+	ULONG line;			// Source line the parsing error occurred on, 0 if the error is not tied to a line
 	ULONG registers[EMULATOR_REGISTERS];
+	BOOL halted;		// Set once the program executed a BREAK instruction or raised an exception
+	BOOL waiting;		// Set when the last run stopped at a READ that found no input or at a WRITE or READ that found a backlog on an
+						// output channel and did not execute it (see SetEmulatorInputCallback and SetEmulatorOutputCallback)
+	ULONG flags;		// EMULATOR_FLAG_* values the emulator was initialized with
+	LPVOID jit;			// JIT compiler state, only present when initialized with EMULATOR_FLAG_JIT
+	LPINSTRUCTION code;	// Decoded instructions indexed by the program counter
+	ULONG slots;		// Number of instructions the code array can hold before it has to grow
+	PULONG blocks;		// Number of instructions from every address to the end of its block (see AnalyzeProgram)
+	LPVOID image;		// Read-only view of the binary program image the code array points into, NULL if the code array is allocated
+	EMULATOROUTPUT output;	// Guest output written by WRITE
+	EMULATORINPUT input;	// Guest input read by READ
+	LPPROGRAM program;	// Shared program the code array belongs to, NULL if the emulator owns its code array
+	LPSNAPSHOT snapshot;	// Snapshot the memory matched when the written pages were last reset, NULL if that was the zeroed memory
+	LPSNAPSHOT backing;	// Snapshot the pages of a clone are copied from when it first accesses them (see CloneEmulator), NULL otherwise
+	LPSNAPSHOT reset;	// State right after the program was loaded, ResetEmulator returns to it
+	LPVOID profile;		// Profiler state, only present when initialized with EMULATOR_FLAG_PROFILE
+	LPVOID sampler;		// Sampler state (EMULATORSAMPLER), only present when initialized with EMULATOR_FLAG_SAMPLE
+	LPCSTR cache;		// Directory of the assembled program cache (see SetEmulatorCache), NULL if sources are always assembled
 } EMULATOR,*LPEMULATOR;
 
 // Instruction types
@@ -36,8 +192,27 @@ typedef struct
 #define INSTRUCTION_PUSH	10
 #define INSTRUCTION_POP		11
 #define INSTRUCTION_BREAK	12
+#define INSTRUCTION_MEMCPY	13
+#define INSTRUCTION_MEMSET	14
+#define INSTRUCTION_MEMCMP	15
+#define INSTRUCTION_MEMCHR	16
 //...
 
+// Fused instruction types, FuseInstructions stores them on the first instruction of a common sequence, the other
+// instructions of the sequence keep their own types so jumps into the middle of it still execute them
+#define INSTRUCTION_CONDJUMP		17		// COND; JUMP
+#define INSTRUCTION_LOADCONDJUMP	18		// LOAD; COND; JUMP
+#define INSTRUCTION_ADDLOAD			19		// ADD; LOAD
+#define INSTRUCTION_ADDJUMP			20		// ADD; JUMP
+
+#define INSTRUCTION_COUNT	21				// Number of instruction types, used to size the executor dispatch table
+
+// Instruction flags, stored in the upper bits of the decoded instruction type by the loader
+#define INSTRUCTION_FLAG_REGISTERS	0x80	// An argument names the stack pointer or program counter register
+#define INSTRUCTION_TYPE_MASK		0x7F
+
+#define INSTRUCTION_TYPE(instruction) ((instruction)->type & INSTRUCTION_TYPE_MASK)
+
 // Argument types
 #define ARGUMENT_NONE		0
 #define ARGUMENT_ADDRESS	1
@@ -45,11 +220,15 @@ typedef struct
 #define ARGUMENT_CONSTANT	3
 #define ARGUMENT_CHARACTER	4
 
+#define ARGUMENT_MASK(type)	(1 << (type))	// Bit of an argument type in the sets of argument types the instruction parsers accept
+
 // Exception types
 #define EMULATOR_EXCEPTION_NONE					0
 #define EMULATOR_EXCEPTION_INVALID_INSTRUCTION	1
 #define EMULATOR_EXCEPTION_ACCESS_VIOLATION		2
 #define EMULATOR_EXCEPTION_NO_INSTRUCTION		3
+#define EMULATOR_EXCEPTION_INSTRUCTION_QUOTA	4	// The scheduler stopped the program once it retired its instruction quota
+#define EMULATOR_EXCEPTION_TIME_QUOTA			5	// The scheduler stopped the program once it used up its wall time quota
 
 // Error types
 #define EMULATOR_ERROR_NONE						0
@@ -57,12 +236,37 @@ typedef struct
 #define EMULATOR_ERROR_UNKNOWN_INSTRUCTION		2
 #define EMULATOR_ERROR_NO_MEMORY				3
 #define EMULATOR_ERROR_FILE_OPEN				4
+#define EMULATOR_ERROR_FILE_WRITE				5
+#define EMULATOR_ERROR_INVALID_IMAGE			6
+#define EMULATOR_ERROR_INVALID_SNAPSHOT		7
 
-typedef struct COMMAND* LPCOMMAND;
-typedef struct INSTRUCTION* LPINSTRUCTION;
+// Whitespace delimited token of a source line, points into the mapped source file and is not null terminated
+typedef struct
+{
+	LPCSTR text;
+	ULONG length;
+} TOKEN,*LPTOKEN;
+
+// Tokenized source line, the parsers read the command name and the arguments from the tokens
+typedef struct
+{
+	TOKEN tokens[EMULATOR_COMMAND_TOKENS];	// Command name followed by the arguments, further tokens are not stored
+	ULONG count;							// Number of tokens stored
+	LPCSTR end;								// End of the line (newline or end of the file), directives with free-form arguments read up to it
+	ULONG number;							// Line number, relative to the chunk when the source is assembled in chunks
+	LPSOURCECHUNK chunk;					// Chunk the line belongs to when the source is assembled in chunks, NULL otherwise
+} SOURCELINE,*LPSOURCELINE;
+
+// Assembled chunks of the source last loaded by LoadProgramFromSourceFileEx, a reload reuses the unchanged chunks
+typedef struct
+{
+	LPSOURCECHUNK* chunks;	// Distinct chunks of the source that assembled without an error
+	ULONG count;			// Number of chunks
+	ULONG parsed;			// Number of chunks the last load had to assemble
+} ASSEMBLY,*LPASSEMBLY;
 
 // Prototype for command parsers
-typedef LPINSTRUCTION (*LPCOMMANDPARSER)(LPCOMMAND, LPEMULATOR, LPCSTR);
+typedef LPINSTRUCTION (*LPCOMMANDPARSER)(LPCOMMAND, LPEMULATOR, LPSOURCELINE);
 
 // Prototype for instruction executors
 typedef BOOL (*LPCOMMANDEXECUTOR)(LPINSTRUCTION, LPEMULATOR);
@@ -73,86 +277,63 @@ typedef struct COMMAND
 	LPCSTR name;
 	ULONG type;
 	LPCOMMANDPARSER parser;
-	LPCOMMANDEXECUTOR executor;
 } *LPCOMMAND;
 
 typedef struct COMMAND COMMAND;
 
-// Base instruction structure, all instruction structures begin with this struct
+// Decoded instruction, all instructions share this fixed width layout and are stored inline in the emulator code array
+// so that four of them fit into a single cache line
 typedef struct INSTRUCTION
 {
-	LPCOMMAND command;
-	ULONG size;
+	BYTE type;				// Instruction type (INSTRUCTION_*)
+	BYTE types[3];			// Argument types (ARGUMENT_*), unused arguments are ARGUMENT_NONE
+	ULONG arguments[3];		// Argument values (register index, address or constant)
 } *LPINSTRUCTION;
 
 typedef struct INSTRUCTION INSTRUCTION;
 
-// This define is returned by directive parsers to indicate a successful parse operation but no instruction generation
-#define LPINSTRUCTION_NONE (LPINSTRUCTION)-1
-
-#pragma region Instruction structures
-typedef struct
-{
-	INSTRUCTION instruction;
-
-	ULONG argument;
-	ULONG type;
-} INSTRUCTIONJUMP,*LPINSTRUCTIONJUMP;
-
-typedef struct
-{
-	INSTRUCTION instruction;
-
-	ULONG argument;
-	ULONG type;
-} INSTRUCTIONCOND,*LPINSTRUCTIONCOND;
-
-typedef struct
-{
-	INSTRUCTION instruction;
-
-	ULONG arguments[2];
-	ULONG types[2];
-} INSTRUCTIONMOVE,*LPINSTRUCTIONMOVE;
-
-// ADD,SUB,MUL,DIV
-typedef struct
-{
-	INSTRUCTION instruction;
+C_ASSERT(sizeof(INSTRUCTION) == 16);
+C_ASSERT(EMULATOR_CODE_ALIGNMENT % sizeof(INSTRUCTION) == 0);
 
-	ULONG arguments[3];
-	ULONG types[3];
-} INSTRUCTIONARTH,*LPINSTRUCTIONARTH;
-
-// WRITE,READ
-typedef struct
+// Program counter sampler of an emulator, the timer thread requests a sample and the emulator thread records it the next
+// time it dispatches an instruction (threaded interpreter), takes a jump (switch interpreter) or enters a block (JIT)
+typedef struct EMULATORSAMPLER
 {
-	INSTRUCTION instruction;
-
-	ULONG argument;
-	ULONG type;
-} INSTRUCTIONIO,*LPINSTRUCTIONIO;
-
-// LOAD,STORE
+	struct EMULATORSAMPLER* next;	// Next sampled emulator
+	LPEMULATOR emulator;
+	volatile LONG pending;			// Set by the timer thread when a sample is requested
+	const void* volatile handlers[256];	// Dispatch table of the threaded interpreter, the timer thread points every entry at the sample handler
+	const void* volatile sample;	// Sample handler of the threaded interpreter, NULL until the interpreter ran
+	PULONG counts;					// Samples per address, the entry after the last instruction counts samples outside the code
+	ULONG instructions;				// Number of instructions counts covers
+	ULONG opcodes[INSTRUCTION_COUNT];	// Samples per instruction type
+	ULONG samples;					// Total number of samples
+} EMULATORSAMPLER,*LPEMULATORSAMPLER;
+
+// Binary program image header, the file continues with the code segment (instructions followed by EMULATOR_CODE_SENTINELS
+// zeroed instructions) at offset code and the data runs at offset data
 typedef struct
 {
-	INSTRUCTION instruction;
-
-	ULONG arguments[2];
-	ULONG types[2];
-} INSTRUCTIONMEMORY,*LPINSTRUCTIONMEMORY;
-
-// PUSH,POP
+	ULONG signature;		// EMULATOR_IMAGE_SIGNATURE
+	ULONG version;			// EMULATOR_IMAGE_VERSION
+	ULONG instructions;		// Number of instructions in the code segment
+	ULONG code;				// File offset of the code segment, aligned to EMULATOR_CODE_ALIGNMENT
+	ULONG data;				// File offset of the data runs
+	ULONG runs;				// Number of data runs
+	ULONG registers[EMULATOR_REGISTERS];	// Initial register values
+} IMAGEHEADER,*LPIMAGEHEADER;
+
+// Run of pre-initialized memory words in a binary program image, followed by its length words
 typedef struct
 {
-	INSTRUCTION instruction;
+	ULONG address;			// Address of the first word
+	ULONG length;			// Number of words
+} IMAGERUN,*LPIMAGERUN;
 
-	ULONG argument;
-	ULONG type;
-} INSTRUCTIONSTACK,*LPINSTRUCTIONSTACK;
-#pragma endregion
+// This define is returned by directive parsers to indicate a successful parse operation but no instruction generation
+#define LPINSTRUCTION_NONE (LPINSTRUCTION)-1
 
-// Execution memory address sanity checker
+// Execution address sanity checker, the program counter indexes the decoded code which is separate from the memory
 BOOL IsValidAddressExecute(LPEMULATOR emulator, ULONG address);
 // Write memory address sanity checker
 BOOL IsValidAddressWrite(LPEMULATOR emulator, ULONG address, ULONG range);
@@ -160,62 +341,282 @@ BOOL IsValidAddressWrite(LPEMULATOR emulator, ULONG address, ULONG range);
 BOOL IsValidAddressRead(LPEMULATOR emulator, ULONG address, ULONG range);
 
 // Instruction executor functions
-BOOL ExecuteInstructionJump(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionCond(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionMove(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionAdd(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionSub(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionWrite(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionRead(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionLoad(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionStore(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionPush(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionPop(LPINSTRUCTION inst, LPEMULATOR emulator);
-BOOL ExecuteInstructionBreak(LPINSTRUCTION inst, LPEMULATOR emulator);
+BOOL ExecuteInstructionJump(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionCond(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionMove(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionAdd(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionSub(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionWrite(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionRead(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionLoad(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionStore(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionPush(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionPop(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionBreak(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionMemcpy(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionMemset(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionMemcmp(LPINSTRUCTION instruction, LPEMULATOR emulator);
+BOOL ExecuteInstructionMemchr(LPINSTRUCTION instruction, LPEMULATOR emulator);
+
+// Word kernels of the bulk memory instructions, vectorized with AVX2 or SSE2 on x86-64 hosts
+// Copies count words, the ranges may overlap
+VOID CopyWords(PULONG destination, const ULONG* source, ULONG count);
+// Sets count words to value
+VOID FillWords(PULONG destination, ULONG value, ULONG count);
+// Returns the index of the first word that differs between the ranges, count if they are equal
+ULONG CompareWords(const ULONG* first, const ULONG* second, ULONG count);
+// Returns the index of the first word equal to value, count if there is none
+ULONG ScanWords(const ULONG* words, ULONG value, ULONG count);
 
 // Register string parser
-BOOL ParseRegister(LPCSTR text, PULONG value);
+BOOL ParseRegister(LPCSTR text, ULONG length, PULONG value);
 // Address string parser
-BOOL ParseAddress(LPCSTR text, PULONG value);
+BOOL ParseAddress(LPCSTR text, ULONG length, PULONG value);
 // Constant string parser
-BOOL ParseConstant(LPCSTR text, PULONG value);
+BOOL ParseConstant(LPCSTR text, ULONG length, PULONG value);
 // Character string parser
-BOOL ParseCharacter(LPCSTR text, PULONG value);
+BOOL ParseCharacter(LPCSTR text, ULONG length, PULONG value);
+
+// Returns the INSTRUCTION_FLAG_* bits the loader stores along with the type of a parsed instruction
+BYTE GetInstructionFlags(LPINSTRUCTION instruction);
+
+// Reserves the next slot of the code array for a parsed instruction of the given command
+LPINSTRUCTION AllocateInstruction(LPCOMMAND command, LPEMULATOR emulator);
+
+// Replaces common instruction sequences of the loaded program with fused instructions
+VOID FuseInstructions(LPEMULATOR emulator);
+// Returns the type of the first instruction of a fused instruction type, other types are returned unchanged
+BYTE GetUnfusedType(BYTE type);
+// Splits the loaded program into the blocks the interpreter executes, a block ends with a jump, a COND or a BREAK or
+// before an instruction that goes through its executor, any address can be jumped to so every address gets the number
+// of instructions from it to the end of its block. Constant jump targets and constant memory addresses are checked here
+// instead of every time they execute, instructions with an invalid one get 0 along with the instructions of their block
+// before them and are left to the executors like the instructions naming the stack pointer or program counter register
+BOOL AnalyzeProgram(LPEMULATOR emulator);
+// Returns the mnemonic of an instruction type, fused types return the mnemonic of their first instruction
+LPCSTR GetInstructionName(BYTE type);
 
 // General instruction/directive parser function, calls the specific instruction/directive parser function based on the instruction's name
-LPINSTRUCTION ParseCommand(LPEMULATOR emulator, LPCSTR text);
+LPINSTRUCTION ParseCommand(LPEMULATOR emulator, LPSOURCELINE line);
 
 // Instruction parser functions
-LPINSTRUCTION ParseInstructionJump(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionCond(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionMove(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionAdd(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionSub(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionWrite(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionRead(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionLoad(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionStore(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionPush(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionPop(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseInstructionBreak(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
+LPINSTRUCTION ParseInstructionJump(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionCond(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionMove(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionAdd(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionSub(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionWrite(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionRead(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionLoad(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionStore(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionPush(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionPop(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionBreak(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionMemcpy(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionMemset(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionMemcmp(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseInstructionMemchr(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
 
 // Directive parser functions
-LPINSTRUCTION ParseDirectiveDefineWord(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
-LPINSTRUCTION ParseDirectiveDefineString(LPCOMMAND command, LPEMULATOR emulator, LPCSTR text);
+LPINSTRUCTION ParseDirectiveDefineWord(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
+LPINSTRUCTION ParseDirectiveDefineString(LPCOMMAND command, LPEMULATOR emulator, LPSOURCELINE line);
 
 // Initializes the emulator internal data structures
 BOOL InitializeEmulator(LPEMULATOR emulator, ULONG memory);
+// Initializes the emulator internal data structures with a combination of EMULATOR_FLAG_* values
+BOOL InitializeEmulatorEx(LPEMULATOR emulator, ULONG memory, ULONG flags);
 // Frees the memory associated with the emulator internal data structures
 VOID UninitializeEmulator(LPEMULATOR emulator);
 
+// Allocates the memory of an initializing emulator according to its flags, sparse memory (EMULATOR_FLAG_SPARSE) is only
+// reserved and a page is committed by an exception handler the first time it is accessed, memory of an emulator that
+// compiles native code gets a guard region if it ends on a page boundary
+BOOL AllocateEmulatorMemory(LPEMULATOR emulator, ULONG words);
+// Frees the memory of an emulator
+VOID FreeEmulatorMemory(LPEMULATOR emulator);
+// Returns the number of words from address on that are either all committed or all not committed, committed receives
+// which of the two, memory that is not sparse is committed as a whole (words that are not committed read as zero, code
+// that scans the memory skips them so it does not commit them)
+ULONG GetEmulatorMemorySpan(LPEMULATOR emulator, ULONG address, PBOOL committed);
+// Zeroes a range of the memory, the pages of sparse memory the range covers are decommitted instead
+VOID ClearEmulatorMemory(LPEMULATOR emulator, ULONG address, ULONG words);
+// Returns the number of committed system pages of the memory, pages receives the number of pages the memory spans
+ULONG GetCommittedMemoryPages(LPEMULATOR emulator, PULONG pages);
+
+// Moves the program loaded into the emulator into a shared program, the emulator keeps using it,
+// returns NULL if there is not enough memory
+LPPROGRAM CreateProgram(LPEMULATOR emulator);
+// Same as CreateProgram, without the initial memory contents if memory is FALSE (for emulators that get their memory elsewhere)
+LPPROGRAM CreateProgramEx(LPEMULATOR emulator, BOOL memory);
+// Loads a shared program into a initialized emulator that has no program loaded
+BOOL AttachProgram(LPEMULATOR emulator, LPPROGRAM program);
+// Drops a reference to a shared program, the last one frees it
+VOID ReleaseProgram(LPPROGRAM program);
+
+// Captures the registers, the exception and error state and the memory of the emulator, only the pages written since the
+// previous snapshot or restore of the emulator are copied, the rest is shared, returns NULL if there is not enough memory
+LPSNAPSHOT SnapshotEmulator(LPEMULATOR emulator);
+// Returns the emulator to the state of a snapshot taken from an emulator with the same memory size running the same program,
+// only the pages written since the previous snapshot or restore and the pages the two snapshots don't share are copied
+BOOL RestoreEmulator(LPEMULATOR emulator, LPSNAPSHOT snapshot);
+// Initializes a new emulator running the same program in the current state of the emulator, the code is shared and the
+// memory of the clone is only reserved, a page is copied from a snapshot of the emulator when the clone first accesses it.
+// Cloning costs as much as a snapshot, the pages written since the previous snapshot or restore of the emulator
+BOOL CloneEmulator(LPEMULATOR emulator, LPEMULATOR clone);
+// Drops a reference to a snapshot, the last one frees it
+VOID ReleaseSnapshot(LPSNAPSHOT snapshot);
+// Makes the current state the one ResetEmulator returns to, the program loaders call it once the program is loaded
+BOOL SetEmulatorResetState(LPEMULATOR emulator);
+// Returns the registers, the exception and error state and the memory to the state right after the program was loaded
+// without loading it again, only the pages written since are copied, the guest input and output and the profile and
+// sample counts are left as they are
+BOOL ResetEmulator(LPEMULATOR emulator);
+
 // Loads a program into a initialized emulator from a textual assembly source file
 BOOL LoadProgramFromSourceFile(LPEMULATOR emulator, LPCSTR path);
-
-// Loads a program into a initialized emulator from a binary file
+// Same as LoadProgramFromSourceFile, reuses the chunks of the source the assembly was last loaded with and only assembles
+// the chunks that changed, the assembly then holds the chunks of this source (NULL assembles the whole source), the whole
+// source is still hashed and compared and the instructions of every chunk are copied
+BOOL LoadProgramFromSourceFileEx(LPEMULATOR emulator, LPCSTR path, LPASSEMBLY assembly);
+
+// Makes LoadProgramFromSourceFile keep the programs it assembles in a directory, a source that was assembled before for
+// an emulator with the same memory size is loaded from its program image instead (sources loaded by a profiled emulator
+// are always assembled), the directory string is not copied, NULL turns the cache off
+VOID SetEmulatorCache(LPEMULATOR emulator, LPCSTR directory);
+
+// Initializes an empty incremental assembly
+VOID InitializeAssembly(LPASSEMBLY assembly);
+// Frees the chunks kept by an incremental assembly
+VOID UninitializeAssembly(LPASSEMBLY assembly);
+
+// Loads a program into a initialized emulator from a binary program image, the code segment is mapped read-only and shared
+// between all emulators running the same image
 BOOL LoadProgramFromFile(LPEMULATOR emulator, LPCSTR path);
 
+// Saves the loaded program, its pre-initialized memory and the current registers into a binary program image
+BOOL SaveProgramToFile(LPEMULATOR emulator, LPCSTR path);
+
+// Runs the jobs of a batch manifest on a pool of threads (0 uses one per processor) and writes the output of every job
+// to standard output in manifest order, the sample histograms of the jobs are appended to samples if it is not NULL,
+// the programs are assembled through the program cache in the cache directory if it is not NULL (see SetEmulatorCache),
+// returns FALSE if the manifest can't be read. The jobs run on a scheduler (see CreateScheduler) with slice instructions per
+// time slice (0 uses EMULATOR_SCHEDULER_SLICE), at most guests jobs in flight (0 uses EMULATOR_BATCH_GUESTS per thread) and
+// an instruction and a millisecond quota for every job (0 means no quota)
+BOOL RunBatch(LPCSTR manifest, ULONG flags, ULONG threads, LPCSTR samples, LPCSTR cache, ULONG slice, ULONG guests, ULONGLONG quota, ULONG timeout);
+
+// Called by a scheduler worker thread once a program halted or used up one of its quotas, the scheduler is done with the
+// emulator when the callback is called, so the callback may reset it and schedule it again
+typedef VOID (CALLBACK* LPSCHEDULERCALLBACK)(LPEMULATOR emulator, ULONGLONG retired, LPVOID context);
+
+// Creates a scheduler multiplexing any number of emulators over a pool of threads (0 uses one per processor), every program
+// runs for at most slice instructions (0 uses EMULATOR_SCHEDULER_SLICE) before the next runnable program gets the thread
+LPSCHEDULER CreateScheduler(ULONG threads, ULONG slice);
+// Adds an emulator with a loaded program to the run queue, it runs until it halts or retires instructions instructions or
+// runs for milliseconds milliseconds (0 means no quota), a READ that finds no input parks the program instead of blocking
+// the thread, callback is called once it stopped
+BOOL ScheduleEmulator(LPSCHEDULER scheduler, LPEMULATOR emulator, ULONGLONG instructions, ULONG milliseconds, LPSCHEDULERCALLBACK callback, LPVOID context);
+// Waits until every scheduled program stopped and its callback returned
+VOID WaitScheduler(LPSCHEDULER scheduler);
+// Stops the threads and frees the scheduler, every scheduled program has to be stopped (see WaitScheduler)
+VOID DestroyScheduler(LPSCHEDULER scheduler);
+
+// Translates the loaded program into a standalone C source file that executes it with the semantics of the instruction executors
+BOOL TranslateProgramToFile(LPEMULATOR emulator, LPCSTR path);
+
 // Executes a singe instruction at the current instruction position
 BOOL ExecuteInstruction(LPEMULATOR emulator);
 
+// Executes instructions until the program breaks, raises an exception or retires maxInstructions instructions (0 means no limit),
+// returns the number of instructions retired
+ULONGLONG RunEmulator(LPEMULATOR emulator, ULONGLONG maxInstructions);
+
+// Allocates the JIT compiler state, returns FALSE if native code generation is not available
+BOOL InitializeJit(LPEMULATOR emulator);
+// Frees the JIT compiler state and the generated code
+VOID UninitializeJit(LPEMULATOR emulator);
+// RunEmulator implementation used when the JIT compiler is active
+ULONGLONG RunJit(LPEMULATOR emulator, ULONGLONG maxInstructions);
+// Moves a thread that faulted in the guard region of the memory from the compiled memory access to the side exit handing
+// its instruction to the interpreter, returns FALSE if the fault was not raised by compiled code of the emulator
+BOOL RecoverJitFault(LPEMULATOR emulator, PCONTEXT context);
+
+// Registers the emulator with the sampler timer thread
+BOOL InitializeSampler(LPEMULATOR emulator);
+// Unregisters the emulator from the sampler timer thread and frees the samples
+VOID UninitializeSampler(LPEMULATOR emulator);
+// Records a requested sample of the program counter, called by the emulator thread
+VOID RecordSample(LPEMULATOR emulator, ULONG address);
+// Copies the dispatch table of the threaded interpreter into the sampler, called by the emulator thread
+VOID RestoreSampleHandlers(LPEMULATOR emulator, const void* const* handlers);
+// Appends the sample histogram of the emulator to a text file
+BOOL SaveSamplesToFile(LPEMULATOR emulator, LPCSTR path, LPCSTR title);
+
+// Allocates the profiler state
+BOOL InitializeProfiler(LPEMULATOR emulator);
+// Frees the profiler state and the collected counters
+VOID UninitializeProfiler(LPEMULATOR emulator);
+// Records the source file and line an instruction was parsed from, called by the loader
+VOID SetProfileSource(LPEMULATOR emulator, LPCSTR path);
+VOID SetProfileLine(LPEMULATOR emulator, ULONG address, ULONG line);
+// RunEmulator implementation used when profiling, counts the executions of every instruction
+ULONGLONG RunProfiler(LPEMULATOR emulator, ULONGLONG maxInstructions);
+// Writes the execution counts annotated onto the program source, the opcode totals, the COND outcomes and the basic block coverage
+BOOL SaveProfileReport(LPEMULATOR emulator, LPCSTR path);
+// Writes the execution counts as collapsed stacks (program;block;instruction count) for flame graph tools
+BOOL SaveProfileStacks(LPEMULATOR emulator, LPCSTR path);
+
+// Sets the size of the guest output buffer, 0 makes every WRITE go straight to the output handle
+BOOL SetEmulatorOutputBuffer(LPEMULATOR emulator, ULONG size);
+// Appends a character to the guest output, flushing the buffer when it is full or at a newline on a console, returns FALSE
+// without appending it if the emulator has to wait for an output channel (see SetEmulatorOutputCallback)
+BOOL WriteEmulatorOutput(LPEMULATOR emulator, CHAR character);
+// Writes out the buffered guest output
+VOID FlushEmulatorOutput(LPEMULATOR emulator);
+
+// Sets the handle the guest writes to, NULL collects the output in the output buffer
+BOOL SetEmulatorOutput(LPEMULATOR emulator, HANDLE handle);
+// Sets the handle the guest reads from, has to be called before the first READ
+VOID SetEmulatorInput(LPEMULATOR emulator, HANDLE handle);
+// Makes a READ that finds no input stop the run with the waiting flag set instead of blocking, callback is called from another
+// thread once input arrived or the input ended. Pipes are always read by a prefetch thread then, other inputs still block.
+// NULL restores blocking reads, no callback is running or called once it returns
+VOID SetEmulatorInputCallback(LPEMULATOR emulator, VOID (CALLBACK* callback)(LPVOID context), LPVOID context);
+// Makes a WRITE that fills the buffer and a READ with buffered output stop the run with the waiting flag set instead of
+// blocking while the output channel has EMULATOR_CHANNEL_BACKLOG characters queued, callback is called by the event loop
+// once they were written. NULL restores blocking, no callback is running or called once it returns
+VOID SetEmulatorOutputCallback(LPEMULATOR emulator, VOID (CALLBACK* callback)(LPVOID context), LPVOID context);
+
+// Reads the next guest input character, returns FALSE at the end of input
+BOOL ReadEmulatorInput(LPEMULATOR emulator, LPBYTE character);
+
+// Creates a thread completing the overlapped reads and writes of any number of guest channels on an I/O completion port
+LPEVENTLOOP CreateEventLoop(VOID);
+// Stops the thread and frees the event loop, no channel may use it anymore
+VOID DestroyEventLoop(LPEVENTLOOP loop);
+// Sets the handle the guest reads from like SetEmulatorInput, the input is read by the event loop instead of READ or a prefetch
+// thread. The handle (a file, a pipe or a socket) has to be opened for overlapped I/O
+BOOL SetEmulatorInputChannel(LPEMULATOR emulator, HANDLE handle, LPEVENTLOOP loop);
+// Sets the handle the guest writes to like SetEmulatorOutput, the flushed output is written by the event loop and WRITE only
+// waits for the handle once the backlog is reached. The handle (a file, a pipe or a socket) has to be opened for overlapped I/O
+BOOL SetEmulatorOutputChannel(LPEMULATOR emulator, HANDLE handle, LPEVENTLOOP loop);
+// Issues the next read of an input channel if the buffer has space, called with the input lock held
+VOID StartChannelRead(LPEMULATORINPUT input);
+// Cancels the read in flight and waits for its completion, called with the input lock held
+VOID CancelChannelRead(LPEMULATORINPUT input);
+// Hands the buffered output to the event loop, queued behind the write in flight if there is one, returns FALSE if no copy
+// of it can be made and it is still buffered
+BOOL FlushChannelOutput(LPEMULATOROUTPUT output);
+// Hands the buffered output to the event loop unless the backlog is reached, it then stays buffered
+VOID PostChannelOutput(LPEMULATOROUTPUT output);
+// Waits until the backlog is below EMULATOR_CHANNEL_BACKLOG and hands the buffered output to the event loop, returns FALSE
+// with the waiting flag set if the emulator has an output callback and has to wait for it
+BOOL WaitChannelOutput(LPEMULATOR emulator);
+// Waits until the event loop wrote all the buffered output
+VOID DrainChannelOutput(LPEMULATOROUTPUT output);
+// Drains the output and detaches it from the event loop
+VOID CloseChannelOutput(LPEMULATOROUTPUT output);
+// Stops the prefetch thread, frees the input buffer and restores the console mode
+VOID UninitializeEmulatorInput(LPEMULATOR emulator);
+
 VOID SetEmulatorException(LPEMULATOR emulator, ULONG exception);
 VOID SetEmulatorError(LPEMULATOR emulator, ULONG error);
\ No newline at end of file
@@ -0,0 +1,504 @@
+#include "Emulator.h"
+
+// GCC and Clang support labels as values, which lets every handler end with its own indirect jump (direct threaded code),
+// other compilers fall back to a single switch
+#if defined(__GNUC__)
+#define EMULATOR_THREADED_DISPATCH
+#endif
+
+// Same checks as IsValidAddressRead/IsValidAddressWrite with a range of one word
+#define READABLE(address) ((address) < capacity)
+#define WRITABLE(address) ((address) < capacity)
+
+// Same checks as the bulk memory executors, a zero length accesses nothing
+#define RANGE(address, length) (!(length) || ((address) < capacity && (length) <= capacity - (address)))
+
+// Fetches the value of a register, address or constant argument, AnalyzeProgram checked the constant addresses
+#define FETCH(index, value) \
+	switch(instruction->types[index]) \
+	{ \
+	case ARGUMENT_REGISTER: value = registers[instruction->arguments[index]]; break; \
+	case ARGUMENT_ADDRESS: value = memory[instruction->arguments[index]]; break; \
+	case ARGUMENT_CONSTANT: value = instruction->arguments[index]; break; \
+	default: goto invalid_instruction; \
+	}
+
+// Fetches the value of a register, constant or character argument of a bulk memory instruction
+#define FETCH_BULK(index, value) \
+	if(instruction->types[index] == ARGUMENT_REGISTER) \
+		value = registers[instruction->arguments[index]]; \
+	else if(instruction->types[index] == ARGUMENT_CONSTANT || instruction->types[index] == ARGUMENT_CHARACTER) \
+		value = instruction->arguments[index]; \
+	else \
+		goto invalid_instruction;
+
+// Fetches the value of a register or constant argument
+#define FETCH_IMMEDIATE(index, value) \
+	if(instruction->types[index] == ARGUMENT_REGISTER) \
+		value = registers[instruction->arguments[index]]; \
+	else if(instruction->types[index] == ARGUMENT_CONSTANT) \
+		value = instruction->arguments[index]; \
+	else \
+		goto invalid_instruction;
+
+#if defined(EMULATOR_THREADED_DISPATCH)
+#define DISPATCH() goto *table[instruction->type]
+#else
+#define DISPATCH() goto dispatch
+#endif
+
+// Continues the block with its next instruction
+#define NEXT() \
+	++instruction; \
+	DISPATCH()
+
+// Continues a fused instruction with the handler of its next instruction in the same block, skipping the dispatch
+#define CHAIN(label) \
+	++instruction; \
+	goto label
+
+// Enters the block at pc, the whole block is retired up front and an exception takes back the instructions it did not
+// execute, so the instructions of a block carry no program counter or budget bookkeeping. A block the budget does not
+// cover and the instructions AnalyzeProgram left to the executors are stepped one at a time
+#define ENTER() \
+	if(!blocks[pc] || blocks[pc] > limit - retired) \
+		goto step; \
+	retired += blocks[pc]; \
+	instruction = &code[pc]; \
+	DISPATCH()
+
+ULONGLONG RunEmulator(LPEMULATOR emulator, ULONGLONG maxInstructions)
+{
+	ULONG registers[EMULATOR_REGISTERS];
+	LPINSTRUCTION code = emulator->code;
+	LPINSTRUCTION instruction;
+	PULONG blocks = emulator->blocks;
+	PULONG memory = emulator->memory;
+	ULONG instructions = emulator->instructions;
+	ULONG capacity = emulator->capacity;
+	ULONG pc;
+	ULONG sp;
+	ULONG address;
+	ULONG values[2];
+	ULONG length;
+	ULONG index;
+	CHAR character;
+	BOOL result;
+	ULONG exception;
+	ULONGLONG retired = 0;
+	ULONGLONG limit = maxInstructions ? maxInstructions : (ULONGLONG)-1;
+	LPEMULATORSAMPLER sampler = emulator->sampler;
+
+#if defined(EMULATOR_THREADED_DISPATCH)
+	static const void* handlers[256] =
+	{
+		[0 ... 255] = &&op_invalid,
+		[INSTRUCTION_JUMP] = &&op_jump,
+		[INSTRUCTION_COND] = &&op_cond,
+		[INSTRUCTION_MOVE] = &&op_move,
+		[INSTRUCTION_ADD] = &&op_add,
+		[INSTRUCTION_SUB] = &&op_sub,
+		[INSTRUCTION_WRITE] = &&op_write,
+		[INSTRUCTION_LOAD] = &&op_load,
+		[INSTRUCTION_STORE] = &&op_store,
+		[INSTRUCTION_PUSH] = &&op_push,
+		[INSTRUCTION_POP] = &&op_pop,
+		[INSTRUCTION_BREAK] = &&op_break,
+		[INSTRUCTION_MEMCPY] = &&op_memcpy,
+		[INSTRUCTION_MEMSET] = &&op_memset,
+		[INSTRUCTION_MEMCMP] = &&op_memcmp,
+		[INSTRUCTION_MEMCHR] = &&op_memchr,
+		[INSTRUCTION_CONDJUMP] = &&op_condjump,
+		[INSTRUCTION_LOADCONDJUMP] = &&op_loadcondjump,
+		[INSTRUCTION_ADDLOAD] = &&op_addload,
+		[INSTRUCTION_ADDJUMP] = &&op_addjump,
+		[INSTRUCTION_FLAG_REGISTERS + INSTRUCTION_JUMP ... INSTRUCTION_FLAG_REGISTERS + INSTRUCTION_MEMCHR] = &&op_executor,
+	};
+	const void* const volatile* table = handlers;
+#endif
+
+	if(emulator->halted)
+		return 0;
+
+	// A READ that stopped the last run for input is executed again
+	emulator->waiting = FALSE;
+
+	// Profiling and native code have their own loops, so the interpreter loop below carries no profiling checks
+	if(emulator->profile)
+		return RunProfiler(emulator, maxInstructions);
+
+	if(emulator->jit)
+		return RunJit(emulator, maxInstructions);
+
+#if defined(EMULATOR_THREADED_DISPATCH)
+	// The sampler thread requests a sample by pointing every entry of a private copy of the dispatch table at op_sample,
+	// so sampling adds nothing to the dispatch of an instruction
+	if(sampler)
+	{
+		if(!sampler->sample)
+		{
+			RestoreSampleHandlers(emulator, handlers);
+			InterlockedExchangePointer((PVOID*)&sampler->sample, &&op_sample);
+		}
+
+		table = sampler->handlers;
+	}
+#endif
+
+	CopyMemory(registers, emulator->registers, sizeof(registers));
+	pc = registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	sp = registers[EMULATOR_REGISTER_STACK_POINTER];
+
+resume:
+	// Only the executor path can move the program counter past the sentinel instructions
+	if(pc >= instructions)
+	{
+		if(retired != limit)
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+
+		goto leave;
+	}
+
+	ENTER();
+
+#if !defined(EMULATOR_THREADED_DISPATCH)
+dispatch:
+	switch(instruction->type)
+	{
+	case INSTRUCTION_JUMP: goto op_jump;
+	case INSTRUCTION_COND: goto op_cond;
+	case INSTRUCTION_MOVE: goto op_move;
+	case INSTRUCTION_ADD: goto op_add;
+	case INSTRUCTION_SUB: goto op_sub;
+	case INSTRUCTION_WRITE: goto op_write;
+	case INSTRUCTION_LOAD: goto op_load;
+	case INSTRUCTION_STORE: goto op_store;
+	case INSTRUCTION_PUSH: goto op_push;
+	case INSTRUCTION_POP: goto op_pop;
+	case INSTRUCTION_BREAK: goto op_break;
+	case INSTRUCTION_MEMCPY: goto op_memcpy;
+	case INSTRUCTION_MEMSET: goto op_memset;
+	case INSTRUCTION_MEMCMP: goto op_memcmp;
+	case INSTRUCTION_MEMCHR: goto op_memchr;
+	case INSTRUCTION_CONDJUMP: goto op_condjump;
+	case INSTRUCTION_LOADCONDJUMP: goto op_loadcondjump;
+	case INSTRUCTION_ADDLOAD: goto op_addload;
+	case INSTRUCTION_ADDJUMP: goto op_addjump;
+	default:
+		if(instruction->type & INSTRUCTION_FLAG_REGISTERS)
+			goto op_executor;
+
+		goto op_invalid;
+	}
+#endif
+
+op_jump:
+	// Constant targets were checked by AnalyzeProgram
+	if(instruction->types[0] == ARGUMENT_ADDRESS)
+		address = instruction->arguments[0];
+	else if(instruction->types[0] == ARGUMENT_REGISTER)
+	{
+		address = registers[instruction->arguments[0]];
+
+		if(address >= instructions)
+			goto invalid_instruction;
+	}
+	else
+		address = (ULONG)(instruction - code);
+
+#if !defined(EMULATOR_THREADED_DISPATCH)
+	// Without a dispatch table to redirect, sample requests are polled at jumps
+	if(sampler && sampler->pending)
+		RecordSample(emulator, (ULONG)(instruction - code));
+#endif
+
+	pc = address;
+	ENTER();
+
+op_cond:
+	pc = (ULONG)(instruction - code) + 1;
+
+	if(instruction->types[0] == ARGUMENT_ADDRESS)
+	{
+		if(memory[instruction->arguments[0]])
+			++pc;
+	}
+	else if(instruction->types[0] == ARGUMENT_REGISTER)
+	{
+		if(registers[instruction->arguments[0]])
+			++pc;
+	}
+
+	ENTER();
+
+op_move:
+	if(instruction->types[0] == ARGUMENT_ADDRESS)
+	{
+		FETCH(1, values[0]);
+		memory[instruction->arguments[0]] = values[0];
+	}
+	else if(instruction->types[0] == ARGUMENT_REGISTER)
+	{
+		FETCH(1, values[0]);
+		registers[instruction->arguments[0]] = values[0];
+	}
+	else
+		goto invalid_instruction;
+
+	NEXT();
+
+op_add:
+	FETCH(1, values[0]);
+	FETCH(2, values[1]);
+	registers[instruction->arguments[0]] = values[0] + values[1];
+
+	NEXT();
+
+op_sub:
+	FETCH(1, values[0]);
+	FETCH(2, values[1]);
+	registers[instruction->arguments[0]] = values[0] - values[1];
+
+	NEXT();
+
+op_write:
+	if(instruction->types[0] == ARGUMENT_CHARACTER || instruction->types[0] == ARGUMENT_CONSTANT)
+		character = (CHAR)instruction->arguments[0];
+	else if(instruction->types[0] == ARGUMENT_REGISTER)
+		character = (CHAR)registers[instruction->arguments[0]];
+	else
+		goto invalid_instruction;
+
+	if(!WriteEmulatorOutput(emulator, character))
+		goto wait;
+
+	NEXT();
+
+op_load:
+	FETCH_IMMEDIATE(1, address);
+
+	if(!READABLE(address))
+		goto access_violation;
+
+	registers[instruction->arguments[0]] = memory[address];
+
+	NEXT();
+
+op_store:
+	FETCH_IMMEDIATE(0, address);
+	FETCH_IMMEDIATE(1, values[0]);
+
+	if(!WRITABLE(address))
+		goto access_violation;
+
+	memory[address] = values[0];
+
+	NEXT();
+
+op_push:
+	if(!WRITABLE(sp))
+		goto access_violation;
+
+	FETCH_IMMEDIATE(0, values[0]);
+	memory[sp] = values[0];
+
+	++sp;
+	NEXT();
+
+op_pop:
+	if(!READABLE(sp - 1))
+		goto access_violation;
+
+	registers[instruction->arguments[0]] = memory[sp - 1];
+
+	--sp;
+	NEXT();
+
+op_break:
+	SetEmulatorException(emulator, EMULATOR_EXCEPTION_NONE);
+
+	pc = (ULONG)(instruction - code);
+	goto leave;
+
+op_memcpy:
+	FETCH_BULK(0, address);
+	FETCH_BULK(1, values[0]);
+	FETCH_BULK(2, length);
+
+	if(!RANGE(address, length) || !RANGE(values[0], length))
+		goto access_violation;
+
+	if(length)
+		CopyWords(&memory[address], &memory[values[0]], length);
+
+	NEXT();
+
+op_memset:
+	FETCH_BULK(0, address);
+	FETCH_BULK(1, values[0]);
+	FETCH_BULK(2, length);
+
+	if(!RANGE(address, length))
+		goto access_violation;
+
+	if(length)
+		FillWords(&memory[address], values[0], length);
+
+	NEXT();
+
+op_memcmp:
+	FETCH_BULK(1, address);
+	FETCH_BULK(2, values[0]);
+	length = registers[instruction->arguments[0]];
+
+	if(!RANGE(address, length) || !RANGE(values[0], length))
+		goto access_violation;
+
+	index = length ? CompareWords(&memory[address], &memory[values[0]], length) : 0;
+	if(index == length)
+		registers[instruction->arguments[0]] = 0;
+	else
+		registers[instruction->arguments[0]] = memory[address + index] > memory[values[0] + index] ? 1 : (ULONG)-1;
+
+	NEXT();
+
+op_memchr:
+	FETCH_BULK(1, address);
+	FETCH_BULK(2, values[0]);
+	length = registers[instruction->arguments[0]];
+
+	// The scan only faults if it runs past the end of the memory before it finds the value
+	values[1] = address < capacity ? capacity - address : 0;
+	if(values[1] > length)
+		values[1] = length;
+
+	index = values[1] ? ScanWords(&memory[address], values[0], values[1]) : 0;
+	if(index == values[1] && values[1] != length)
+		goto access_violation;
+
+	registers[instruction->arguments[0]] = index;
+
+	NEXT();
+
+// Fused instructions execute their first instruction and continue with the handler of the next one, which is still
+// stored in place, so a fault or an exhausted budget stops at the same instruction as the unfused sequence
+op_loadcondjump:
+	FETCH_IMMEDIATE(1, address);
+
+	if(!READABLE(address))
+		goto access_violation;
+
+	registers[instruction->arguments[0]] = memory[address];
+
+	CHAIN(op_condjump);
+
+op_condjump:
+	if(instruction->types[0] == ARGUMENT_ADDRESS)
+		values[0] = memory[instruction->arguments[0]];
+	else if(instruction->types[0] == ARGUMENT_REGISTER)
+		values[0] = registers[instruction->arguments[0]];
+	else
+		values[0] = 0;
+
+	pc = (ULONG)(instruction - code) + 1;
+
+	// A taken COND skips the JUMP
+	if(values[0])
+	{
+		++pc;
+		ENTER();
+	}
+
+	// The JUMP is a block of its own
+	if(!blocks[pc] || blocks[pc] > limit - retired)
+		goto step;
+
+	retired += blocks[pc];
+	CHAIN(op_jump);
+
+op_addload:
+	FETCH(1, values[0]);
+	FETCH(2, values[1]);
+	registers[instruction->arguments[0]] = values[0] + values[1];
+
+	CHAIN(op_load);
+
+op_addjump:
+	FETCH(1, values[0]);
+	FETCH(2, values[1]);
+	registers[instruction->arguments[0]] = values[0] + values[1];
+
+	CHAIN(op_jump);
+
+step:
+	instruction = &code[pc];
+
+op_executor:
+	// Instructions that name the stack pointer or program counter register run through their executor on the emulator
+	// state, so do the instructions of blocks that are stepped, a block falling through into such an instruction did
+	// not retire it
+	pc = (ULONG)(instruction - code);
+
+	if(retired == limit)
+		goto leave;
+
+	registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = pc;
+	registers[EMULATOR_REGISTER_STACK_POINTER] = sp;
+	CopyMemory(emulator->registers, registers, sizeof(registers));
+
+	result = ExecuteInstruction(emulator);
+
+	CopyMemory(registers, emulator->registers, sizeof(registers));
+	pc = registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+	sp = registers[EMULATOR_REGISTER_STACK_POINTER];
+
+	if(!result)
+	{
+		// BREAK is retired, a fault and a READ or WRITE that waits are not
+		if(emulator->exception == EMULATOR_EXCEPTION_NONE && !emulator->waiting)
+			++retired;
+
+		return retired;
+	}
+
+	++retired;
+	goto resume;
+
+#if defined(EMULATOR_THREADED_DISPATCH)
+op_sample:
+	// Restore the dispatch table first, a sample requested meanwhile is taken at the next dispatch
+	RestoreSampleHandlers(emulator, handlers);
+	RecordSample(emulator, (ULONG)(instruction - code));
+
+	goto *handlers[instruction->type];
+#endif
+
+wait:
+	// The WRITE waits for the output channel, it and the rest of its block were retired on entry
+	pc = (ULONG)(instruction - code);
+	retired -= blocks[pc];
+
+	goto leave;
+
+op_invalid:
+invalid_instruction:
+	exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+	goto fault;
+
+access_violation:
+	exception = EMULATOR_EXCEPTION_ACCESS_VIOLATION;
+
+fault:
+	// The faulting instruction and the rest of its block were retired on entry
+	pc = (ULONG)(instruction - code);
+	retired -= blocks[pc];
+
+	SetEmulatorException(emulator, exception);
+
+leave:
+	registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = pc;
+	registers[EMULATOR_REGISTER_STACK_POINTER] = sp;
+	CopyMemory(emulator->registers, registers, sizeof(registers));
+
+	return retired;
+}
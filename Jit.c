@@ -0,0 +1,863 @@
+#include "Emulator.h"
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+
+// Host registers (x86-64 encoding numbers)
+#define HOST_RAX 0
+#define HOST_RCX 1
+#define HOST_RDX 2
+#define HOST_RBX 3
+#define HOST_RSI 6
+#define HOST_RDI 7
+#define HOST_R8 8
+
+// Registers used by the generated code:
+//  rbx      emulator register file
+//  rdi      emulator memory
+//  r8-r15   emulator registers r0-r7
+//  rsi      emulator stack pointer
+//  rax, rcx, rdx scratch
+#define JIT_MAPPED_REGISTERS 8
+
+// Flag set in the value returned by a block when the instruction at the returned address has to be executed by the interpreter
+#define JIT_EXIT_INTERPRET 0x8000000000000000ULL
+
+// Marks addresses where no block can be compiled because the first instruction is left to the interpreter
+#define JIT_BLOCK_INTERPRET ((LPJITENTRY)1)
+
+// Offset of the epilogue shared by all blocks, it is emitted at the start of the executable buffer
+#define JIT_EPILOGUE 0
+
+// Max number of side exits a single block can have (at most two checks per instruction)
+#define JIT_EXITS (EMULATOR_JIT_BLOCK * 2)
+
+// Upper bound of the native code size of a single block including its side exit stubs
+#define JIT_BLOCK_BYTES (EMULATOR_JIT_BLOCK * 64 + JIT_EXITS * 24 + 128)
+
+// Bytes of the executable buffer committed at a time as the generated code grows
+#define JIT_COMMIT 65536
+
+// Prototype of a compiled block, returns the next address, the number of retired instructions in bits 32-62
+// and JIT_EXIT_INTERPRET in bit 63
+typedef ULONGLONG (*LPJITENTRY)(PULONG registers, PULONG memory);
+
+typedef struct
+{
+	LPJITENTRY entry;	// Native code of the block starting at this address, NULL if not compiled yet
+	ULONG length;		// Max number of instructions retired by the block
+	ULONG count;		// Number of times the address was reached by the dispatcher
+} JITBLOCK,*LPJITBLOCK;
+
+typedef struct
+{
+	ULONG offset;		// Offset of the rel32 field of the conditional jump to patch, or of the memory access for a fault exit
+	ULONG address;		// Address of the instruction that has to be executed by the interpreter
+	ULONG retired;		// Number of instructions of the block retired before it
+	BOOL fault;			// Set if the exit is reached by a fault of the memory access in the guard region instead of a jump
+} JITEXIT,*LPJITEXIT;
+
+typedef struct
+{
+	ULONG offset;		// Offset of a memory access that is not preceded by an address check
+	ULONG exit;			// Offset of the side exit stub of its instruction
+} JITFAULT,*LPJITFAULT;
+
+typedef struct
+{
+	PBYTE buffer;		// Executable memory, reserved as a whole and committed in chunks of JIT_COMMIT bytes
+	SIZE_T used;		// Bytes of the executable memory in use
+	SIZE_T committed;	// Bytes of the executable memory committed
+	SIZE_T writable;	// End of the writable part of the executable memory, code is only emitted below it
+	SIZE_T shared;		// Bytes used by the code shared between all blocks (the epilogue)
+	BOOL overflow;		// Set if the current block did not fit into the buffer
+	LPJITBLOCK blocks;	// Compiled blocks indexed by the address of their first instruction
+	ULONG instructions;	// Number of instructions the blocks array was allocated for
+	JITEXIT exits[JIT_EXITS];
+	ULONG pending;		// Number of side exits of the block being compiled
+	LPJITFAULT faults;	// Unchecked memory accesses of the generated code ordered by offset (guarded memory only)
+	ULONG accesses;		// Number of entries in faults
+	ULONG slots;		// Number of entries faults can hold
+} JIT,*LPJIT;
+
+static VOID EmitByte(LPJIT jit, BYTE value)
+{
+	if(jit->used >= jit->writable)
+	{
+		jit->overflow = TRUE;
+		return;
+	}
+
+	jit->buffer[jit->used++] = value;
+}
+
+static VOID EmitDword(LPJIT jit, ULONG value)
+{
+	EmitByte(jit, (BYTE)value);
+	EmitByte(jit, (BYTE)(value >> 8));
+	EmitByte(jit, (BYTE)(value >> 16));
+	EmitByte(jit, (BYTE)(value >> 24));
+}
+
+static VOID EmitQword(LPJIT jit, ULONGLONG value)
+{
+	EmitDword(jit, (ULONG)value);
+	EmitDword(jit, (ULONG)(value >> 32));
+}
+
+static VOID EmitRex(LPJIT jit, BOOL wide, ULONG reg, ULONG index, ULONG base)
+{
+	BYTE rex = 0x40 | (wide ? 0x08 : 0) | ((reg & 8) ? 0x04 : 0) | ((index & 8) ? 0x02 : 0) | ((base & 8) ? 0x01 : 0);
+
+	if(rex != 0x40)
+		EmitByte(jit, rex);
+}
+
+static VOID EmitModRM(LPJIT jit, ULONG mod, ULONG reg, ULONG rm)
+{
+	EmitByte(jit, (BYTE)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+// op r/m32, r32 with both operands in registers
+static VOID EmitRegister(LPJIT jit, BYTE opcode, ULONG reg, ULONG rm)
+{
+	EmitRex(jit, FALSE, reg, 0, rm);
+	EmitByte(jit, opcode);
+	EmitModRM(jit, 3, reg, rm);
+}
+
+// op r32, [rbx + index * 4] (emulator register file access)
+static VOID EmitRegisterFile(LPJIT jit, BYTE opcode, ULONG reg, ULONG index)
+{
+	EmitRex(jit, FALSE, reg, 0, HOST_RBX);
+	EmitByte(jit, opcode);
+	EmitModRM(jit, 1, reg, HOST_RBX);
+	EmitByte(jit, (BYTE)(index * sizeof(ULONG)));
+}
+
+// op r32, [rdi + rcx * 4] (emulator memory access)
+static VOID EmitMemory(LPJIT jit, BYTE opcode, ULONG reg)
+{
+	EmitRex(jit, FALSE, reg, HOST_RCX, HOST_RDI);
+	EmitByte(jit, opcode);
+	EmitModRM(jit, 0, reg, 4);
+	EmitByte(jit, (2 << 6) | (HOST_RCX << 3) | HOST_RDI);
+}
+
+// mov r32, imm32
+static VOID EmitMoveConstant(LPJIT jit, ULONG reg, ULONG value)
+{
+	EmitRex(jit, FALSE, 0, 0, reg);
+	EmitByte(jit, (BYTE)(0xB8 + (reg & 7)));
+	EmitDword(jit, value);
+}
+
+// cmp r32, imm32
+static VOID EmitCompareConstant(LPJIT jit, ULONG reg, ULONG value)
+{
+	EmitRex(jit, FALSE, 0, 0, reg);
+	EmitByte(jit, 0x81);
+	EmitModRM(jit, 3, 7, reg);
+	EmitDword(jit, value);
+}
+
+// lea r32, [base + displacement]
+static VOID EmitLea(LPJIT jit, ULONG reg, ULONG base, CHAR displacement)
+{
+	EmitRex(jit, FALSE, reg, 0, base);
+	EmitByte(jit, 0x8D);
+	EmitModRM(jit, 1, reg, base);
+	EmitByte(jit, (BYTE)displacement);
+}
+
+// jmp rel32 to an absolute position in the buffer
+static VOID EmitJump(LPJIT jit, SIZE_T target)
+{
+	EmitByte(jit, 0xE9);
+	EmitDword(jit, (ULONG)(target - (jit->used + 4)));
+}
+
+// Returns the host register an emulator register lives in, 0 if it is kept in the register file
+static ULONG GetHostRegister(ULONG index)
+{
+	if(index < JIT_MAPPED_REGISTERS)
+		return HOST_R8 + index;
+
+	if(index == EMULATOR_REGISTER_STACK_POINTER)
+		return HOST_RSI;
+
+	return 0;
+}
+
+static VOID EmitLoadRegister(LPJIT jit, ULONG reg, ULONG index)
+{
+	ULONG host = GetHostRegister(index);
+
+	if(host)
+		EmitRegister(jit, 0x89, host, reg);
+	else
+		EmitRegisterFile(jit, 0x8B, reg, index);
+}
+
+static VOID EmitStoreRegister(LPJIT jit, ULONG index, ULONG reg)
+{
+	ULONG host = GetHostRegister(index);
+
+	if(host)
+		EmitRegister(jit, 0x89, reg, host);
+	else
+		EmitRegisterFile(jit, 0x89, reg, index);
+}
+
+// Leaves the block with a value known at compile time
+static VOID EmitExit(LPJIT jit, ULONG address, ULONG retired, BOOL interpret)
+{
+	// mov rax, imm64
+	EmitByte(jit, 0x48);
+	EmitByte(jit, 0xB8);
+	EmitQword(jit, ((ULONGLONG)retired << 32) | address | (interpret ? JIT_EXIT_INTERPRET : 0));
+
+	EmitJump(jit, JIT_EPILOGUE);
+}
+
+// Records a side exit of the block being compiled, its stub is emitted after the block
+static VOID AddSideExit(LPJIT jit, SIZE_T offset, ULONG address, ULONG retired, BOOL fault)
+{
+	LPJITEXIT exit;
+
+	if(jit->pending >= JIT_EXITS)
+	{
+		jit->overflow = TRUE;
+		return;
+	}
+
+	exit = &jit->exits[jit->pending++];
+	exit->offset = (ULONG)offset;
+	exit->address = address;
+	exit->retired = retired;
+	exit->fault = fault;
+}
+
+// Emits a conditional jump (jcc rel32) to a side exit that hands the instruction at address to the interpreter
+static VOID EmitSideExit(LPJIT jit, BYTE condition, ULONG address, ULONG retired)
+{
+	EmitByte(jit, 0x0F);
+	EmitByte(jit, 0x80 | condition);
+	EmitDword(jit, 0);
+
+	AddSideExit(jit, jit->used - 4, address, retired, FALSE);
+}
+
+#define CONDITION_ABOVE_EQUAL 0x3
+#define CONDITION_NOT_EQUAL 0x5
+
+// Emits the readable/writable check of the address in ecx (see IsValidAddressRead/IsValidAddressWrite), the memory
+// access has to follow it
+static VOID EmitAddressCheck(LPJIT jit, LPEMULATOR emulator, ULONG address, ULONG retired)
+{
+	// Guarded memory checks the address in hardware, an access past the memory faults and goes to the side exit instead
+	if(emulator->guarded)
+	{
+		AddSideExit(jit, jit->used, address, retired, TRUE);
+		return;
+	}
+
+	EmitCompareConstant(jit, HOST_RCX, emulator->capacity);
+	EmitSideExit(jit, CONDITION_ABOVE_EQUAL, address, retired);
+}
+
+static BOOL IsValidConstantAddress(LPEMULATOR emulator, ULONG address)
+{
+	return IsValidAddressRead(emulator, address, 1);
+}
+
+// Loads the value of a register, address or constant argument into reg, returns FALSE if the argument is left to the interpreter
+static BOOL EmitFetch(LPJIT jit, LPEMULATOR emulator, LPINSTRUCTION instruction, ULONG index, ULONG reg)
+{
+	switch(instruction->types[index])
+	{
+	case ARGUMENT_REGISTER:
+		EmitLoadRegister(jit, reg, instruction->arguments[index]);
+		return TRUE;
+
+	case ARGUMENT_CONSTANT:
+		EmitMoveConstant(jit, reg, instruction->arguments[index]);
+		return TRUE;
+
+	case ARGUMENT_ADDRESS:
+		if(!IsValidConstantAddress(emulator, instruction->arguments[index]))
+			return FALSE;
+
+		EmitMoveConstant(jit, HOST_RCX, instruction->arguments[index]);
+		EmitMemory(jit, 0x8B, reg);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+// Loads a register or constant argument into reg
+static BOOL EmitFetchImmediate(LPJIT jit, LPINSTRUCTION instruction, ULONG index, ULONG reg)
+{
+	if(instruction->types[index] == ARGUMENT_REGISTER)
+		EmitLoadRegister(jit, reg, instruction->arguments[index]);
+	else if(instruction->types[index] == ARGUMENT_CONSTANT)
+		EmitMoveConstant(jit, reg, instruction->arguments[index]);
+	else
+		return FALSE;
+
+	return TRUE;
+}
+
+static VOID EmitPrologue(LPJIT jit)
+{
+	ULONG index;
+
+	// push rbx, rsi, rdi, r12-r15
+	EmitByte(jit, 0x53);
+	EmitByte(jit, 0x56);
+	EmitByte(jit, 0x57);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x54);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x55);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x56);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x57);
+
+#if defined(_WIN64)
+	// mov rbx, rcx; mov rdi, rdx
+	EmitByte(jit, 0x48); EmitByte(jit, 0x89); EmitByte(jit, 0xCB);
+	EmitByte(jit, 0x48); EmitByte(jit, 0x89); EmitByte(jit, 0xD7);
+#else
+	// mov rbx, rdi; mov rdi, rsi
+	EmitByte(jit, 0x48); EmitByte(jit, 0x89); EmitByte(jit, 0xFB);
+	EmitByte(jit, 0x48); EmitByte(jit, 0x89); EmitByte(jit, 0xF7);
+#endif
+
+	for(index = 0; index < JIT_MAPPED_REGISTERS; ++index)
+		EmitRegisterFile(jit, 0x8B, HOST_R8 + index, index);
+
+	EmitRegisterFile(jit, 0x8B, HOST_RSI, EMULATOR_REGISTER_STACK_POINTER);
+}
+
+// Shared block epilogue, expects the block result in rax
+static VOID EmitEpilogue(LPJIT jit)
+{
+	ULONG index;
+
+	for(index = 0; index < JIT_MAPPED_REGISTERS; ++index)
+		EmitRegisterFile(jit, 0x89, HOST_R8 + index, index);
+
+	EmitRegisterFile(jit, 0x89, HOST_RSI, EMULATOR_REGISTER_STACK_POINTER);
+
+	// pop r15-r12, rdi, rsi, rbx; ret
+	EmitByte(jit, 0x41); EmitByte(jit, 0x5F);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x5E);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x5D);
+	EmitByte(jit, 0x41); EmitByte(jit, 0x5C);
+	EmitByte(jit, 0x5F);
+	EmitByte(jit, 0x5E);
+	EmitByte(jit, 0x5B);
+	EmitByte(jit, 0xC3);
+}
+
+// Makes room for bytes more code after the code in use, the pages it takes are committed if needed and made writable, so
+// the code is never writable and executable at the same time. Returns FALSE if the pages can't be committed or made writable
+static BOOL UnprotectJit(LPJIT jit, SIZE_T bytes)
+{
+	SIZE_T end = jit->used + bytes;
+	SIZE_T commit;
+	DWORD protection;
+
+	if(end > EMULATOR_JIT_BUFFER)
+		return FALSE;
+
+	// Committed pages are executable, the page holding the end of the code included
+	if(jit->used < jit->committed && !VirtualProtect(jit->buffer + jit->used, (end < jit->committed ? end : jit->committed) - jit->used, PAGE_READWRITE, &protection))
+		return FALSE;
+
+	// Pages committed now are writable already
+	if(end > jit->committed)
+	{
+		commit = (end + JIT_COMMIT - 1) / JIT_COMMIT * JIT_COMMIT;
+		if(commit > EMULATOR_JIT_BUFFER)
+			commit = EMULATOR_JIT_BUFFER;
+
+		if(!VirtualAlloc(jit->buffer + jit->committed, commit - jit->committed, MEM_COMMIT, PAGE_READWRITE))
+			return FALSE;
+
+		jit->committed = commit;
+	}
+
+	jit->writable = end;
+	return TRUE;
+}
+
+// Makes the room UnprotectJit made from start on executable again with the code emitted into it, returns FALSE if its
+// pages can't be made executable
+static BOOL ProtectJit(LPJIT jit, SIZE_T start)
+{
+	DWORD protection;
+	SIZE_T end = jit->writable;
+
+	jit->writable = jit->used;
+
+	if(!VirtualProtect(jit->buffer + start, end - start, PAGE_EXECUTE_READ, &protection))
+		return FALSE;
+
+	FlushInstructionCache(GetCurrentProcess(), jit->buffer + start, jit->used - start);
+	return TRUE;
+}
+
+// Throws away all the generated code, returns FALSE if the epilogue can't be emitted, no block is compiled until a reset
+// succeeded
+static BOOL ResetJit(LPJIT jit, ULONG instructions)
+{
+	jit->used = 0;
+	jit->shared = 0;
+	jit->overflow = FALSE;
+	jit->accesses = 0;
+
+	if(jit->blocks)
+		ZeroMemory(jit->blocks, jit->instructions * sizeof(JITBLOCK));
+
+	if(!UnprotectJit(jit, JIT_BLOCK_BYTES))
+		return FALSE;
+
+	EmitEpilogue(jit);
+
+	if(!ProtectJit(jit, 0))
+		return FALSE;
+
+	jit->shared = jit->used;
+	return TRUE;
+}
+
+// Translates a single instruction, returns FALSE if the block has to end before it
+static BOOL CompileInstruction(LPJIT jit, LPEMULATOR emulator, LPINSTRUCTION instruction, ULONG address, ULONG retired, PBOOL terminator)
+{
+	*terminator = FALSE;
+
+	// Instructions naming the program counter or stack pointer register, I/O, BREAK and the bulk memory instructions are
+	// executed by the interpreter
+	if(instruction->type & INSTRUCTION_FLAG_REGISTERS)
+		return FALSE;
+
+	// Fused instructions are translated as their first instruction, the rest of the sequence follows in the block
+	switch(INSTRUCTION_TYPE(instruction))
+	{
+	case INSTRUCTION_JUMP:
+		*terminator = TRUE;
+
+		if(instruction->types[0] == ARGUMENT_ADDRESS)
+		{
+			if(!IsValidAddressExecute(emulator, instruction->arguments[0]))
+				return FALSE;
+
+			EmitExit(jit, instruction->arguments[0], retired + 1, FALSE);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+		{
+			EmitLoadRegister(jit, HOST_RAX, instruction->arguments[0]);
+			EmitCompareConstant(jit, HOST_RAX, emulator->instructions);
+			EmitSideExit(jit, CONDITION_ABOVE_EQUAL, address, retired);
+
+			// mov rdx, imm64; or rax, rdx
+			EmitByte(jit, 0x48);
+			EmitByte(jit, 0xBA);
+			EmitQword(jit, (ULONGLONG)(retired + 1) << 32);
+			EmitByte(jit, 0x48); EmitByte(jit, 0x09); EmitByte(jit, 0xD0);
+			EmitJump(jit, JIT_EPILOGUE);
+		}
+		else
+			return FALSE;
+
+		return TRUE;
+
+	case INSTRUCTION_COND:
+	case INSTRUCTION_CONDJUMP:
+		*terminator = TRUE;
+
+		if(instruction->types[0] == ARGUMENT_ADDRESS)
+		{
+			if(instruction->arguments[0] >= emulator->capacity)
+				return FALSE;
+
+			EmitMoveConstant(jit, HOST_RCX, instruction->arguments[0]);
+			EmitMemory(jit, 0x8B, HOST_RAX);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+			EmitLoadRegister(jit, HOST_RAX, instruction->arguments[0]);
+		else
+		{
+			EmitExit(jit, address + 1, retired + 1, FALSE);
+			return TRUE;
+		}
+
+		// test eax, eax; jnz taken
+		EmitRegister(jit, 0x85, HOST_RAX, HOST_RAX);
+		EmitByte(jit, 0x0F);
+		EmitByte(jit, 0x80 | CONDITION_NOT_EQUAL);
+		EmitDword(jit, 15);		// Size of the exit below
+		EmitExit(jit, address + 1, retired + 1, FALSE);
+		EmitExit(jit, address + 2, retired + 1, FALSE);
+		return TRUE;
+
+	case INSTRUCTION_MOVE:
+		if(instruction->types[0] == ARGUMENT_ADDRESS)
+		{
+			if(!IsValidAddressWrite(emulator, instruction->arguments[0], 1))
+				return FALSE;
+
+			if(!EmitFetch(jit, emulator, instruction, 1, HOST_RAX))
+				return FALSE;
+
+			EmitMoveConstant(jit, HOST_RCX, instruction->arguments[0]);
+			EmitMemory(jit, 0x89, HOST_RAX);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+		{
+			if(!EmitFetch(jit, emulator, instruction, 1, HOST_RAX))
+				return FALSE;
+
+			EmitStoreRegister(jit, instruction->arguments[0], HOST_RAX);
+		}
+		else
+			return FALSE;
+
+		return TRUE;
+
+	case INSTRUCTION_ADD:
+	case INSTRUCTION_SUB:
+	case INSTRUCTION_ADDLOAD:
+	case INSTRUCTION_ADDJUMP:
+		if(!EmitFetch(jit, emulator, instruction, 1, HOST_RAX) || !EmitFetch(jit, emulator, instruction, 2, HOST_RDX))
+			return FALSE;
+
+		// add/sub eax, edx
+		EmitRegister(jit, (BYTE)(INSTRUCTION_TYPE(instruction) == INSTRUCTION_SUB ? 0x29 : 0x01), HOST_RDX, HOST_RAX);
+		EmitStoreRegister(jit, instruction->arguments[0], HOST_RAX);
+		return TRUE;
+
+	case INSTRUCTION_LOAD:
+	case INSTRUCTION_LOADCONDJUMP:
+		if(instruction->types[1] == ARGUMENT_CONSTANT)
+		{
+			if(!IsValidAddressRead(emulator, instruction->arguments[1], 1))
+				return FALSE;
+
+			EmitMoveConstant(jit, HOST_RCX, instruction->arguments[1]);
+		}
+		else if(instruction->types[1] == ARGUMENT_REGISTER)
+		{
+			EmitLoadRegister(jit, HOST_RCX, instruction->arguments[1]);
+			EmitAddressCheck(jit, emulator, address, retired);
+		}
+		else
+			return FALSE;
+
+		EmitMemory(jit, 0x8B, HOST_RAX);
+		EmitStoreRegister(jit, instruction->arguments[0], HOST_RAX);
+		return TRUE;
+
+	case INSTRUCTION_STORE:
+		if(!EmitFetchImmediate(jit, instruction, 1, HOST_RAX))
+			return FALSE;
+
+		if(instruction->types[0] == ARGUMENT_CONSTANT)
+		{
+			if(!IsValidAddressWrite(emulator, instruction->arguments[0], 1))
+				return FALSE;
+
+			EmitMoveConstant(jit, HOST_RCX, instruction->arguments[0]);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+		{
+			EmitLoadRegister(jit, HOST_RCX, instruction->arguments[0]);
+			EmitAddressCheck(jit, emulator, address, retired);
+		}
+		else
+			return FALSE;
+
+		EmitMemory(jit, 0x89, HOST_RAX);
+		return TRUE;
+
+	case INSTRUCTION_PUSH:
+		if(!EmitFetchImmediate(jit, instruction, 0, HOST_RAX))
+			return FALSE;
+
+		EmitRegister(jit, 0x89, HOST_RSI, HOST_RCX);
+		EmitAddressCheck(jit, emulator, address, retired);
+		EmitMemory(jit, 0x89, HOST_RAX);
+
+		// add esi, 1
+		EmitByte(jit, 0x83); EmitModRM(jit, 3, 0, HOST_RSI); EmitByte(jit, 1);
+		return TRUE;
+
+	case INSTRUCTION_POP:
+		EmitLea(jit, HOST_RCX, HOST_RSI, -1);
+		EmitAddressCheck(jit, emulator, address, retired);
+		EmitMemory(jit, 0x8B, HOST_RAX);
+		EmitStoreRegister(jit, instruction->arguments[0], HOST_RAX);
+
+		// sub esi, 1
+		EmitByte(jit, 0x83); EmitModRM(jit, 3, 5, HOST_RSI); EmitByte(jit, 1);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+// Compiles the block starting at address, returns JIT_BLOCK_INTERPRET if its first instruction can't be compiled
+static LPJITENTRY CompileBlock(LPJIT jit, LPEMULATOR emulator, ULONG address)
+{
+	SIZE_T start;
+	SIZE_T mark;
+	ULONG pending;
+	ULONG length;
+	ULONG index;
+	BOOL terminator = FALSE;
+	LPJITFAULT faults;
+
+	if((!jit->shared || EMULATOR_JIT_BUFFER - jit->used < JIT_BLOCK_BYTES) && !ResetJit(jit, emulator->instructions))
+		return NULL;
+
+	// Room for the unchecked memory accesses of the block, the block is compiled later if there is not enough memory
+	if(emulator->guarded && jit->slots - jit->accesses < JIT_EXITS)
+	{
+		faults = jit->faults ? HeapReAlloc(GetProcessHeap(), 0, jit->faults, (jit->slots * 2) * sizeof(JITFAULT)) : HeapAlloc(GetProcessHeap(), 0, (JIT_EXITS * 16) * sizeof(JITFAULT));
+		if(!faults)
+			return NULL;
+
+		jit->slots = jit->faults ? jit->slots * 2 : JIT_EXITS * 16;
+		jit->faults = faults;
+	}
+
+	// The block is compiled later if there is no room for it
+	if(!UnprotectJit(jit, JIT_BLOCK_BYTES))
+	{
+		ResetJit(jit, emulator->instructions);
+		return NULL;
+	}
+
+	start = jit->used;
+	jit->pending = 0;
+
+	EmitPrologue(jit);
+
+	for(length = 0; length < EMULATOR_JIT_BLOCK && address + length < emulator->instructions && !terminator; ++length)
+	{
+		mark = jit->used;
+		pending = jit->pending;
+
+		if(!CompileInstruction(jit, emulator, &emulator->code[address + length], address + length, length, &terminator))
+		{
+			// Drop whatever was emitted for the instruction and let the interpreter execute it
+			jit->used = mark;
+			jit->pending = pending;
+			break;
+		}
+	}
+
+	if(!length)
+	{
+		jit->used = start;
+
+		if(!ProtectJit(jit, start))
+		{
+			ResetJit(jit, emulator->instructions);
+			return NULL;
+		}
+
+		return JIT_BLOCK_INTERPRET;
+	}
+
+	if(!terminator)
+		EmitExit(jit, address + length, length, address + length < emulator->instructions);
+
+	// Side exit stubs, the accesses faulting into one are ordered since the block follows the previous blocks
+	for(index = 0; index < jit->pending; ++index)
+	{
+		if(jit->exits[index].fault)
+		{
+			jit->faults[jit->accesses].offset = jit->exits[index].offset;
+			jit->faults[jit->accesses].exit = (ULONG)jit->used;
+			++jit->accesses;
+		}
+		else
+			*(PULONG)&jit->buffer[jit->exits[index].offset] = (ULONG)(jit->used - (jit->exits[index].offset + 4));
+
+		EmitExit(jit, jit->exits[index].address, jit->exits[index].retired, TRUE);
+	}
+
+	// The block only runs once its pages are executable again
+	if(jit->overflow || !ProtectJit(jit, start))
+	{
+		ResetJit(jit, emulator->instructions);
+		return NULL;
+	}
+
+	jit->blocks[address].length = length;
+	return (LPJITENTRY)(jit->buffer + start);
+}
+
+BOOL InitializeJit(LPEMULATOR emulator)
+{
+	LPJIT jit;
+
+	jit = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(JIT));
+	if(!jit)
+		return FALSE;
+
+	// Only the address space is taken up front, the pages are committed as code is emitted into them
+	jit->buffer = VirtualAlloc(NULL, EMULATOR_JIT_BUFFER, MEM_RESERVE, PAGE_NOACCESS);
+	if(!jit->buffer)
+	{
+		HeapFree(GetProcessHeap(), 0, jit);
+		return FALSE;
+	}
+
+	if(!ResetJit(jit, 0))
+	{
+		VirtualFree(jit->buffer, 0, MEM_RELEASE);
+		HeapFree(GetProcessHeap(), 0, jit);
+		return FALSE;
+	}
+
+	emulator->jit = jit;
+	return TRUE;
+}
+
+VOID UninitializeJit(LPEMULATOR emulator)
+{
+	LPJIT jit = emulator->jit;
+
+	if(jit->blocks)
+		HeapFree(GetProcessHeap(), 0, jit->blocks);
+
+	if(jit->faults)
+		HeapFree(GetProcessHeap(), 0, jit->faults);
+
+	VirtualFree(jit->buffer, 0, MEM_RELEASE);
+	HeapFree(GetProcessHeap(), 0, jit);
+
+	emulator->jit = NULL;
+}
+
+ULONGLONG RunJit(LPEMULATOR emulator, ULONGLONG maxInstructions)
+{
+	LPJIT jit = emulator->jit;
+	LPJITBLOCK block;
+	ULONGLONG result;
+	ULONGLONG retired = 0;
+	ULONGLONG limit = maxInstructions ? maxInstructions : (ULONGLONG)-1;
+	ULONG address;
+
+	// The blocks array follows the loaded program
+	if(jit->instructions != emulator->instructions)
+	{
+		if(jit->blocks)
+			HeapFree(GetProcessHeap(), 0, jit->blocks);
+
+		jit->instructions = 0;
+		jit->blocks = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (emulator->instructions + 1) * sizeof(JITBLOCK));
+		if(!jit->blocks)
+		{
+			// Fall back to the interpreter for this program
+			UninitializeJit(emulator);
+			return RunEmulator(emulator, maxInstructions);
+		}
+
+		jit->instructions = emulator->instructions;
+		ResetJit(jit, jit->instructions);
+	}
+
+	while(retired < limit)
+	{
+		address = emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+
+		// Sample requests are polled between blocks
+		if(emulator->sampler && ((LPEMULATORSAMPLER)emulator->sampler)->pending)
+			RecordSample(emulator, address);
+
+		if(address < jit->instructions)
+		{
+			block = &jit->blocks[address];
+
+			if(!block->entry && ++block->count >= EMULATOR_JIT_THRESHOLD)
+				block->entry = CompileBlock(jit, emulator, address);
+
+			if(block->entry && block->entry != JIT_BLOCK_INTERPRET && limit - retired >= block->length)
+			{
+				result = block->entry(emulator->registers, emulator->memory);
+
+				emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER] = (ULONG)result;
+				retired += (result & ~JIT_EXIT_INTERPRET) >> 32;
+
+				if(!(result & JIT_EXIT_INTERPRET) || retired >= limit)
+					continue;
+			}
+		}
+
+		// Cold code, I/O and all exceptional paths go through the interpreter
+		if(!ExecuteInstruction(emulator))
+		{
+			if(emulator->exception == EMULATOR_EXCEPTION_NONE && !emulator->waiting)
+				++retired;
+
+			break;
+		}
+
+		++retired;
+	}
+
+	return retired;
+}
+
+BOOL RecoverJitFault(LPEMULATOR emulator, PCONTEXT context)
+{
+	LPJIT jit = emulator->jit;
+	ULONG_PTR offset = (ULONG_PTR)context->Rip - (ULONG_PTR)jit->buffer;
+	ULONG first = 0;
+	ULONG last = jit->accesses;
+	ULONG middle;
+
+	if(offset >= jit->used)
+		return FALSE;
+
+	while(first < last)
+	{
+		middle = first + (last - first) / 2;
+
+		if(jit->faults[middle].offset < offset)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	if(first == jit->accesses || jit->faults[first].offset != offset)
+		return FALSE;
+
+	context->Rip = (ULONG_PTR)(jit->buffer + jit->faults[first].exit);
+	return TRUE;
+}
+
+#else
+
+BOOL InitializeJit(LPEMULATOR emulator)
+{
+	return FALSE;
+}
+
+VOID UninitializeJit(LPEMULATOR emulator)
+{
+}
+
+ULONGLONG RunJit(LPEMULATOR emulator, ULONGLONG maxInstructions)
+{
+	return 0;
+}
+
+BOOL RecoverJitFault(LPEMULATOR emulator, PCONTEXT context)
+{
+	return FALSE;
+}
+
+#endif
@@ -1,39 +1,259 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "Emulator.h"
 
 int main(int argc,const char** argv)
 {
 	EMULATOR emulator;
+	ULONG flags = 0;
+	BOOL image = FALSE;
+	LPCSTR save = NULL;
+	LPCSTR translate = NULL;
+	LPCSTR batch = NULL;
+	LPCSTR report = NULL;
+	LPCSTR stacks = NULL;
+	LPCSTR samples = NULL;
+	LPCSTR cache = NULL;
+	ULONG threads = 0;
+	ULONG slice = 0;
+	ULONG guests = 0;
+	ULONGLONG quota = 0;
+	ULONG timeout = 0;
+	ULONG memory = EMULATOR_DEFAULT_MEMORY;
+	ULONG output = EMULATOR_OUTPUT_BUFFER;
+	ULONG committed;
+	ULONG pages;
+	BOOL result;
 
 	--argc;
 	++argv;
 
+	while(argc && argv[0][0] == '-')
+	{
+		if(!strcmp(argv[0], "-jit"))
+			flags |= EMULATOR_FLAG_JIT;
+		else if(!strcmp(argv[0], "-prefetch"))
+			flags |= EMULATOR_FLAG_PREFETCH_INPUT;
+		else if(!strcmp(argv[0], "-image"))
+			image = TRUE;
+		else if(!strcmp(argv[0], "-sparse"))
+			flags |= EMULATOR_FLAG_SPARSE;
+		else if(!strcmp(argv[0], "-memory") && argc > 1)
+		{
+			memory = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-save") && argc > 1)
+		{
+			save = argv[1];
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-output") && argc > 1)
+		{
+			output = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-translate") && argc > 1)
+		{
+			translate = argv[1];
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-profile") && argc > 1)
+		{
+			report = argv[1];
+			flags |= EMULATOR_FLAG_PROFILE;
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-stacks") && argc > 1)
+		{
+			stacks = argv[1];
+			flags |= EMULATOR_FLAG_PROFILE;
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-sample") && argc > 1)
+		{
+			samples = argv[1];
+			flags |= EMULATOR_FLAG_SAMPLE;
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-cache") && argc > 1)
+		{
+			cache = argv[1];
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-batch") && argc > 1)
+		{
+			batch = argv[1];
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-threads") && argc > 1)
+		{
+			threads = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-slice") && argc > 1)
+		{
+			slice = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-guests") && argc > 1)
+		{
+			guests = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-quota") && argc > 1)
+		{
+			quota = _strtoui64(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else if(!strcmp(argv[0], "-timeout") && argc > 1)
+		{
+			timeout = strtoul(argv[1], NULL, 0);
+
+			--argc;
+			++argv;
+		}
+		else
+		{
+			printf("Unknown option '%s'.\n", argv[0]);
+			return 1;
+		}
+
+		--argc;
+		++argv;
+	}
+
+	// The cache directory is created on first use, the programs are assembled as usual if it can't be
+	if(cache)
+		CreateDirectory(cache, NULL);
+
+	// Run every job of a manifest instead of a single program
+	if(batch)
+	{
+		if(!RunBatch(batch, flags, threads, samples, cache, slice, guests, quota, timeout))
+		{
+			printf("Failed to run the batch manifest '%s'.\n", batch);
+			return 1;
+		}
+
+		return 0;
+	}
+
 	if(!argc)
 	{
 		printf("No input file specified.\n");
 		return 1;
 	}
 
-	if(!InitializeEmulator(&emulator, EMULATOR_DEFAULT_MEMORY))
+	if(!InitializeEmulatorEx(&emulator, memory, flags))
 	{
 		printf("Failed to initialize the emulation engine.\n");
 		return 1;
 	}
 
-	if(!LoadProgramFromSourceFile(&emulator, argv[0]))
+	if(!SetEmulatorOutputBuffer(&emulator, output))
 	{
-		printf("Failed to load the input file '%s'. Error %0#8x.\n", argv[0], emulator.error);
+		printf("Failed to allocate the output buffer.\n");
 
 		UninitializeEmulator(&emulator);
 		return 1;
 	}
 
-	while(ExecuteInstruction(&emulator));
+	SetEmulatorCache(&emulator, cache);
+
+	if(image)
+		result = LoadProgramFromFile(&emulator, argv[0]);
+	else
+		result = LoadProgramFromSourceFile(&emulator, argv[0]);
+
+	if(!result)
+	{
+		if(emulator.line)
+			printf("Failed to load the input file '%s'. Error %0#8x on line %u.\n", argv[0], emulator.error, emulator.line);
+		else
+			printf("Failed to load the input file '%s'. Error %0#8x.\n", argv[0], emulator.error);
+
+		UninitializeEmulator(&emulator);
+		return 1;
+	}
+
+	// Assemble only
+	if(save)
+	{
+		if(!SaveProgramToFile(&emulator, save))
+		{
+			printf("Failed to save the program image '%s'. Error %0#8x.\n", save, emulator.error);
+
+			UninitializeEmulator(&emulator);
+			return 1;
+		}
+
+		UninitializeEmulator(&emulator);
+		return 0;
+	}
+
+	if(translate)
+	{
+		if(!TranslateProgramToFile(&emulator, translate))
+		{
+			printf("Failed to translate the program to '%s'. Error %0#8x.\n", translate, emulator.error);
+
+			UninitializeEmulator(&emulator);
+			return 1;
+		}
+
+		UninitializeEmulator(&emulator);
+		return 0;
+	}
+
+	RunEmulator(&emulator, 0);
 
 	if(emulator.exception != EMULATOR_EXCEPTION_NONE)
 		printf("Exception %0#8x occured at address %0#8x. Program terminated.\n", emulator.exception, emulator.registers[EMULATOR_REGISTER_PROGRAM_COUNTER]);
 
+	if(report && !SaveProfileReport(&emulator, report))
+		printf("Failed to write the profile report '%s'.\n", report);
+
+	if(stacks && !SaveProfileStacks(&emulator, stacks))
+		printf("Failed to write the profile stacks '%s'.\n", stacks);
+
+	if(samples && !SaveSamplesToFile(&emulator, samples, argv[0]))
+		printf("Failed to write the samples '%s'.\n", samples);
+
+	if(flags & EMULATOR_FLAG_SPARSE)
+	{
+		committed = GetCommittedMemoryPages(&emulator, &pages);
+		printf("Committed %u of %u memory pages.\n", committed, pages);
+	}
+
 	UninitializeEmulator(&emulator);
 	return 0;
 }
\ No newline at end of file
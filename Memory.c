@@ -0,0 +1,356 @@
+#include "Emulator.h"
+
+// Sparse memory is only reserved, the first access to one of its pages raises an access violation that a vectored
+// exception handler turns into a commit of the page before the access is retried, so the page reads as zero like the
+// rest of the memory. The handler serves every sparse emulator of the process and looks the faulting address up in the
+// list of memory regions. The memory of a clone is sparse too, the handler copies a page it commits from the snapshot
+// backing the clone and resets its write watch, so the clone shares every page it did not access with the snapshot.
+//
+// Compiled code forms word addresses in 32-bit registers, so with the whole 16 GiB they can reach reserved behind the
+// memory an address past its end lands in the guard region instead of some other allocation. The JIT then emits memory
+// accesses without checking their address and the same handler sends a thread that faults in the guard region to the
+// side exit of the access, the interpreter executes the instruction again and raises the access violation exception.
+// The guard region is a reservation of its own, only the memory is write watched, and it costs address space only. At
+// most MEMORY_GUARD_LIMIT emulators get one, the others (and the ones the address space can't be found for) run compiled
+// code that checks its addresses.
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+// Bytes addressable by a 32-bit word address
+#define MEMORY_GUARD_END ((SIZE_T)0x100000000 * sizeof(ULONG))
+// Emulators with a guard region at a time, 16 TiB of the 128 TiB user address space of 64-bit processes
+#define MEMORY_GUARD_LIMIT 1024
+// Times a free range for the memory and its guard region is looked for, another thread can take it in between
+#define MEMORY_GUARD_ATTEMPTS 4
+#endif
+
+typedef struct
+{
+	PBYTE base;
+	PBYTE end;			// End of the pages committed on first access, base if the memory is not sparse
+	PBYTE guard;		// End of the guard region, end if there is none
+	LPEMULATOR emulator;
+} MEMORYREGION,*LPMEMORYREGION;
+
+static SRWLOCK lock = SRWLOCK_INIT;
+static LPMEMORYREGION regions;
+static ULONG count;
+static ULONG size;
+static PVOID handler;
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+static volatile LONG guards;
+#endif
+
+static ULONG GetPageSize(VOID)
+{
+	SYSTEM_INFO information;
+
+	GetSystemInfo(&information);
+
+	return information.dwPageSize;
+}
+
+// Copies the snapshot pages of a clone the committed system page holding address covers from the snapshot backing the
+// clone, the page then counts as not written since that snapshot like the pages the clone did not access
+static VOID FillBackedPage(LPEMULATOR emulator, PBYTE address)
+{
+	LPSNAPSHOT backing = emulator->backing;
+	ULONG_PTR page = GetPageSize();
+	PBYTE start = (PBYTE)((ULONG_PTR)address & ~(page - 1));
+	ULONG index = (ULONG)((start - (PBYTE)emulator->memory) / (EMULATOR_PAGE_WORDS * sizeof(ULONG)));
+	ULONG words;
+
+	for(; index < backing->pages && (PBYTE)(emulator->memory + index * EMULATOR_PAGE_WORDS) < start + page; ++index)
+	{
+		if(!backing->table[index])
+			continue;
+
+		// The last page of the memory can be partial
+		words = emulator->capacity - index * EMULATOR_PAGE_WORDS;
+		if(words > EMULATOR_PAGE_WORDS)
+			words = EMULATOR_PAGE_WORDS;
+
+		CopyMemory(emulator->memory + index * EMULATOR_PAGE_WORDS, backing->table[index]->words, words * sizeof(ULONG));
+	}
+
+	ResetWriteWatch(start, page);
+}
+
+static LONG CALLBACK HandleMemoryFault(PEXCEPTION_POINTERS exception)
+{
+	PEXCEPTION_RECORD record = exception->ExceptionRecord;
+	PBYTE address;
+	ULONG index;
+	LONG result = EXCEPTION_CONTINUE_SEARCH;
+
+	if(record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+		return EXCEPTION_CONTINUE_SEARCH;
+
+	address = (PBYTE)record->ExceptionInformation[1];
+
+	AcquireSRWLockShared(&lock);
+
+	for(index = 0; index < count; ++index)
+	{
+		if(address >= regions[index].base && address < regions[index].guard)
+		{
+			if(address < regions[index].end)
+			{
+				// A page that can't be committed is left to the next handler like any other access violation
+				if(VirtualAlloc(address, 1, MEM_COMMIT, PAGE_READWRITE))
+				{
+					if(regions[index].emulator->backing)
+						FillBackedPage(regions[index].emulator, address);
+
+					result = EXCEPTION_CONTINUE_EXECUTION;
+				}
+			}
+#if defined(EMULATOR_JIT_SUPPORTED)
+			else if(regions[index].emulator->jit && RecoverJitFault(regions[index].emulator, exception->ContextRecord))
+				result = EXCEPTION_CONTINUE_EXECUTION;
+#endif
+
+			break;
+		}
+	}
+
+	ReleaseSRWLockShared(&lock);
+
+	return result;
+}
+
+static BOOL RegisterMemory(LPEMULATOR emulator)
+{
+	LPMEMORYREGION grown;
+	BOOL result = TRUE;
+
+	AcquireSRWLockExclusive(&lock);
+
+	if(!handler)
+		handler = AddVectoredExceptionHandler(TRUE, HandleMemoryFault);
+
+	if(count == size)
+	{
+		grown = regions ? HeapReAlloc(GetProcessHeap(), 0, regions, (size * 2) * sizeof(MEMORYREGION)) : HeapAlloc(GetProcessHeap(), 0, 16 * sizeof(MEMORYREGION));
+		if(grown)
+		{
+			size = regions ? size * 2 : 16;
+			regions = grown;
+		}
+	}
+
+	if(!handler || count == size)
+		result = FALSE;
+	else
+	{
+		regions[count].base = (PBYTE)emulator->memory;
+		regions[count].end = (PBYTE)(emulator->flags & EMULATOR_FLAG_SPARSE ? emulator->memory + emulator->capacity : emulator->memory);
+		regions[count].guard = regions[count].end;
+		regions[count].emulator = emulator;
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+		if(emulator->guarded)
+			regions[count].guard = (PBYTE)emulator->memory + MEMORY_GUARD_END;
+#endif
+
+		++count;
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+
+	return result;
+}
+
+static VOID UnregisterMemory(LPEMULATOR emulator)
+{
+	ULONG index;
+
+	AcquireSRWLockExclusive(&lock);
+
+	for(index = 0; index < count; ++index)
+	{
+		if(regions[index].base == (PBYTE)emulator->memory)
+		{
+			regions[index] = regions[--count];
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+}
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+// Allocates the memory at the start of a free range of MEMORY_GUARD_END bytes and reserves the rest of the range as the
+// guard region, returns NULL if no such range is left
+static PULONG AllocateGuardedMemory(SIZE_T bytes, DWORD commit)
+{
+	PBYTE base;
+	ULONG attempt;
+
+	for(attempt = 0; attempt < MEMORY_GUARD_ATTEMPTS; ++attempt)
+	{
+		base = VirtualAlloc(NULL, MEMORY_GUARD_END, MEM_RESERVE, PAGE_NOACCESS);
+		if(!base)
+			return NULL;
+
+		VirtualFree(base, 0, MEM_RELEASE);
+
+		if(!VirtualAlloc(base, bytes, MEM_RESERVE | commit | MEM_WRITE_WATCH, PAGE_READWRITE))
+			continue;
+
+		if(VirtualAlloc(base + bytes, MEMORY_GUARD_END - bytes, MEM_RESERVE, PAGE_NOACCESS))
+			return (PULONG)base;
+
+		VirtualFree(base, 0, MEM_RELEASE);
+	}
+
+	return NULL;
+}
+
+static VOID FreeGuardRegion(LPEMULATOR emulator)
+{
+	VirtualFree(emulator->memory + emulator->capacity, 0, MEM_RELEASE);
+	InterlockedDecrement(&guards);
+
+	emulator->guarded = FALSE;
+}
+#endif
+
+BOOL AllocateEmulatorMemory(LPEMULATOR emulator, ULONG words)
+{
+	DWORD commit = emulator->flags & EMULATOR_FLAG_SPARSE ? 0 : MEM_COMMIT;
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+	// The guard region has to start on a page boundary to fault, memory of other sizes keeps the checks in compiled code
+	if((emulator->flags & (EMULATOR_FLAG_JIT | EMULATOR_FLAG_PROFILE)) == EMULATOR_FLAG_JIT && !(words * sizeof(ULONG) % GetPageSize()))
+	{
+		if(InterlockedIncrement(&guards) <= MEMORY_GUARD_LIMIT)
+			emulator->memory = AllocateGuardedMemory(words * sizeof(ULONG), commit);
+
+		// Without a guard region the memory is allocated like everywhere else
+		emulator->guarded = emulator->memory != NULL;
+		if(!emulator->guarded)
+			InterlockedDecrement(&guards);
+	}
+#endif
+
+	// The capacity and all address checks count words, the pages written since the last snapshot are tracked by the
+	// system so a snapshot or a restore only has to copy those
+	if(!emulator->memory)
+		emulator->memory = VirtualAlloc(NULL, words * sizeof(ULONG), MEM_RESERVE | commit | MEM_WRITE_WATCH, PAGE_READWRITE);
+
+	if(!emulator->memory)
+		return FALSE;
+
+	emulator->capacity = words;
+
+	if(((emulator->flags & EMULATOR_FLAG_SPARSE) || emulator->guarded) && !RegisterMemory(emulator))
+	{
+#if defined(EMULATOR_JIT_SUPPORTED)
+		// The handler has to know a guard region, memory that is not sparse does without one and keeps the checks
+		if(emulator->guarded)
+			FreeGuardRegion(emulator);
+
+		if(!(emulator->flags & EMULATOR_FLAG_SPARSE))
+			return TRUE;
+#endif
+
+		VirtualFree(emulator->memory, 0, MEM_RELEASE);
+
+		emulator->memory = NULL;
+		emulator->capacity = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+VOID FreeEmulatorMemory(LPEMULATOR emulator)
+{
+	if((emulator->flags & EMULATOR_FLAG_SPARSE) || emulator->guarded)
+		UnregisterMemory(emulator);
+
+#if defined(EMULATOR_JIT_SUPPORTED)
+	if(emulator->guarded)
+		FreeGuardRegion(emulator);
+#endif
+
+	VirtualFree(emulator->memory, 0, MEM_RELEASE);
+
+	emulator->memory = NULL;
+	emulator->capacity = 0;
+	emulator->guarded = FALSE;
+}
+
+ULONG GetEmulatorMemorySpan(LPEMULATOR emulator, ULONG address, PBOOL committed)
+{
+	MEMORY_BASIC_INFORMATION information;
+	SIZE_T words;
+
+	*committed = TRUE;
+
+	// Pages of a clone that were not committed yet hold the contents of its snapshot
+	if(!(emulator->flags & EMULATOR_FLAG_SPARSE) || emulator->backing || !VirtualQuery(emulator->memory + address, &information, sizeof(information)))
+		return emulator->capacity - address;
+
+	*committed = information.State == MEM_COMMIT;
+
+	words = ((PBYTE)information.BaseAddress + information.RegionSize - (PBYTE)(emulator->memory + address)) / sizeof(ULONG);
+
+	return words < emulator->capacity - address ? (ULONG)words : emulator->capacity - address;
+}
+
+VOID ClearEmulatorMemory(LPEMULATOR emulator, ULONG address, ULONG words)
+{
+	ULONG_PTR page = GetPageSize();
+	ULONG_PTR start = (ULONG_PTR)(emulator->memory + address);
+	ULONG_PTR end = (ULONG_PTR)(emulator->memory + address + words);
+	ULONG_PTR first;
+	ULONG_PTR last;
+
+	// A decommitted page of a clone would read as the page of its snapshot again
+	if(!(emulator->flags & EMULATOR_FLAG_SPARSE) || emulator->backing)
+	{
+		ZeroMemory(emulator->memory + address, words * sizeof(ULONG));
+		return;
+	}
+
+	// Only whole pages are decommitted, the last page of the memory is whole since nothing else lives in it
+	first = (start + page - 1) & ~(page - 1);
+	last = address + words == emulator->capacity ? (end + page - 1) & ~(page - 1) : end & ~(page - 1);
+
+	if(first >= last)
+	{
+		ZeroMemory((PVOID)start, end - start);
+		return;
+	}
+
+	ZeroMemory((PVOID)start, first - start);
+
+	if(!VirtualFree((PVOID)first, last - first, MEM_DECOMMIT))
+		ZeroMemory((PVOID)first, (end < last ? end : last) - first);
+
+	if(end > last)
+		ZeroMemory((PVOID)last, end - last);
+}
+
+ULONG GetCommittedMemoryPages(LPEMULATOR emulator, PULONG pages)
+{
+	ULONG page = GetPageSize();
+	ULONG committed = 0;
+	ULONG address;
+	ULONG span;
+	BOOL state;
+
+	*pages = (ULONG)(((ULONGLONG)emulator->capacity * sizeof(ULONG) + page - 1) / page);
+
+	for(address = 0; address < emulator->capacity; address += span)
+	{
+		span = GetEmulatorMemorySpan(emulator, address, &state);
+
+		if(state)
+			committed += (ULONG)(((ULONGLONG)span * sizeof(ULONG) + page - 1) / page);
+	}
+
+	return committed;
+}
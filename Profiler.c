@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "Emulator.h"
+
+// Profiler state, the counters are allocated by the first run once the program is loaded
+typedef struct
+{
+	CHAR source[MAX_PATH];	// Source file the program was loaded from, empty for binary program images
+	PULONG lines;			// Source line of every instruction, 0 if unknown
+	ULONG size;				// Number of entries in lines
+	ULONG instructions;		// Number of instructions the counters cover
+	PULONGLONG counts;		// Executions of every instruction
+	PULONGLONG taken;		// Executions of every COND that skipped the next instruction
+	PBYTE leaders;			// Nonzero for instructions reached other than by falling through
+	ULONGLONG opcodes[INSTRUCTION_COUNT];	// Executions of every instruction type
+	ULONGLONG retired;		// Total number of retired instructions
+} PROFILE,*LPPROFILE;
+
+BOOL InitializeProfiler(LPEMULATOR emulator)
+{
+	emulator->profile = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(PROFILE));
+
+	return emulator->profile != NULL;
+}
+
+VOID UninitializeProfiler(LPEMULATOR emulator)
+{
+	LPPROFILE profile = emulator->profile;
+
+	if(profile->lines)
+		HeapFree(GetProcessHeap(), 0, profile->lines);
+
+	if(profile->counts)
+		HeapFree(GetProcessHeap(), 0, profile->counts);
+
+	if(profile->taken)
+		HeapFree(GetProcessHeap(), 0, profile->taken);
+
+	if(profile->leaders)
+		HeapFree(GetProcessHeap(), 0, profile->leaders);
+
+	HeapFree(GetProcessHeap(), 0, profile);
+	emulator->profile = NULL;
+}
+
+VOID SetProfileSource(LPEMULATOR emulator, LPCSTR path)
+{
+	LPPROFILE profile = emulator->profile;
+
+	lstrcpyn(profile->source, path, MAX_PATH);
+}
+
+VOID SetProfileLine(LPEMULATOR emulator, ULONG address, ULONG line)
+{
+	LPPROFILE profile = emulator->profile;
+	PULONG lines;
+	ULONG size;
+
+	if(address >= profile->size)
+	{
+		size = profile->size ? profile->size * 2 : EMULATOR_CODE_SLOTS;
+		while(size <= address)
+			size *= 2;
+
+		if(profile->lines)
+			lines = HeapReAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, profile->lines, size * sizeof(ULONG));
+		else
+			lines = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size * sizeof(ULONG));
+
+		// Without memory the instruction is reported without its line
+		if(!lines)
+			return;
+
+		profile->lines = lines;
+		profile->size = size;
+	}
+
+	profile->lines[address] = line;
+}
+
+static ULONG GetProfileLine(LPPROFILE profile, ULONG address)
+{
+	return address < profile->size ? profile->lines[address] : 0;
+}
+
+static BOOL AllocateProfileCounters(LPEMULATOR emulator, LPPROFILE profile)
+{
+	ULONG instructions = emulator->instructions ? emulator->instructions : 1;
+
+	profile->counts = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, instructions * sizeof(ULONGLONG));
+	profile->taken = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, instructions * sizeof(ULONGLONG));
+	profile->leaders = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, instructions);
+
+	if(!profile->counts || !profile->taken || !profile->leaders)
+	{
+		if(profile->counts)
+			HeapFree(GetProcessHeap(), 0, profile->counts);
+
+		if(profile->taken)
+			HeapFree(GetProcessHeap(), 0, profile->taken);
+
+		if(profile->leaders)
+			HeapFree(GetProcessHeap(), 0, profile->leaders);
+
+		profile->counts = NULL;
+		profile->taken = NULL;
+		profile->leaders = NULL;
+		return FALSE;
+	}
+
+	profile->instructions = emulator->instructions;
+
+	// The entry point and everything reached by a static jump or after a control transfer start a block, dynamic
+	// control transfers are added as they execute
+	profile->leaders[0] = 1;
+
+	for(instructions = 0; instructions < emulator->instructions; ++instructions)
+	{
+		LPINSTRUCTION instruction = &emulator->code[instructions];
+
+		switch(GetUnfusedType((BYTE)INSTRUCTION_TYPE(instruction)))
+		{
+		case INSTRUCTION_JUMP:
+			if(instruction->types[0] == ARGUMENT_ADDRESS && instruction->arguments[0] < emulator->instructions)
+				profile->leaders[instruction->arguments[0]] = 1;
+			// Fall through
+
+		case INSTRUCTION_BREAK:
+			if(instructions + 1 < emulator->instructions)
+				profile->leaders[instructions + 1] = 1;
+			break;
+
+		case INSTRUCTION_COND:
+			if(instructions + 1 < emulator->instructions)
+				profile->leaders[instructions + 1] = 1;
+
+			if(instructions + 2 < emulator->instructions)
+				profile->leaders[instructions + 2] = 1;
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+ULONGLONG RunProfiler(LPEMULATOR emulator, ULONGLONG maxInstructions)
+{
+	LPPROFILE profile = emulator->profile;
+	ULONGLONG retired = 0;
+	ULONG address;
+	ULONG next;
+	BYTE type;
+	BOOL result;
+
+	if(emulator->halted)
+		return 0;
+
+	if(!profile->counts && !AllocateProfileCounters(emulator, profile))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return 0;
+	}
+
+	while(!maxInstructions || retired < maxInstructions)
+	{
+		address = emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+		type = address < profile->instructions ? GetUnfusedType((BYTE)INSTRUCTION_TYPE(&emulator->code[address])) : INSTRUCTION_NONE;
+
+		// Fused instructions are executed one instruction at a time by ExecuteInstruction
+		result = ExecuteInstruction(emulator);
+
+		// The faulting instruction and a READ waiting for input are not retired
+		if(!result && (emulator->exception != EMULATOR_EXCEPTION_NONE || emulator->waiting))
+			break;
+
+		++retired;
+
+		if(address < profile->instructions)
+		{
+			next = emulator->registers[EMULATOR_REGISTER_PROGRAM_COUNTER];
+
+			++profile->counts[address];
+			++profile->opcodes[type];
+
+			if(type == INSTRUCTION_COND && next == address + 2)
+				++profile->taken[address];
+
+			if(next != address + 1 && next < profile->instructions)
+				profile->leaders[next] = 1;
+		}
+
+		if(!result)
+			break;
+	}
+
+	profile->retired += retired;
+
+	return retired;
+}
+
+static double GetProfilePercent(LPPROFILE profile, ULONGLONG count)
+{
+	return profile->retired ? 100.0 * (double)count / (double)profile->retired : 0.0;
+}
+
+BOOL SaveProfileReport(LPEMULATOR emulator, LPCSTR path)
+{
+	LPPROFILE profile = emulator->profile;
+	CHAR buffer[EMULATOR_READ_BUFFER];
+	PULONGLONG counts = NULL;
+	PBYTE executable = NULL;
+	FILE* file;
+	FILE* source = NULL;
+	ULONG lines = 0;
+	ULONG line;
+	ULONG address;
+	ULONG blocks = 0;
+	ULONG covered = 0;
+	ULONG type;
+
+	if(!profile)
+		return FALSE;
+
+	// A program that never ran still gets a report of its blocks
+	if(!profile->counts && !AllocateProfileCounters(emulator, profile))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	file = fopen(path, "wt");
+	if(!file)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	fprintf(file, "; Profile of %s, %llu instructions retired\n", profile->source[0] ? profile->source : "<image>", profile->retired);
+
+	fprintf(file, ";\n; Instructions by opcode\n");
+	for(type = INSTRUCTION_JUMP; type <= INSTRUCTION_MEMCHR; ++type)
+		if(profile->opcodes[type])
+			fprintf(file, ";   %-8s %14llu %6.2f%%\n", GetInstructionName((BYTE)type), profile->opcodes[type], GetProfilePercent(profile, profile->opcodes[type]));
+
+	for(address = 0; address < profile->instructions; ++address)
+	{
+		if(!profile->leaders[address])
+			continue;
+
+		++blocks;
+		if(profile->counts[address])
+			++covered;
+	}
+
+	fprintf(file, ";\n; Basic blocks: %u of %u executed (%.2f%%)\n", covered, blocks, blocks ? 100.0 * covered / blocks : 0.0);
+	for(address = 0; address < profile->instructions; ++address)
+		if(profile->leaders[address] && !profile->counts[address])
+			fprintf(file, ";   never executed: address %0#8x line %u\n", address, GetProfileLine(profile, address));
+
+	fprintf(file, ";\n; COND outcomes (taken skips the next instruction)\n");
+	for(address = 0; address < profile->instructions; ++address)
+	{
+		if(GetUnfusedType((BYTE)INSTRUCTION_TYPE(&emulator->code[address])) != INSTRUCTION_COND || !profile->counts[address])
+			continue;
+
+		fprintf(file, ";   address %0#8x line %-6u taken %14llu not taken %14llu\n", address, GetProfileLine(profile, address),
+			profile->taken[address], profile->counts[address] - profile->taken[address]);
+	}
+
+	// Sum the counts of every source line, lines without instructions are marked with '-' and never executed lines with '#####'
+	for(address = 0; address < profile->instructions; ++address)
+		if(GetProfileLine(profile, address) > lines)
+			lines = GetProfileLine(profile, address);
+
+	if(lines)
+	{
+		counts = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (lines + 1) * sizeof(ULONGLONG));
+		executable = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, lines + 1);
+		source = fopen(profile->source, "rt");
+	}
+
+	if(counts && executable && source)
+	{
+		for(address = 0; address < profile->instructions; ++address)
+		{
+			line = GetProfileLine(profile, address);
+
+			counts[line] += profile->counts[address];
+			executable[line] = 1;
+		}
+
+		fprintf(file, ";\n; Executions by source line\n");
+		for(line = 1; fgets(buffer, sizeof(buffer), source); ++line)
+		{
+			if(line > lines || !executable[line])
+				fprintf(file, "%14s %6s:%6u: %s", "-", "", line, buffer);
+			else if(!counts[line])
+				fprintf(file, "%14s %6s:%6u: %s", "#####", "", line, buffer);
+			else
+				fprintf(file, "%14llu %5.2f%%:%6u: %s", counts[line], GetProfilePercent(profile, counts[line]), line, buffer);
+
+			if(!strchr(buffer, '\n'))
+				fputc('\n', file);
+		}
+	}
+	else
+	{
+		// Programs loaded from images have no source, report every address instead
+		fprintf(file, ";\n; Executions by address\n");
+		for(address = 0; address < profile->instructions; ++address)
+			fprintf(file, "%14llu %5.2f%%: %0#8x %s\n", profile->counts[address], GetProfilePercent(profile, profile->counts[address]),
+				address, GetInstructionName((BYTE)INSTRUCTION_TYPE(&emulator->code[address])));
+	}
+
+	if(source)
+		fclose(source);
+
+	if(counts)
+		HeapFree(GetProcessHeap(), 0, counts);
+
+	if(executable)
+		HeapFree(GetProcessHeap(), 0, executable);
+
+	if(fclose(file))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_WRITE);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+BOOL SaveProfileStacks(LPEMULATOR emulator, LPCSTR path)
+{
+	LPPROFILE profile = emulator->profile;
+	LPCSTR program;
+	LPCSTR separator;
+	FILE* file;
+	ULONG address;
+	ULONG leader = 0;
+
+	if(!profile)
+		return FALSE;
+
+	// A program that never ran still gets a report of its blocks
+	if(!profile->counts && !AllocateProfileCounters(emulator, profile))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	file = fopen(path, "wt");
+	if(!file)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	// The program frame is the file name without its directory, flame graph tools split frames at ';'
+	program = profile->source[0] ? profile->source : "image";
+	for(separator = program; *separator; ++separator)
+		if(*separator == '\\' || *separator == '/')
+			program = separator + 1;
+
+	// The guest has no calls, so the stacks are program;basic block;instruction
+	for(address = 0; address < profile->instructions; ++address)
+	{
+		if(profile->leaders[address])
+			leader = address;
+
+		if(!profile->counts[address])
+			continue;
+
+		if(GetProfileLine(profile, leader))
+			fprintf(file, "%s;block@%u;%s@%u %llu\n", program, GetProfileLine(profile, leader),
+				GetInstructionName((BYTE)INSTRUCTION_TYPE(&emulator->code[address])), GetProfileLine(profile, address), profile->counts[address]);
+		else
+			fprintf(file, "%s;block@%08x;%s@%08x %llu\n", program, leader,
+				GetInstructionName((BYTE)INSTRUCTION_TYPE(&emulator->code[address])), address, profile->counts[address]);
+	}
+
+	if(fclose(file))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_WRITE);
+		return FALSE;
+	}
+
+	return TRUE;
+}
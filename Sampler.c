@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Emulator.h"
+
+// A single timer thread serves every sampled emulator of the process, it exits once the last one is uninitialized
+static SRWLOCK lock = SRWLOCK_INIT;
+static LPEMULATORSAMPLER samplers;
+static HANDLE thread;
+static BOOL handler;
+
+static VOID WriteSamples(LPEMULATORSAMPLER sampler, FILE* file, LPCSTR title);
+
+static DWORD WINAPI RunSamplerThread(LPVOID parameter)
+{
+	LPEMULATORSAMPLER sampler;
+	ULONG index;
+
+	for(;;)
+	{
+		Sleep(EMULATOR_SAMPLE_INTERVAL);
+
+		AcquireSRWLockExclusive(&lock);
+
+		if(!samplers)
+		{
+			CloseHandle(thread);
+			thread = NULL;
+
+			ReleaseSRWLockExclusive(&lock);
+			return 0;
+		}
+
+		for(sampler = samplers; sampler; sampler = sampler->next)
+		{
+			sampler->pending = TRUE;
+
+			// The threaded interpreter takes the sample at its next dispatch, the entries are restored by the sample handler
+			if(sampler->sample)
+				for(index = 0; index < _countof(sampler->handlers); ++index)
+					sampler->handlers[index] = sampler->sample;
+		}
+
+		ReleaseSRWLockExclusive(&lock);
+	}
+}
+
+// Dumps the samples of every emulator to stderr on Ctrl+Break, the programs keep running
+static BOOL WINAPI DumpSamplers(DWORD type)
+{
+	LPEMULATORSAMPLER sampler;
+
+	if(type != CTRL_BREAK_EVENT)
+		return FALSE;
+
+	AcquireSRWLockExclusive(&lock);
+
+	for(sampler = samplers; sampler; sampler = sampler->next)
+		WriteSamples(sampler, stderr, "running emulator");
+
+	fflush(stderr);
+
+	ReleaseSRWLockExclusive(&lock);
+
+	return TRUE;
+}
+
+BOOL InitializeSampler(LPEMULATOR emulator)
+{
+	LPEMULATORSAMPLER sampler;
+
+	sampler = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(EMULATORSAMPLER));
+	if(!sampler)
+		return FALSE;
+
+	sampler->emulator = emulator;
+
+	AcquireSRWLockExclusive(&lock);
+
+	if(!thread)
+	{
+		thread = CreateThread(NULL, 0, RunSamplerThread, NULL, 0, NULL);
+		if(!thread)
+		{
+			ReleaseSRWLockExclusive(&lock);
+
+			HeapFree(GetProcessHeap(), 0, sampler);
+			return FALSE;
+		}
+	}
+
+	if(!handler)
+		handler = SetConsoleCtrlHandler(DumpSamplers, TRUE);
+
+	sampler->next = samplers;
+	samplers = sampler;
+
+	ReleaseSRWLockExclusive(&lock);
+
+	emulator->sampler = sampler;
+
+	return TRUE;
+}
+
+VOID UninitializeSampler(LPEMULATOR emulator)
+{
+	LPEMULATORSAMPLER sampler = emulator->sampler;
+	LPEMULATORSAMPLER* link;
+
+	AcquireSRWLockExclusive(&lock);
+
+	for(link = &samplers; *link; link = &(*link)->next)
+	{
+		if(*link == sampler)
+		{
+			*link = sampler->next;
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+
+	if(sampler->counts)
+		HeapFree(GetProcessHeap(), 0, sampler->counts);
+
+	HeapFree(GetProcessHeap(), 0, sampler);
+	emulator->sampler = NULL;
+}
+
+VOID RecordSample(LPEMULATOR emulator, ULONG address)
+{
+	LPEMULATORSAMPLER sampler = emulator->sampler;
+	PULONG counts;
+	BYTE type = INSTRUCTION_NONE;
+
+	sampler->pending = FALSE;
+
+	// The counters follow the loaded program
+	if(!sampler->counts)
+	{
+		counts = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, (emulator->instructions + 1) * sizeof(ULONG));
+		if(!counts)
+			return;
+
+		sampler->instructions = emulator->instructions;
+		InterlockedExchangePointer((PVOID*)&sampler->counts, counts);
+	}
+
+	if(address < sampler->instructions)
+		type = GetUnfusedType((BYTE)INSTRUCTION_TYPE(&emulator->code[address]));
+	else
+		address = sampler->instructions;
+
+	++sampler->counts[address];
+	++sampler->opcodes[type];
+	++sampler->samples;
+}
+
+VOID RestoreSampleHandlers(LPEMULATOR emulator, const void* const* handlers)
+{
+	LPEMULATORSAMPLER sampler = emulator->sampler;
+
+	// The timer thread points the entries at the sample handler with the lock held, a restore racing it would leave
+	// torn entries
+	AcquireSRWLockExclusive(&lock);
+	CopyMemory((PVOID)sampler->handlers, handlers, sizeof(sampler->handlers));
+	ReleaseSRWLockExclusive(&lock);
+}
+
+// Sorts the packed (count, address) pairs by decreasing count
+static int CompareSamples(const void* first, const void* second)
+{
+	ULONGLONG a = *(const ULONGLONG*)first;
+	ULONGLONG b = *(const ULONGLONG*)second;
+
+	return a < b ? 1 : a > b ? -1 : 0;
+}
+
+static VOID WriteSamples(LPEMULATORSAMPLER sampler, FILE* file, LPCSTR title)
+{
+	PULONGLONG sorted;
+	ULONG samples = sampler->samples;
+	ULONG count = 0;
+	ULONG address;
+	ULONG type;
+
+	fprintf(file, "; Samples of %s: %u taken every %u ms\n", title, samples, EMULATOR_SAMPLE_INTERVAL);
+
+	if(!samples || !sampler->counts)
+		return;
+
+	fprintf(file, "; Samples by opcode\n");
+	for(type = 0; type < INSTRUCTION_COUNT; ++type)
+		if(sampler->opcodes[type])
+			fprintf(file, ";   %-8s %10u %6.2f%%\n", GetInstructionName((BYTE)type), sampler->opcodes[type], 100.0 * sampler->opcodes[type] / samples);
+
+	// Pack the count above the address so a single sort orders the histogram
+	sorted = HeapAlloc(GetProcessHeap(), 0, (sampler->instructions + 1) * sizeof(ULONGLONG));
+	if(!sorted)
+		return;
+
+	for(address = 0; address <= sampler->instructions; ++address)
+		if(sampler->counts[address])
+			sorted[count++] = ((ULONGLONG)sampler->counts[address] << 32) | address;
+
+	qsort(sorted, count, sizeof(ULONGLONG), CompareSamples);
+
+	fprintf(file, "; Samples by address\n");
+	for(address = 0; address < count; ++address)
+	{
+		ULONG pc = (ULONG)sorted[address];
+		ULONG hits = (ULONG)(sorted[address] >> 32);
+
+		if(pc == sampler->instructions)
+			fprintf(file, "    %-10s %-8s %10u %6.2f%%\n", "outside", "", hits, 100.0 * hits / samples);
+		else
+			fprintf(file, "    %08x   %-8s %10u %6.2f%%\n", pc, GetInstructionName((BYTE)INSTRUCTION_TYPE(&sampler->emulator->code[pc])),
+				hits, 100.0 * hits / samples);
+	}
+
+	HeapFree(GetProcessHeap(), 0, sorted);
+}
+
+BOOL SaveSamplesToFile(LPEMULATOR emulator, LPCSTR path, LPCSTR title)
+{
+	FILE* file;
+
+	if(!emulator->sampler)
+		return FALSE;
+
+	// Emulators running in parallel append to the same file one at a time
+	AcquireSRWLockExclusive(&lock);
+
+	file = fopen(path, "at");
+	if(file)
+	{
+		WriteSamples(emulator->sampler, file, title);
+		fclose(file);
+	}
+
+	ReleaseSRWLockExclusive(&lock);
+
+	if(!file)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,337 @@
+#include "Emulator.h"
+
+// The scheduled programs (guests) wait in a single run queue, a worker thread takes the guest at the head, runs it for one
+// time slice and puts it back at the tail, so every runnable guest gets a slice before any guest gets a second one. A guest
+// whose READ found no input is parked until the prefetch thread of its input calls WakeGuest, so is a guest whose output
+// channel reached its backlog until the event loop caught up. Parked guests with a time quota are checked every
+// EMULATOR_SCHEDULER_TICK milliseconds.
+
+typedef struct GUEST
+{
+	LPSCHEDULER scheduler;
+	LPEMULATOR emulator;
+	ULONGLONG retired;		// Number of instructions retired so far
+	ULONGLONG quota;		// Number of instructions the guest may retire, 0 for no limit
+	ULONGLONG deadline;		// Tick count the guest is stopped at, 0 for no limit
+	LPSCHEDULERCALLBACK callback;
+	LPVOID context;
+	BOOL parked;			// Set while the guest waits for input or its output channel in the parked list
+	BOOL woken;				// Set if the guest was woken before the slice that had it wait was over
+	struct GUEST* next;		// Next guest in the run queue or the parked list
+	struct GUEST* previous;	// Previous guest in the parked list
+} GUEST,*LPGUEST;
+
+typedef struct SCHEDULER
+{
+	CRITICAL_SECTION lock;			// Guards everything below but the threads
+	CONDITION_VARIABLE runnable;	// Signaled when a guest was queued or the threads have to exit
+	CONDITION_VARIABLE finished;	// Signaled when the last guest stopped
+	LPGUEST head;			// Run queue
+	LPGUEST tail;
+	LPGUEST parked;			// Guests waiting for input or their output channel
+	ULONG guests;			// Number of guests that did not stop yet
+	ULONG timed;			// Number of guests with a time quota
+	ULONGLONG check;		// Tick count the parked guests are checked for their time quotas next
+	ULONG slice;
+	BOOL stop;
+	HANDLE* threads;
+	ULONG workers;
+} SCHEDULER;
+
+// Called with the lock held
+static VOID QueueGuest(LPSCHEDULER scheduler, LPGUEST guest)
+{
+	guest->next = NULL;
+
+	if(scheduler->tail)
+		scheduler->tail->next = guest;
+	else
+		scheduler->head = guest;
+
+	scheduler->tail = guest;
+
+	WakeConditionVariable(&scheduler->runnable);
+}
+
+// Called with the lock held
+static VOID UnparkGuest(LPSCHEDULER scheduler, LPGUEST guest)
+{
+	if(guest->previous)
+		guest->previous->next = guest->next;
+	else
+		scheduler->parked = guest->next;
+
+	if(guest->next)
+		guest->next->previous = guest->previous;
+
+	guest->parked = FALSE;
+	QueueGuest(scheduler, guest);
+}
+
+// Input callback of the emulators, called by their prefetch thread
+static VOID CALLBACK WakeGuest(LPVOID context)
+{
+	LPGUEST guest = context;
+	LPSCHEDULER scheduler = guest->scheduler;
+
+	EnterCriticalSection(&scheduler->lock);
+
+	// The worker running the slice that found no input queues the guest again instead of parking it
+	if(guest->parked)
+		UnparkGuest(scheduler, guest);
+	else
+		guest->woken = TRUE;
+
+	LeaveCriticalSection(&scheduler->lock);
+}
+
+// Queues the parked guests that ran out of time, the worker taking them stops them. Called with the lock held
+static VOID ExpireParkedGuests(LPSCHEDULER scheduler, ULONGLONG now)
+{
+	LPGUEST guest;
+	LPGUEST next;
+
+	for(guest = scheduler->parked; guest; guest = next)
+	{
+		next = guest->next;
+
+		if(guest->deadline && now >= guest->deadline)
+			UnparkGuest(scheduler, guest);
+	}
+
+	scheduler->check = now + EMULATOR_SCHEDULER_TICK;
+}
+
+static VOID StopGuest(LPSCHEDULER scheduler, LPGUEST guest)
+{
+	// Once the callbacks are detached the prefetch thread and the event loop can't reach the guest anymore
+	SetEmulatorInputCallback(guest->emulator, NULL, NULL);
+	SetEmulatorOutputCallback(guest->emulator, NULL, NULL);
+
+	if(guest->callback)
+		guest->callback(guest->emulator, guest->retired, guest->context);
+
+	EnterCriticalSection(&scheduler->lock);
+
+	if(guest->deadline)
+		--scheduler->timed;
+
+	// The callback may have scheduled another guest, so the count only drops to 0 once nothing is left to run
+	if(!--scheduler->guests)
+		WakeAllConditionVariable(&scheduler->finished);
+
+	LeaveCriticalSection(&scheduler->lock);
+
+	HeapFree(GetProcessHeap(), 0, guest);
+}
+
+// Runs a slice of the guest, returns FALSE if the guest stopped
+static BOOL RunGuest(LPSCHEDULER scheduler, LPGUEST guest)
+{
+	LPEMULATOR emulator = guest->emulator;
+	ULONGLONG budget = scheduler->slice;
+
+	if(!guest->deadline || GetTickCount64() < guest->deadline)
+	{
+		if(guest->quota && guest->quota - guest->retired < budget)
+			budget = guest->quota - guest->retired;
+
+		guest->retired += RunEmulator(emulator, budget);
+
+		if(emulator->halted || emulator->error != EMULATOR_ERROR_NONE)
+			return FALSE;
+
+		// The worker parks the guest, ExpireParkedGuests looks after its time quota from now on
+		if(emulator->waiting)
+			return TRUE;
+
+		if(guest->quota && guest->retired >= guest->quota)
+		{
+			SetEmulatorException(emulator, EMULATOR_EXCEPTION_INSTRUCTION_QUOTA);
+			return FALSE;
+		}
+
+		if(!guest->deadline || GetTickCount64() < guest->deadline)
+			return TRUE;
+	}
+
+	SetEmulatorException(emulator, EMULATOR_EXCEPTION_TIME_QUOTA);
+	return FALSE;
+}
+
+static DWORD WINAPI RunSchedulerWorker(LPVOID parameter)
+{
+	LPSCHEDULER scheduler = parameter;
+	LPGUEST guest;
+	ULONGLONG now;
+
+	EnterCriticalSection(&scheduler->lock);
+
+	for(;;)
+	{
+		if(scheduler->timed)
+		{
+			now = GetTickCount64();
+			if(now >= scheduler->check)
+				ExpireParkedGuests(scheduler, now);
+		}
+
+		guest = scheduler->head;
+		if(!guest)
+		{
+			if(scheduler->stop)
+				break;
+
+			// Only the time quotas of parked guests need a thread to look at them without a guest to run
+			SleepConditionVariableCS(&scheduler->runnable, &scheduler->lock, scheduler->timed ? EMULATOR_SCHEDULER_TICK : INFINITE);
+			continue;
+		}
+
+		scheduler->head = guest->next;
+		if(!scheduler->head)
+			scheduler->tail = NULL;
+
+		LeaveCriticalSection(&scheduler->lock);
+
+		if(!RunGuest(scheduler, guest))
+		{
+			StopGuest(scheduler, guest);
+
+			EnterCriticalSection(&scheduler->lock);
+			continue;
+		}
+
+		EnterCriticalSection(&scheduler->lock);
+
+		if(guest->emulator->waiting && !guest->woken)
+		{
+			guest->parked = TRUE;
+			guest->previous = NULL;
+			guest->next = scheduler->parked;
+
+			if(scheduler->parked)
+				scheduler->parked->previous = guest;
+
+			scheduler->parked = guest;
+		}
+		else
+		{
+			guest->woken = FALSE;
+			QueueGuest(scheduler, guest);
+		}
+	}
+
+	LeaveCriticalSection(&scheduler->lock);
+
+	return 0;
+}
+
+LPSCHEDULER CreateScheduler(ULONG threads, ULONG slice)
+{
+	LPSCHEDULER scheduler;
+	SYSTEM_INFO information;
+
+	if(!threads)
+	{
+		GetSystemInfo(&information);
+		threads = information.dwNumberOfProcessors;
+	}
+
+	scheduler = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SCHEDULER));
+	if(!scheduler)
+		return NULL;
+
+	scheduler->threads = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, threads * sizeof(HANDLE));
+	if(!scheduler->threads)
+	{
+		HeapFree(GetProcessHeap(), 0, scheduler);
+		return NULL;
+	}
+
+	InitializeCriticalSection(&scheduler->lock);
+	InitializeConditionVariable(&scheduler->runnable);
+	InitializeConditionVariable(&scheduler->finished);
+
+	scheduler->slice = slice ? slice : EMULATOR_SCHEDULER_SLICE;
+
+	// Fewer threads than asked for only cost parallelism
+	for(scheduler->workers = 0; scheduler->workers < threads; ++scheduler->workers)
+	{
+		scheduler->threads[scheduler->workers] = CreateThread(NULL, 0, RunSchedulerWorker, scheduler, 0, NULL);
+		if(!scheduler->threads[scheduler->workers])
+			break;
+	}
+
+	if(!scheduler->workers)
+	{
+		DestroyScheduler(scheduler);
+		return NULL;
+	}
+
+	return scheduler;
+}
+
+BOOL ScheduleEmulator(LPSCHEDULER scheduler, LPEMULATOR emulator, ULONGLONG instructions, ULONG milliseconds, LPSCHEDULERCALLBACK callback, LPVOID context)
+{
+	LPGUEST guest;
+
+	guest = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(GUEST));
+	if(!guest)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	guest->scheduler = scheduler;
+	guest->emulator = emulator;
+	guest->quota = instructions;
+	guest->deadline = milliseconds ? GetTickCount64() + milliseconds : 0;
+	guest->callback = callback;
+	guest->context = context;
+
+	SetEmulatorInputCallback(emulator, WakeGuest, guest);
+	SetEmulatorOutputCallback(emulator, WakeGuest, guest);
+
+	EnterCriticalSection(&scheduler->lock);
+
+	++scheduler->guests;
+	if(guest->deadline)
+		++scheduler->timed;
+
+	QueueGuest(scheduler, guest);
+
+	LeaveCriticalSection(&scheduler->lock);
+
+	return TRUE;
+}
+
+VOID WaitScheduler(LPSCHEDULER scheduler)
+{
+	EnterCriticalSection(&scheduler->lock);
+
+	while(scheduler->guests)
+		SleepConditionVariableCS(&scheduler->finished, &scheduler->lock, INFINITE);
+
+	LeaveCriticalSection(&scheduler->lock);
+}
+
+VOID DestroyScheduler(LPSCHEDULER scheduler)
+{
+	ULONG index;
+
+	EnterCriticalSection(&scheduler->lock);
+	scheduler->stop = TRUE;
+	WakeAllConditionVariable(&scheduler->runnable);
+	LeaveCriticalSection(&scheduler->lock);
+
+	for(index = 0; index < scheduler->workers; ++index)
+	{
+		WaitForSingleObject(scheduler->threads[index], INFINITE);
+		CloseHandle(scheduler->threads[index]);
+	}
+
+	DeleteCriticalSection(&scheduler->lock);
+
+	HeapFree(GetProcessHeap(), 0, scheduler->threads);
+	HeapFree(GetProcessHeap(), 0, scheduler);
+}
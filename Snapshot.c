@@ -0,0 +1,304 @@
+#include "Emulator.h"
+
+// Guest memory is allocated with MEM_WRITE_WATCH, so the system records the pages the guest (or the loader) wrote to.
+// The write watch is reset whenever the memory is known to match a snapshot (emulator->snapshot), a new snapshot shares
+// every page of that snapshot that was not written since and a restore rewrites only the written pages and the pages
+// the two snapshots don't share. A clone starts out matching a snapshot of the emulator it was cloned from without any
+// committed page, its pages are copied from that snapshot as it accesses them (see Memory.c).
+
+// Returns an array with a nonzero entry for every snapshot page written since the write watch was last reset
+static PBYTE GetWrittenPages(LPEMULATOR emulator, ULONG pages)
+{
+	PBYTE written;
+	PVOID* addresses;
+	ULONG_PTR count = pages;
+	ULONG granularity;
+	ULONG_PTR index;
+	ULONG_PTR offset;
+
+	written = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, pages);
+	if(!written)
+		return NULL;
+
+	addresses = HeapAlloc(GetProcessHeap(), 0, pages * sizeof(PVOID));
+	if(!addresses)
+	{
+		HeapFree(GetProcessHeap(), 0, written);
+		return NULL;
+	}
+
+	if(GetWriteWatch(0, emulator->memory, emulator->capacity * sizeof(ULONG), addresses, &count, &granularity))
+	{
+		// Without the written pages every page has to be considered written
+		FillMemory(written, pages, 1);
+	}
+	else
+	{
+		for(index = 0; index < count; ++index)
+		{
+			// System pages larger than a snapshot page mark all the snapshot pages they contain
+			for(offset = 0; offset < granularity; offset += EMULATOR_PAGE_WORDS * sizeof(ULONG))
+			{
+				ULONG_PTR page = ((PBYTE)addresses[index] - (PBYTE)emulator->memory + offset) / (EMULATOR_PAGE_WORDS * sizeof(ULONG));
+
+				if(page < pages)
+					written[page] = 1;
+			}
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, addresses);
+
+	return written;
+}
+
+// Number of memory words in a snapshot page, the last page of the memory can be partial
+static ULONG GetPageWords(ULONG capacity, ULONG page)
+{
+	ULONG words = capacity - page * EMULATOR_PAGE_WORDS;
+
+	return words < EMULATOR_PAGE_WORDS ? words : EMULATOR_PAGE_WORDS;
+}
+
+static VOID ReleaseSnapshotPage(LPSNAPSHOTPAGE page)
+{
+	if(page && !InterlockedDecrement(&page->references))
+		HeapFree(GetProcessHeap(), 0, page);
+}
+
+LPSNAPSHOT SnapshotEmulator(LPEMULATOR emulator)
+{
+	LPSNAPSHOT snapshot;
+	LPSNAPSHOT base = emulator->snapshot;
+	ULONG pages = (emulator->capacity + EMULATOR_PAGE_WORDS - 1) / EMULATOR_PAGE_WORDS;
+	PBYTE written;
+	ULONG index;
+
+	// The page table follows the snapshot
+	snapshot = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SNAPSHOT) + pages * sizeof(LPSNAPSHOTPAGE));
+	if(!snapshot)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return NULL;
+	}
+
+	written = GetWrittenPages(emulator, pages);
+	if(!written)
+	{
+		HeapFree(GetProcessHeap(), 0, snapshot);
+
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return NULL;
+	}
+
+	snapshot->table = (LPSNAPSHOTPAGE*)(snapshot + 1);
+	snapshot->pages = pages;
+
+	for(index = 0; index < pages; ++index)
+	{
+		// Pages not written since the reset still hold the contents of the base snapshot (or zeroes)
+		if(!written[index])
+		{
+			if(base && base->table[index])
+			{
+				InterlockedIncrement(&base->table[index]->references);
+				snapshot->table[index] = base->table[index];
+			}
+
+			continue;
+		}
+
+		snapshot->table[index] = HeapAlloc(GetProcessHeap(), 0, sizeof(SNAPSHOTPAGE));
+		if(!snapshot->table[index])
+		{
+			while(index)
+				ReleaseSnapshotPage(snapshot->table[--index]);
+
+			HeapFree(GetProcessHeap(), 0, written);
+			HeapFree(GetProcessHeap(), 0, snapshot);
+
+			SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+			return NULL;
+		}
+
+		snapshot->table[index]->references = 1;
+		CopyMemory(snapshot->table[index]->words, emulator->memory + index * EMULATOR_PAGE_WORDS, GetPageWords(emulator->capacity, index) * sizeof(ULONG));
+	}
+
+	HeapFree(GetProcessHeap(), 0, written);
+
+	snapshot->capacity = emulator->capacity;
+	snapshot->exception = emulator->exception;
+	snapshot->error = emulator->error;
+	snapshot->halted = emulator->halted;
+	CopyMemory(snapshot->registers, emulator->registers, sizeof(snapshot->registers));
+
+	// One reference for the caller and one for the emulator, which matches the snapshot from now on
+	snapshot->references = 2;
+
+	ResetWriteWatch(emulator->memory, emulator->capacity * sizeof(ULONG));
+
+	if(base)
+		ReleaseSnapshot(base);
+
+	emulator->snapshot = snapshot;
+
+	return snapshot;
+}
+
+BOOL RestoreEmulator(LPEMULATOR emulator, LPSNAPSHOT snapshot)
+{
+	LPSNAPSHOT base = emulator->snapshot;
+	LPSNAPSHOTPAGE page;
+	PBYTE written;
+	ULONG index;
+	ULONG words;
+
+	if(snapshot->capacity != emulator->capacity)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_SNAPSHOT);
+		return FALSE;
+	}
+
+	written = GetWrittenPages(emulator, snapshot->pages);
+	if(!written)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	for(index = 0; index < snapshot->pages; ++index)
+	{
+		page = snapshot->table[index];
+
+		// A page not written since the reset that the base snapshot shares with the snapshot already holds its contents
+		if(!written[index] && (base ? base->table[index] : NULL) == page)
+			continue;
+
+		words = GetPageWords(emulator->capacity, index);
+
+		// Zeroed pages of sparse memory are decommitted
+		if(page)
+			CopyMemory(emulator->memory + index * EMULATOR_PAGE_WORDS, page->words, words * sizeof(ULONG));
+		else
+			ClearEmulatorMemory(emulator, index * EMULATOR_PAGE_WORDS, words);
+	}
+
+	HeapFree(GetProcessHeap(), 0, written);
+
+	ResetWriteWatch(emulator->memory, emulator->capacity * sizeof(ULONG));
+
+	InterlockedIncrement(&snapshot->references);
+
+	if(base)
+		ReleaseSnapshot(base);
+
+	emulator->snapshot = snapshot;
+
+	emulator->exception = snapshot->exception;
+	emulator->error = snapshot->error;
+	emulator->halted = snapshot->halted;
+	CopyMemory(emulator->registers, snapshot->registers, sizeof(emulator->registers));
+
+	return TRUE;
+}
+
+BOOL CloneEmulator(LPEMULATOR emulator, LPEMULATOR clone)
+{
+	LPSNAPSHOT snapshot;
+
+	// The clone runs the same code, which belongs to a shared program from now on
+	if(!emulator->program && !CreateProgramEx(emulator, FALSE))
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	// Output written before the clone comes first
+	FlushEmulatorOutput(emulator);
+
+	snapshot = SnapshotEmulator(emulator);
+	if(!snapshot)
+		return FALSE;
+
+	// The memory of the clone is sparse, the exception handler copies a page from the snapshot once it is accessed
+	if(!InitializeEmulatorEx(clone, emulator->capacity, emulator->flags | EMULATOR_FLAG_SPARSE))
+	{
+		ReleaseSnapshot(snapshot);
+
+		SetEmulatorError(emulator, EMULATOR_ERROR_NO_MEMORY);
+		return FALSE;
+	}
+
+	if(!AttachProgram(clone, emulator->program))
+	{
+		ReleaseSnapshot(snapshot);
+
+		SetEmulatorError(emulator, clone->error);
+
+		UninitializeEmulator(clone);
+		return FALSE;
+	}
+
+	// The initial memory contents of the program are decommitted again, from now on every page reads as the page of the
+	// snapshot and none counts as written since
+	ClearEmulatorMemory(clone, 0, clone->capacity);
+
+	clone->backing = snapshot;
+
+	InterlockedIncrement(&snapshot->references);
+
+	if(clone->snapshot)
+		ReleaseSnapshot(clone->snapshot);
+
+	clone->snapshot = snapshot;
+
+	ResetWriteWatch(clone->memory, clone->capacity * sizeof(ULONG));
+
+	clone->exception = snapshot->exception;
+	clone->error = snapshot->error;
+	clone->halted = snapshot->halted;
+	CopyMemory(clone->registers, snapshot->registers, sizeof(clone->registers));
+
+	return TRUE;
+}
+
+BOOL SetEmulatorResetState(LPEMULATOR emulator)
+{
+	LPSNAPSHOT snapshot;
+
+	snapshot = SnapshotEmulator(emulator);
+	if(!snapshot)
+		return FALSE;
+
+	if(emulator->reset)
+		ReleaseSnapshot(emulator->reset);
+
+	emulator->reset = snapshot;
+
+	return TRUE;
+}
+
+BOOL ResetEmulator(LPEMULATOR emulator)
+{
+	if(!emulator->reset)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_INVALID_SNAPSHOT);
+		return FALSE;
+	}
+
+	return RestoreEmulator(emulator, emulator->reset);
+}
+
+VOID ReleaseSnapshot(LPSNAPSHOT snapshot)
+{
+	ULONG index;
+
+	if(InterlockedDecrement(&snapshot->references))
+		return;
+
+	for(index = 0; index < snapshot->pages; ++index)
+		ReleaseSnapshotPage(snapshot->table[index]);
+
+	HeapFree(GetProcessHeap(), 0, snapshot);
+}
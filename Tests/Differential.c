@@ -0,0 +1,254 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../Emulator.h"
+
+// Runs every program of the corpus one instruction at a time with ExecuteInstruction and checks that the interpreter and
+// the JIT end in the same state: the registers (the program counter of a fault included), the memory, the exception, the
+// output and the number of retired instructions. The corpus holds programs that fault on purpose, a program reads its
+// input from the file with the same name and the .in extension, programs without one read from the null device. Hosts
+// without the JIT run the JIT modes on the interpreter.
+
+#define DIFFERENTIAL_MEMORY EMULATOR_DEFAULT_MEMORY	// Memory size of the emulators in words, the fault programs depend on it
+
+// Execution mode compared to single stepping
+typedef struct
+{
+	LPCSTR name;
+	ULONG flags;
+	ULONGLONG slice;	// Instructions every RunEmulator call may retire, 0 runs the program in one call
+} MODE;
+
+static const MODE modes[] =
+{
+	{"interpreter",		0,					0},
+	{"interpreter/1",	0,					1},
+	{"interpreter/3",	0,					3},
+	{"jit",				EMULATOR_FLAG_JIT,	0},
+	{"jit/1",			EMULATOR_FLAG_JIT,	1},
+	{"jit/3",			EMULATOR_FLAG_JIT,	3},
+};
+
+// Opens the input file of a program, every emulator reads it from the start
+static HANDLE OpenInput(LPCSTR path)
+{
+	CHAR input[MAX_PATH];
+	LPSTR extension;
+	HANDLE handle;
+
+	lstrcpyn(input, path, MAX_PATH);
+
+	extension = strrchr(input, '.');
+	if(extension)
+	{
+		lstrcpy(extension, ".in");
+
+		handle = CreateFile(input, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if(handle != INVALID_HANDLE_VALUE)
+			return handle;
+	}
+
+	return CreateFile("NUL", GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+}
+
+// Loads a program into a new emulator that collects its output, the input handle is closed by the caller
+static BOOL LoadProgram(LPEMULATOR emulator, LPCSTR path, ULONG flags, HANDLE input)
+{
+	if(!InitializeEmulatorEx(emulator, DIFFERENTIAL_MEMORY, flags))
+	{
+		fprintf(stderr, "Failed to initialize the emulation engine.\n");
+		return FALSE;
+	}
+
+	SetEmulatorInput(emulator, input);
+
+	if(!SetEmulatorOutput(emulator, NULL) || !LoadProgramFromSourceFile(emulator, path))
+	{
+		fprintf(stderr, "Failed to load the program '%s'. Error %0#8x.\n", path, emulator->error);
+
+		UninitializeEmulator(emulator);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Executes the program one instruction at a time, returns the number of retired instructions
+static ULONGLONG StepProgram(LPEMULATOR emulator)
+{
+	ULONGLONG retired = 0;
+
+	while(ExecuteInstruction(emulator))
+		++retired;
+
+	// BREAK is retired, a fault is not
+	if(emulator->exception == EMULATOR_EXCEPTION_NONE)
+		++retired;
+
+	return retired;
+}
+
+// Runs the program in calls of the given number of instructions, returns the number of retired instructions
+static ULONGLONG RunProgram(LPEMULATOR emulator, ULONGLONG slice)
+{
+	ULONGLONG retired = 0;
+	ULONGLONG count;
+
+	do
+	{
+		count = RunEmulator(emulator, slice);
+		retired += count;
+	}
+	while(slice && count && !emulator->halted);
+
+	return retired;
+}
+
+// Prints the first difference between the state of the reference and the one of the mode, returns FALSE if there is one
+static BOOL CompareEmulators(LPCSTR name, LPCSTR mode, LPEMULATOR reference, ULONGLONG expected, LPEMULATOR emulator, ULONGLONG retired)
+{
+	ULONG index;
+
+	if(emulator->exception != reference->exception)
+	{
+		printf("FAIL %s (%s): exception %0#8x instead of %0#8x\n", name, mode, emulator->exception, reference->exception);
+		return FALSE;
+	}
+
+	for(index = 0; index < EMULATOR_REGISTERS; ++index)
+	{
+		if(emulator->registers[index] != reference->registers[index])
+		{
+			printf("FAIL %s (%s): register %u is %0#8x instead of %0#8x\n", name, mode, index, emulator->registers[index], reference->registers[index]);
+			return FALSE;
+		}
+	}
+
+	for(index = 0; index < DIFFERENTIAL_MEMORY; ++index)
+	{
+		if(emulator->memory[index] != reference->memory[index])
+		{
+			printf("FAIL %s (%s): word %u is %0#8x instead of %0#8x\n", name, mode, index, emulator->memory[index], reference->memory[index]);
+			return FALSE;
+		}
+	}
+
+	if(emulator->output.used != reference->output.used || memcmp(emulator->output.buffer, reference->output.buffer, reference->output.used))
+	{
+		printf("FAIL %s (%s): the output differs\n", name, mode);
+		return FALSE;
+	}
+
+	if(retired != expected)
+	{
+		printf("FAIL %s (%s): %llu instructions retired instead of %llu\n", name, mode, retired, expected);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Runs one program of the corpus in every mode, returns the number of modes that differ from single stepping
+static ULONG TestProgram(LPCSTR path, LPCSTR name)
+{
+	EMULATOR reference;
+	EMULATOR emulator;
+	HANDLE input;
+	HANDLE handle;
+	ULONGLONG expected;
+	ULONGLONG retired;
+	ULONG failures = 0;
+	ULONG index;
+
+	input = OpenInput(path);
+	if(input == INVALID_HANDLE_VALUE)
+	{
+		printf("FAIL %s: the input can't be opened\n", name);
+		return _countof(modes);
+	}
+
+	if(!LoadProgram(&reference, path, 0, input))
+	{
+		CloseHandle(input);
+
+		printf("FAIL %s: the program can't be loaded\n", name);
+		return _countof(modes);
+	}
+
+	expected = StepProgram(&reference);
+
+	for(index = 0; index < _countof(modes); ++index)
+	{
+		handle = OpenInput(path);
+		if(handle == INVALID_HANDLE_VALUE || !LoadProgram(&emulator, path, modes[index].flags, handle))
+		{
+			if(handle != INVALID_HANDLE_VALUE)
+				CloseHandle(handle);
+
+			printf("FAIL %s (%s): the program can't be loaded\n", name, modes[index].name);
+
+			++failures;
+			continue;
+		}
+
+		retired = RunProgram(&emulator, modes[index].slice);
+
+		if(!CompareEmulators(name, modes[index].name, &reference, expected, &emulator, retired))
+			++failures;
+
+		UninitializeEmulator(&emulator);
+		CloseHandle(handle);
+	}
+
+	if(!failures)
+		printf("PASS %s: exception %0#8x at %0#8x, %llu instructions retired\n", name, reference.exception, reference.registers[EMULATOR_REGISTER_PROGRAM_COUNTER], expected);
+
+	UninitializeEmulator(&reference);
+	CloseHandle(input);
+
+	return failures;
+}
+
+int main(int argc, const char** argv)
+{
+	WIN32_FIND_DATA data;
+	CHAR pattern[MAX_PATH];
+	CHAR path[MAX_PATH];
+	LPCSTR directory = ".";
+	HANDLE find;
+	ULONG programs = 0;
+	ULONG failures = 0;
+
+	if(argc > 2)
+	{
+		fprintf(stderr, "Usage: Differential [directory]\n");
+		return 1;
+	}
+
+	if(argc > 1)
+		directory = argv[1];
+
+	_snprintf(pattern, sizeof(pattern), "%s\\*.pasm", directory);
+
+	find = FindFirstFile(pattern, &data);
+	if(find == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "No programs found in '%s'.\n", directory);
+		return 1;
+	}
+
+	do
+	{
+		_snprintf(path, sizeof(path), "%s\\%s", directory, data.cFileName);
+
+		failures += TestProgram(path, data.cFileName);
+		++programs;
+	}
+	while(FindNextFile(find, &data));
+
+	FindClose(find);
+
+	printf("%u programs, %u failures\n", programs, failures);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../Emulator.h"
+
+// Runs every program of the corpus halfway, snapshots it and checks that the emulator and its clones get back to the
+// state of the snapshot: the program runs to the end, is restored and checked against the snapshot, then it is cloned,
+// runs to the end again before the clone did anything and the clone is checked against the snapshot, and finally the
+// clone runs to the end and is checked against a run of the program without any snapshot. Every program reads from the
+// null device, so a run after a restore reads the same input as the first one.
+
+#define SNAPSHOT_MEMORY EMULATOR_DEFAULT_MEMORY	// Memory size of the emulators in words, the fault programs depend on it
+
+// Emulator flags the programs are tested with
+typedef struct
+{
+	LPCSTR name;
+	ULONG flags;
+} MODE;
+
+static const MODE modes[] =
+{
+	{"interpreter",	0},
+	{"sparse",		EMULATOR_FLAG_SPARSE},
+	{"jit",			EMULATOR_FLAG_JIT},
+};
+
+// State of an emulator the others are checked against
+typedef struct
+{
+	ULONG exception;
+	ULONG registers[EMULATOR_REGISTERS];
+	ULONG memory[SNAPSHOT_MEMORY];
+} STATE,*LPSTATE;
+
+// Loads a program into a new emulator that reads from the null device and collects its output
+static BOOL LoadProgram(LPEMULATOR emulator, LPCSTR path, ULONG flags, HANDLE input)
+{
+	if(!InitializeEmulatorEx(emulator, SNAPSHOT_MEMORY, flags))
+	{
+		fprintf(stderr, "Failed to initialize the emulation engine.\n");
+		return FALSE;
+	}
+
+	SetEmulatorInput(emulator, input);
+
+	if(!SetEmulatorOutput(emulator, NULL) || !LoadProgramFromSourceFile(emulator, path))
+	{
+		fprintf(stderr, "Failed to load the program '%s'. Error %0#8x.\n", path, emulator->error);
+
+		UninitializeEmulator(emulator);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static VOID SaveState(LPEMULATOR emulator, LPSTATE state)
+{
+	state->exception = emulator->exception;
+	CopyMemory(state->registers, emulator->registers, sizeof(state->registers));
+	CopyMemory(state->memory, emulator->memory, sizeof(state->memory));
+}
+
+// Prints the first difference between the state and the one of the emulator, returns FALSE if there is one
+static BOOL CompareState(LPCSTR name, LPCSTR mode, LPCSTR step, LPSTATE state, LPEMULATOR emulator)
+{
+	ULONG index;
+
+	if(emulator->exception != state->exception)
+	{
+		printf("FAIL %s (%s, %s): exception %0#8x instead of %0#8x\n", name, mode, step, emulator->exception, state->exception);
+		return FALSE;
+	}
+
+	for(index = 0; index < EMULATOR_REGISTERS; ++index)
+	{
+		if(emulator->registers[index] != state->registers[index])
+		{
+			printf("FAIL %s (%s, %s): register %u is %0#8x instead of %0#8x\n", name, mode, step, index, emulator->registers[index], state->registers[index]);
+			return FALSE;
+		}
+	}
+
+	for(index = 0; index < SNAPSHOT_MEMORY; ++index)
+	{
+		if(emulator->memory[index] != state->memory[index])
+		{
+			printf("FAIL %s (%s, %s): word %u is %0#8x instead of %0#8x\n", name, mode, step, index, emulator->memory[index], state->memory[index]);
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+// Snapshots, restores and clones the program in one mode, returns FALSE if a state differs
+static BOOL TestMode(LPCSTR path, LPCSTR name, const MODE* mode, HANDLE input, ULONGLONG retired, LPSTATE final, LPSTATE saved)
+{
+	EMULATOR emulator;
+	EMULATOR clone;
+	LPSNAPSHOT snapshot;
+	BOOL result = FALSE;
+
+	if(!LoadProgram(&emulator, path, mode->flags, input))
+	{
+		printf("FAIL %s (%s): the program can't be loaded\n", name, mode->name);
+		return FALSE;
+	}
+
+	// A program that retires a single instruction is snapshot before it ran
+	if(retired / 2)
+		RunEmulator(&emulator, retired / 2);
+
+	SaveState(&emulator, saved);
+
+	snapshot = SnapshotEmulator(&emulator);
+	if(!snapshot)
+	{
+		printf("FAIL %s (%s): the snapshot can't be taken\n", name, mode->name);
+
+		UninitializeEmulator(&emulator);
+		return FALSE;
+	}
+
+	RunEmulator(&emulator, 0);
+
+	if(!CompareState(name, mode->name, "run", final, &emulator))
+		goto cleanup;
+
+	if(!RestoreEmulator(&emulator, snapshot))
+	{
+		printf("FAIL %s (%s): the snapshot can't be restored\n", name, mode->name);
+		goto cleanup;
+	}
+
+	if(!CompareState(name, mode->name, "restore", saved, &emulator))
+		goto cleanup;
+
+	if(!CloneEmulator(&emulator, &clone))
+	{
+		printf("FAIL %s (%s): the emulator can't be cloned\n", name, mode->name);
+		goto cleanup;
+	}
+
+	SetEmulatorInput(&clone, input);
+	SetEmulatorOutput(&clone, NULL);
+
+	// The emulator writes its pages before the clone first accessed them
+	RunEmulator(&emulator, 0);
+
+	result = CompareState(name, mode->name, "rerun", final, &emulator) && CompareState(name, mode->name, "clone", saved, &clone);
+
+	if(result)
+	{
+		RunEmulator(&clone, 0);
+		result = CompareState(name, mode->name, "clone run", final, &clone);
+	}
+
+	UninitializeEmulator(&clone);
+
+cleanup:
+	ReleaseSnapshot(snapshot);
+	UninitializeEmulator(&emulator);
+
+	return result;
+}
+
+// Tests one program of the corpus in every mode, returns the number of modes that failed
+static ULONG TestProgram(LPCSTR path, LPCSTR name, HANDLE input, LPSTATE final, LPSTATE saved)
+{
+	EMULATOR reference;
+	ULONGLONG retired;
+	ULONG failures = 0;
+	ULONG index;
+
+	if(!LoadProgram(&reference, path, 0, input))
+	{
+		printf("FAIL %s: the program can't be loaded\n", name);
+		return _countof(modes);
+	}
+
+	retired = RunEmulator(&reference, 0);
+	SaveState(&reference, final);
+
+	UninitializeEmulator(&reference);
+
+	for(index = 0; index < _countof(modes); ++index)
+	{
+		if(!TestMode(path, name, &modes[index], input, retired, final, saved))
+			++failures;
+	}
+
+	if(!failures)
+		printf("PASS %s: snapshot after %llu of %llu instructions\n", name, retired / 2, retired);
+
+	return failures;
+}
+
+int main(int argc, const char** argv)
+{
+	WIN32_FIND_DATA data;
+	CHAR pattern[MAX_PATH];
+	CHAR path[MAX_PATH];
+	LPCSTR directory = ".";
+	LPSTATE states;
+	HANDLE find;
+	HANDLE input;
+	ULONG programs = 0;
+	ULONG failures = 0;
+
+	if(argc > 2)
+	{
+		fprintf(stderr, "Usage: Snapshot [directory]\n");
+		return 1;
+	}
+
+	if(argc > 1)
+		directory = argv[1];
+
+	// The state at the end of the program and the one of the snapshot
+	states = HeapAlloc(GetProcessHeap(), 0, 2 * sizeof(STATE));
+	if(!states)
+	{
+		fprintf(stderr, "Not enough memory.\n");
+		return 1;
+	}
+
+	input = CreateFile("NUL", GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if(input == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "The null device can't be opened.\n");
+
+		HeapFree(GetProcessHeap(), 0, states);
+		return 1;
+	}
+
+	_snprintf(pattern, sizeof(pattern), "%s\\*.pasm", directory);
+
+	find = FindFirstFile(pattern, &data);
+	if(find == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "No programs found in '%s'.\n", directory);
+
+		CloseHandle(input);
+		HeapFree(GetProcessHeap(), 0, states);
+		return 1;
+	}
+
+	do
+	{
+		_snprintf(path, sizeof(path), "%s\\%s", directory, data.cFileName);
+
+		failures += TestProgram(path, data.cFileName, input, &states[0], &states[1]);
+		++programs;
+	}
+	while(FindNextFile(find, &data));
+
+	FindClose(find);
+	CloseHandle(input);
+	HeapFree(GetProcessHeap(), 0, states);
+
+	printf("%u programs, %u failures\n", programs, failures);
+
+	return failures ? 1 : 0;
+}
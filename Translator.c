@@ -0,0 +1,438 @@
+#include "Emulator.h"
+
+#include <stdio.h>
+
+// Names used for the exception codes in the generated source
+static LPCSTR exceptions[] =
+{
+	"EXCEPTION_NONE",					// EMULATOR_EXCEPTION_NONE
+	"EXCEPTION_INVALID_INSTRUCTION",	// EMULATOR_EXCEPTION_INVALID_INSTRUCTION
+	"EXCEPTION_ACCESS_VIOLATION",		// EMULATOR_EXCEPTION_ACCESS_VIOLATION
+};
+
+// Writes the C expression of a register, address or constant argument into text, returns the exception the argument raises
+// (address arguments are checked here since their address is known at translation time)
+static ULONG TranslateArgument(LPEMULATOR emulator, LPINSTRUCTION instruction, ULONG index, LPSTR text)
+{
+	switch(instruction->types[index])
+	{
+	case ARGUMENT_REGISTER:
+		sprintf(text, "registers[%u]", instruction->arguments[index]);
+		return EMULATOR_EXCEPTION_NONE;
+
+	case ARGUMENT_ADDRESS:
+		if(!IsValidAddressRead(emulator, instruction->arguments[index], 1))
+			return EMULATOR_EXCEPTION_ACCESS_VIOLATION;
+
+		sprintf(text, "memory[%u]", instruction->arguments[index]);
+		return EMULATOR_EXCEPTION_NONE;
+
+	case ARGUMENT_CONSTANT:
+		sprintf(text, "0x%08X", instruction->arguments[index]);
+		return EMULATOR_EXCEPTION_NONE;
+	}
+
+	return EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+}
+
+// Writes the C expression of a register or constant argument into text
+static ULONG TranslateArgumentImmediate(LPINSTRUCTION instruction, ULONG index, LPSTR text)
+{
+	if(instruction->types[index] == ARGUMENT_REGISTER)
+		sprintf(text, "registers[%u]", instruction->arguments[index]);
+	else if(instruction->types[index] == ARGUMENT_CONSTANT)
+		sprintf(text, "0x%08X", instruction->arguments[index]);
+	else
+		return EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+
+	return EMULATOR_EXCEPTION_NONE;
+}
+
+// Writes the C expression of a register, constant or character argument of a bulk memory instruction into text
+static ULONG TranslateArgumentBulk(LPINSTRUCTION instruction, ULONG index, LPSTR text)
+{
+	if(instruction->types[index] == ARGUMENT_CHARACTER)
+	{
+		sprintf(text, "0x%08X", instruction->arguments[index]);
+		return EMULATOR_EXCEPTION_NONE;
+	}
+
+	return TranslateArgumentImmediate(instruction, index, text);
+}
+
+// Emits the C statements of the instruction at address, the checks and their order follow the ExecuteInstruction* executors
+static VOID TranslateInstruction(FILE* file, LPEMULATOR emulator, ULONG address)
+{
+	LPINSTRUCTION instruction = &emulator->code[address];
+	CHAR values[3][EMULATOR_COMMAND_ARGUMENT];
+	ULONG exception = EMULATOR_EXCEPTION_NONE;
+
+	// Instructions naming the program counter or stack pointer register see the program counter in the register file
+	// and leave through the dispatcher, all others fall through to the next instruction
+	BOOL dynamic = (instruction->type & INSTRUCTION_FLAG_REGISTERS) != 0;
+
+	fprintf(file, "i%u:\n", address);
+
+	if(dynamic)
+		fprintf(file, "\tregisters[PROGRAM_COUNTER] = %u;\n", address);
+
+	switch(GetUnfusedType(INSTRUCTION_TYPE(instruction)))
+	{
+	case INSTRUCTION_JUMP:
+		if(instruction->types[0] == ARGUMENT_ADDRESS)
+		{
+			if(!IsValidAddressExecute(emulator, instruction->arguments[0]))
+				exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+			else
+				fprintf(file, "\tgoto i%u;\n", instruction->arguments[0]);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+		{
+			fprintf(file, "\tif(registers[%u] >= INSTRUCTIONS)\n\t\tRAISE(%u, EXCEPTION_INVALID_INSTRUCTION);\n", instruction->arguments[0], address);
+			fprintf(file, "\tregisters[PROGRAM_COUNTER] = registers[%u];\n\tgoto dispatch;\n", instruction->arguments[0]);
+		}
+		else
+			fprintf(file, "\tgoto i%u;\n", address);	// The executor leaves the program counter unchanged
+
+		break;
+
+	case INSTRUCTION_COND:
+		if(instruction->types[0] == ARGUMENT_ADDRESS)
+		{
+			if(instruction->arguments[0] >= emulator->capacity)
+				exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+			else
+				fprintf(file, "\tif(memory[%u])\n\t\tgoto i%u;\n", instruction->arguments[0], address + 2);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+		{
+			if(dynamic)
+				fprintf(file, "\tif(registers[%u])\n\t\t++registers[PROGRAM_COUNTER];\n", instruction->arguments[0]);
+			else
+				fprintf(file, "\tif(registers[%u])\n\t\tgoto i%u;\n", instruction->arguments[0], address + 2);
+		}
+
+		break;
+
+	case INSTRUCTION_MOVE:
+		if(instruction->types[0] == ARGUMENT_ADDRESS)
+		{
+			if(!IsValidAddressWrite(emulator, instruction->arguments[0], 1))
+				exception = EMULATOR_EXCEPTION_ACCESS_VIOLATION;
+			else if(!(exception = TranslateArgument(emulator, instruction, 1, values[0])))
+				fprintf(file, "\tmemory[%u] = %s;\n", instruction->arguments[0], values[0]);
+		}
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+		{
+			if(!(exception = TranslateArgument(emulator, instruction, 1, values[0])))
+				fprintf(file, "\tregisters[%u] = %s;\n", instruction->arguments[0], values[0]);
+		}
+		else
+			exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+
+		break;
+
+	case INSTRUCTION_ADD:
+	case INSTRUCTION_SUB:
+		if(!(exception = TranslateArgument(emulator, instruction, 1, values[0])) && !(exception = TranslateArgument(emulator, instruction, 2, values[1])))
+			fprintf(file, "\tregisters[%u] = %s %c %s;\n", instruction->arguments[0], values[0], GetUnfusedType(INSTRUCTION_TYPE(instruction)) == INSTRUCTION_ADD ? '+' : '-', values[1]);
+
+		break;
+
+	case INSTRUCTION_WRITE:
+		if(instruction->types[0] == ARGUMENT_CHARACTER || instruction->types[0] == ARGUMENT_CONSTANT)
+			fprintf(file, "\tWrite(0x%08X);\n", instruction->arguments[0]);
+		else if(instruction->types[0] == ARGUMENT_REGISTER)
+			fprintf(file, "\tWrite(registers[%u]);\n", instruction->arguments[0]);
+		else
+			exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+
+		break;
+
+	case INSTRUCTION_READ:
+		if(instruction->types[0] == ARGUMENT_REGISTER)
+			fprintf(file, "\tRead(&registers[%u]);\n", instruction->arguments[0]);
+		else
+			exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+
+		break;
+
+	case INSTRUCTION_LOAD:
+		if(instruction->types[1] == ARGUMENT_CONSTANT)
+		{
+			if(!IsValidAddressRead(emulator, instruction->arguments[1], 1))
+				exception = EMULATOR_EXCEPTION_ACCESS_VIOLATION;
+			else
+				fprintf(file, "\tregisters[%u] = memory[%u];\n", instruction->arguments[0], instruction->arguments[1]);
+		}
+		else if(instruction->types[1] == ARGUMENT_REGISTER)
+		{
+			fprintf(file, "\taddress = registers[%u];\n", instruction->arguments[1]);
+			fprintf(file, "\tif(!READABLE(address))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", address);
+			fprintf(file, "\tregisters[%u] = memory[address];\n", instruction->arguments[0]);
+		}
+		else
+			exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+
+		break;
+
+	case INSTRUCTION_STORE:
+		if(instruction->types[0] != ARGUMENT_REGISTER && instruction->types[0] != ARGUMENT_CONSTANT)
+			exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+		else if(!(exception = TranslateArgumentImmediate(instruction, 1, values[0])))
+		{
+			if(instruction->types[0] == ARGUMENT_CONSTANT)
+			{
+				if(!IsValidAddressWrite(emulator, instruction->arguments[0], 1))
+					exception = EMULATOR_EXCEPTION_ACCESS_VIOLATION;
+				else
+					fprintf(file, "\tmemory[%u] = %s;\n", instruction->arguments[0], values[0]);
+			}
+			else
+			{
+				fprintf(file, "\taddress = registers[%u];\n", instruction->arguments[0]);
+				fprintf(file, "\tif(!WRITABLE(address))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", address);
+				fprintf(file, "\tmemory[address] = %s;\n", values[0]);
+			}
+		}
+
+		break;
+
+	case INSTRUCTION_PUSH:
+		fprintf(file, "\tif(!WRITABLE(registers[STACK_POINTER]))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", address);
+
+		if(!(exception = TranslateArgumentImmediate(instruction, 0, values[0])))
+			fprintf(file, "\tmemory[registers[STACK_POINTER]] = %s;\n\t++registers[STACK_POINTER];\n", values[0]);
+
+		break;
+
+	case INSTRUCTION_POP:
+		fprintf(file, "\tif(!READABLE(registers[STACK_POINTER] - 1))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", address);
+		fprintf(file, "\tregisters[%u] = memory[registers[STACK_POINTER] - 1];\n\t--registers[STACK_POINTER];\n", instruction->arguments[0]);
+		break;
+
+	case INSTRUCTION_BREAK:
+		fprintf(file, "\tRAISE(%u, EXCEPTION_NONE);\n", address);
+		return;
+
+	case INSTRUCTION_MEMCPY:
+	case INSTRUCTION_MEMSET:
+		if(!(exception = TranslateArgumentBulk(instruction, 0, values[0])) && !(exception = TranslateArgumentBulk(instruction, 1, values[1])) && !(exception = TranslateArgumentBulk(instruction, 2, values[2])))
+		{
+			fprintf(file, "\taddress = %s;\n\tlength = %s;\n", values[0], values[2]);
+
+			if(GetUnfusedType(INSTRUCTION_TYPE(instruction)) == INSTRUCTION_MEMCPY)
+			{
+				fprintf(file, "\tif(!RANGE(address, length) || !RANGE(%s, length))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", values[1], address);
+				fprintf(file, "\tCopy(address, %s, length);\n", values[1]);
+			}
+			else
+			{
+				fprintf(file, "\tif(!RANGE(address, length))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", address);
+				fprintf(file, "\tFill(address, %s, length);\n", values[1]);
+			}
+		}
+
+		break;
+
+	case INSTRUCTION_MEMCMP:
+		if(!(exception = TranslateArgumentBulk(instruction, 1, values[0])) && !(exception = TranslateArgumentBulk(instruction, 2, values[1])))
+		{
+			fprintf(file, "\taddress = %s;\n\tlength = registers[%u];\n", values[0], instruction->arguments[0]);
+			fprintf(file, "\tif(!RANGE(address, length) || !RANGE(%s, length))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", values[1], address);
+			fprintf(file, "\tregisters[%u] = Compare(address, %s, length);\n", instruction->arguments[0], values[1]);
+		}
+
+		break;
+
+	case INSTRUCTION_MEMCHR:
+		if(!(exception = TranslateArgumentBulk(instruction, 1, values[0])) && !(exception = TranslateArgumentBulk(instruction, 2, values[1])))
+		{
+			fprintf(file, "\tif(!Scan(%s, %s, &registers[%u]))\n\t\tRAISE(%u, EXCEPTION_ACCESS_VIOLATION);\n", values[0], values[1], instruction->arguments[0], address);
+		}
+
+		break;
+
+	default:
+		exception = EMULATOR_EXCEPTION_INVALID_INSTRUCTION;
+		break;
+	}
+
+	if(exception != EMULATOR_EXCEPTION_NONE)
+	{
+		fprintf(file, "\tRAISE(%u, %s);\n", address, exceptions[exception]);
+		return;
+	}
+
+	if(dynamic)
+		fprintf(file, "\t++registers[PROGRAM_COUNTER];\n\tgoto dispatch;\n");
+}
+
+BOOL TranslateProgramToFile(LPEMULATOR emulator, LPCSTR path)
+{
+	FILE* file;
+	ULONG address;
+	ULONG length;
+	ULONG index;
+	ULONG end;
+	BOOL committed;
+
+	file = fopen(path, "wt");
+	if(!file)
+	{
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_OPEN);
+		return FALSE;
+	}
+
+	fprintf(file, "// Generated by the emulator translator, every guest instruction is translated into the C statements of its executor\n\n");
+	fprintf(file, "#include <windows.h>\n#include <stdio.h>\n\n");
+
+	fprintf(file, "#define CAPACITY %u\n", emulator->capacity);
+	fprintf(file, "#define INSTRUCTIONS %u\n\n", emulator->instructions);
+
+	fprintf(file, "#define PROGRAM_COUNTER %u\n", EMULATOR_REGISTER_PROGRAM_COUNTER);
+	fprintf(file, "#define STACK_POINTER %u\n\n", EMULATOR_REGISTER_STACK_POINTER);
+
+	fprintf(file, "#define EXCEPTION_NONE %u\n", EMULATOR_EXCEPTION_NONE);
+	fprintf(file, "#define EXCEPTION_INVALID_INSTRUCTION %u\n", EMULATOR_EXCEPTION_INVALID_INSTRUCTION);
+	fprintf(file, "#define EXCEPTION_ACCESS_VIOLATION %u\n\n", EMULATOR_EXCEPTION_ACCESS_VIOLATION);
+
+	fprintf(file, "// Same checks as IsValidAddressRead/IsValidAddressWrite with a range of one word\n");
+	fprintf(file, "#define READABLE(address) ((address) < CAPACITY)\n");
+	fprintf(file, "#define WRITABLE(address) ((address) < CAPACITY)\n\n");
+
+	fprintf(file, "// Same checks as the bulk memory executors, a zero length accesses nothing\n");
+	fprintf(file, "#define RANGE(address, length) (!(length) || ((address) < CAPACITY && (length) <= CAPACITY - (address)))\n\n");
+
+	fprintf(file, "// Stops the program at the instruction at address\n");
+	fprintf(file, "#define RAISE(address, code) { registers[PROGRAM_COUNTER] = (address); exception = (code); goto leave; }\n\n");
+
+	// Large memories don't fit into the image of the program, the memory is allocated when it starts
+	fprintf(file, "static PULONG memory;\n\n");
+
+	// Pre-initialized memory as runs of address, length and words
+	fprintf(file, "static const ULONG data[] =\n{\n");
+
+	for(address = 0; address < emulator->capacity; address = end)
+	{
+		// Pages of sparse memory that were never committed hold zeroes
+		end = address + GetEmulatorMemorySpan(emulator, address, &committed);
+		if(!committed)
+			continue;
+
+		for(; address < end; address += length)
+		{
+			if(!emulator->memory[address])
+			{
+				length = 1;
+				continue;
+			}
+
+			for(length = 0; address + length < end && emulator->memory[address + length]; ++length);
+
+			fprintf(file, "\t%u, %u,", address, length);
+			for(index = 0; index < length; ++index)
+				fprintf(file, "%s0x%08X,", index % 8 ? " " : "\n\t\t", emulator->memory[address + index]);
+
+			fprintf(file, "\n");
+		}
+	}
+
+	fprintf(file, "\t0, 0,\n};\n\n");
+
+	// Guest output and input, buffered the way WriteEmulatorOutput, FlushEmulatorOutput and ReadEmulatorInput buffer them
+	fprintf(file, "static BYTE output[%u];\nstatic ULONG used;\nstatic BOOL console;\n\n", EMULATOR_OUTPUT_BUFFER);
+	fprintf(file, "static BYTE input[%u];\nstatic ULONG head;\nstatic ULONG tail;\nstatic BOOL end;\n", EMULATOR_INPUT_BUFFER);
+	fprintf(file, "static BOOL opened;\nstatic BOOL terminal;\nstatic BOOL raw;\nstatic ULONG restore;\n\n");
+
+	fprintf(file, "static VOID Flush(VOID)\n{\n\tULONG written;\n\tULONG offset;\n\n");
+	fprintf(file, "\tfor(offset = 0; offset < used; offset += written)\n\t{\n");
+	fprintf(file, "\t\tif(!WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), output + offset, used - offset, &written, NULL) || !written)\n\t\t\tbreak;\n\t}\n\n");
+	fprintf(file, "\tused = 0;\n}\n\n");
+
+	// Redirected output is only written when the buffer is full, console output also at every newline
+	fprintf(file, "static VOID Write(ULONG value)\n{\n");
+	fprintf(file, "\toutput[used++] = (BYTE)value;\n\n");
+	fprintf(file, "\tif(used == sizeof(output) || ((CHAR)value == '\\n' && console))\n\t\tFlush();\n}\n\n");
+
+	// A console is switched to unbuffered input without echo for the whole run, at the end of redirected input the
+	// register is left unchanged
+	fprintf(file, "static VOID Read(PULONG value)\n{\n\tULONG read;\n\tBOOL result;\n\n");
+	fprintf(file, "\tFlush();\n\n");
+	fprintf(file, "\tif(!opened)\n\t{\n\t\topened = TRUE;\n");
+	fprintf(file, "\t\tterminal = GetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), &restore);\n");
+	fprintf(file, "\t\tif(terminal)\n\t\t\traw = SetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), restore & ~ENABLE_LINE_INPUT & ~ENABLE_ECHO_INPUT);\n\t}\n\n");
+	fprintf(file, "\tif(head == tail)\n\t{\n\t\tif(end)\n\t\t\treturn;\n\n");
+	fprintf(file, "\t\tif(terminal)\n\t\t\tresult = ReadConsole(GetStdHandle(STD_INPUT_HANDLE), input, sizeof(input), &read, NULL);\n");
+	fprintf(file, "\t\telse\n\t\t\tresult = ReadFile(GetStdHandle(STD_INPUT_HANDLE), input, sizeof(input), &read, NULL);\n\n");
+	fprintf(file, "\t\tif(!result || !read)\n\t\t{\n\t\t\tend = !terminal;\n\t\t\treturn;\n\t\t}\n\n");
+	fprintf(file, "\t\thead = 0;\n\t\ttail = read;\n\t}\n\n");
+	fprintf(file, "\t*(LPBYTE)value = input[head++];\n}\n\n");
+
+	// Bulk memory instructions, the C compiler vectorizes the loops
+	fprintf(file, "static VOID Copy(ULONG destination, ULONG source, ULONG length)\n{\n");
+	fprintf(file, "\tif(length)\n\t\tMoveMemory(&memory[destination], &memory[source], length * sizeof(ULONG));\n}\n\n");
+
+	fprintf(file, "static VOID Fill(ULONG destination, ULONG value, ULONG length)\n{\n\tULONG index;\n\n");
+	fprintf(file, "\tfor(index = 0; index < length; ++index)\n\t\tmemory[destination + index] = value;\n}\n\n");
+
+	fprintf(file, "static ULONG Compare(ULONG first, ULONG second, ULONG length)\n{\n\tULONG index;\n\n");
+	fprintf(file, "\tfor(index = 0; index < length; ++index)\n\t\tif(memory[first + index] != memory[second + index])\n");
+	fprintf(file, "\t\t\treturn memory[first + index] > memory[second + index] ? 1 : 0xFFFFFFFF;\n\n\treturn 0;\n}\n\n");
+
+	// Only reads up to the match like the executor, a scan running past the end of the memory faults
+	fprintf(file, "static BOOL Scan(ULONG address, ULONG value, PULONG length)\n{\n\tULONG index;\n\n");
+	fprintf(file, "\tfor(index = 0; index < *length; ++index)\n\t{\n");
+	fprintf(file, "\t\tif(!READABLE(address + index))\n\t\t\treturn FALSE;\n\n");
+	fprintf(file, "\t\tif(memory[address + index] == value)\n\t\t\tbreak;\n\t}\n\n");
+	fprintf(file, "\t*length = index;\n\treturn TRUE;\n}\n\n");
+
+	fprintf(file, "int main()\n{\n");
+	fprintf(file, "\tULONG registers[%u] = {", EMULATOR_REGISTERS);
+	for(index = 0; index < EMULATOR_REGISTERS; ++index)
+		fprintf(file, "%s%u", index ? ", " : "", emulator->registers[index]);
+	fprintf(file, "};\n");
+	fprintf(file, "\tULONG exception = EXCEPTION_NONE;\n\tULONG address;\n\tULONG length;\n\tULONG index;\n\tULONG mode;\n\n");
+
+	fprintf(file, "\tmemory = VirtualAlloc(NULL, (SIZE_T)CAPACITY * sizeof(ULONG), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);\n");
+	fprintf(file, "\tif(!memory)\n\t{\n\t\tprintf(\"Failed to allocate the memory.\\n\");\n\t\treturn 1;\n\t}\n\n");
+
+	fprintf(file, "\tconsole = GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &mode);\n\n");
+
+	fprintf(file, "\tfor(index = 0; data[index + 1]; index += 2 + data[index + 1])\n");
+	fprintf(file, "\t\tCopyMemory(&memory[data[index]], &data[index + 2], data[index + 1] * sizeof(ULONG));\n\n");
+
+	fprintf(file, "\tgoto dispatch;\n\n");
+
+	for(address = 0; address < emulator->instructions; ++address)
+		TranslateInstruction(file, emulator, address);
+
+	// The program counter ran off the end of the code (COND can skip one past it)
+	fprintf(file, "i%u:\n\tRAISE(%u, EXCEPTION_INVALID_INSTRUCTION);\n", emulator->instructions, emulator->instructions);
+	fprintf(file, "i%u:\n\tRAISE(%u, EXCEPTION_INVALID_INSTRUCTION);\n\n", emulator->instructions + 1, emulator->instructions + 1);
+
+	// Indirect control transfers
+	fprintf(file, "dispatch:\n\tswitch(registers[PROGRAM_COUNTER])\n\t{\n");
+	for(address = 0; address < emulator->instructions; ++address)
+		fprintf(file, "\tcase %u: goto i%u;\n", address, address);
+	fprintf(file, "\t}\n\n\texception = EXCEPTION_INVALID_INSTRUCTION;\n\n");
+
+	fprintf(file, "leave:\n");
+	fprintf(file, "\tFlush();\n\n");
+	fprintf(file, "\tif(raw)\n\t\tSetConsoleMode(GetStdHandle(STD_INPUT_HANDLE), restore);\n\n");
+	fprintf(file, "\tif(exception != EXCEPTION_NONE)\n");
+	fprintf(file, "\t\tprintf(\"Exception %%0#8x occured at address %%0#8x. Program terminated.\\n\", exception, registers[PROGRAM_COUNTER]);\n\n");
+	fprintf(file, "\treturn 0;\n}\n");
+
+	if(ferror(file))
+	{
+		fclose(file);
+		DeleteFile(path);
+
+		SetEmulatorError(emulator, EMULATOR_ERROR_FILE_WRITE);
+		return FALSE;
+	}
+
+	fclose(file);
+	return TRUE;
+}